@@ -0,0 +1,904 @@
+// mp3bench.cpp : synthetic corpus generator and benchmark for the tools
+//
+// Copyright (c) 2010, Reiji Tokuda
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+// IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+// EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../mp3scan/mp3scan.h"
+
+///////////////////////////////////////
+
+#define MP3_BENCH_BUFFER (1024 * 1024)// generator write buffer
+#define MP3_BENCH_DEFAULT_SIZE (16ULL * 1024 * 1024)
+#define MP3_BENCH_JUNK_INTERVAL 2000// frames between injected junk
+#define MP3_BENCH_JUNK_MAX 4096
+#define MP3_BENCH_APIC_MAX (32 * 1024 * 1024)
+#define MP3_BENCH_APE_ITEM 4096
+#define MP3_BENCH_PATH 1024
+
+/**
+ * corpus
+ *
+ * Every profile is a stream of valid headers with random payloads, so
+ * the tools walk it like real audio without any decoder involved.
+ */
+typedef enum mp3_bench_profile_tag {
+    MP3_BENCH_CBR = 0,// MPEG-1 Layer III 128 kbit/s
+    MP3_BENCH_VBR = 1,// MPEG-1 Layer III, bitrate per frame
+    MP3_BENCH_MPEG25 = 2,// MPEG-2.5 Layer III 11025 Hz, VBR
+    MP3_BENCH_CRC = 3,// protected frames with a valid CRC-16
+    MP3_BENCH_APIC = 4,// ID3v2 with a large APIC frame
+    MP3_BENCH_TAGS = 5,// APEv2 and ID3v1 trailers
+    MP3_BENCH_CORRUPT = 6,// junk injected between frames
+    MP3_BENCH_PROFILES = 7,
+} mp3_bench_profile;
+
+static const char* profile_string[] =
+{
+    "cbr",
+    "vbr",
+    "mpeg25",
+    "crc",
+    "apic",
+    "tags",
+    "corrupt",
+};
+
+typedef struct mp3_bench_corpus_tag {
+    mp3_bench_profile profile;
+    char path[MP3_BENCH_PATH];
+    uint64_t size;
+    uint64_t frames;
+} mp3_bench_corpus;
+
+typedef struct mp3_bench_measure_tag {
+    double seconds;
+    uint64_t syscalls;// read and write class calls, UINT64_MAX if unknown
+    uint64_t peak_rss;// KB
+    int status;// exit status, 0:ok
+} mp3_bench_measure;
+
+typedef enum mp3_bench_op_tag {
+    MP3_BENCH_ANALYZE = 0,
+    MP3_BENCH_SKIP = 1,
+    MP3_BENCH_REWRITE = 2,
+} mp3_bench_op;
+
+static const char* op_string[] =
+{
+    "analyze",
+    "skip",
+    "rewrite",
+};
+
+//one timed run : operation and I/O backend
+typedef struct mp3_bench_case_tag {
+    mp3_bench_op op;
+    const char *backend;
+} mp3_bench_case;
+
+static const mp3_bench_case bench_cases[] =
+{
+    {MP3_BENCH_ANALYZE, "stdio"},
+    {MP3_BENCH_ANALYZE, "mmap"},
+    {MP3_BENCH_ANALYZE, "parallel"},
+    {MP3_BENCH_ANALYZE, "stdin"},
+    {MP3_BENCH_SKIP, "fd"},
+    {MP3_BENCH_SKIP, "mmap"},
+    {MP3_BENCH_SKIP, "stream"},
+    {MP3_BENCH_REWRITE, "stdio"},
+    {MP3_BENCH_REWRITE, "zerocopy"},
+    {MP3_BENCH_REWRITE, "in-place"},
+    {MP3_BENCH_REWRITE, "stdin"},
+};
+
+typedef struct mp3_bench_context_tag {
+    const char *dir;// --dir
+    char bin[MP3_BENCH_PATH];// --bin, where the tools are
+    uint64_t size;// --size
+    uint32_t repeat;// --repeat, the fastest run is reported
+    uint32_t profiles;// --profile, bit per profile
+    uint8_t keep;// --keep
+    uint8_t csv;// --csv
+    uint8_t generate_only;// --generate-only
+} mp3_bench_context;
+
+///////////////////////////////////////
+
+static uint64_t
+mp3_bench_random(uint64_t *state);
+
+static int
+mp3_bench_generate(mp3_bench_context *ctx, mp3_bench_corpus *corpus);
+
+static int
+mp3_bench_case_run(mp3_bench_context *ctx, mp3_bench_corpus *corpus, const mp3_bench_case *bench_case, mp3_bench_measure *measure);
+
+static void
+mp3_bench_report(mp3_bench_context *ctx, mp3_bench_corpus *corpus, const mp3_bench_case *bench_case, mp3_bench_measure *measure);
+
+///////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    mp3_bench_context ctx;
+    mp3_bench_corpus corpus;
+    mp3_bench_measure measure;
+    mp3_bench_measure best;
+    const char *slash;
+    int failed = 0;
+
+    //init
+    memset(&ctx, 0x00, sizeof(mp3_bench_context));
+    ctx.dir = "mp3bench.corpus";
+    ctx.size = MP3_BENCH_DEFAULT_SIZE;
+    ctx.repeat = 3;
+    ctx.profiles = (1 << MP3_BENCH_PROFILES) - 1;
+
+    //the tools are built next to the benchmark
+    slash = strrchr(argv[0], '/');
+    if(slash) {
+        if(snprintf(ctx.bin, sizeof(ctx.bin), "%.*s", (int)(slash - argv[0]), argv[0]) >= (int)sizeof(ctx.bin)) {
+            fprintf(stderr, "*error* : path too long : %s\n", argv[0]);
+            return -1;
+        }
+    }
+    else
+        snprintf(ctx.bin, sizeof(ctx.bin), ".");
+
+    //options
+    for(int i = 1; i < argc; i++) {
+        if(0 == strncmp(argv[i], "--dir=", 6)) {
+            ctx.dir = argv[i] + 6;
+        }
+        else if(0 == strncmp(argv[i], "--bin=", 6)) {
+            if(snprintf(ctx.bin, sizeof(ctx.bin), "%s", argv[i] + 6) >= (int)sizeof(ctx.bin)) {
+                fprintf(stderr, "*error* : path too long : %s\n", argv[i] + 6);
+                return -1;
+            }
+        }
+        else if(0 == strncmp(argv[i], "--size=", 7)) {
+            char *unit;
+            ctx.size = strtoull(argv[i] + 7, &unit, 10);
+            if(*unit == 'K' || *unit == 'k')
+                ctx.size <<= 10;
+            else if(*unit == 'M' || *unit == 'm')
+                ctx.size <<= 20;
+            else if(*unit == 'G' || *unit == 'g')
+                ctx.size <<= 30;
+            if(ctx.size < 1024) {
+                fprintf(stderr, "*error* : size must be at least 1K : %s\n", argv[i] + 7);
+                return -1;
+            }
+        }
+        else if(0 == strncmp(argv[i], "--profile=", 10)) {
+            const char *name = argv[i] + 10;
+            ctx.profiles = 0;
+            while(*name) {
+                size_t length = strcspn(name, ",");
+                int profile;
+
+                for(profile = 0; profile < MP3_BENCH_PROFILES; profile++) {
+                    if(strlen(profile_string[profile]) == length &&
+                        0 == strncmp(name, profile_string[profile], length))
+                        break;
+                }
+                if(length == 3 && 0 == strncmp(name, "all", 3))
+                    ctx.profiles = (1 << MP3_BENCH_PROFILES) - 1;
+                else if(profile == MP3_BENCH_PROFILES) {
+                    fprintf(stderr, "*error* : unknown profile : %.*s\n", (int)length, name);
+                    return -1;
+                }
+                else
+                    ctx.profiles |= 1 << profile;
+                name += length;
+                if(*name == ',')
+                    name++;
+            }
+        }
+        else if(0 == strncmp(argv[i], "--repeat=", 9)) {
+            ctx.repeat = (uint32_t)strtoul(argv[i] + 9, NULL, 10);
+            if(ctx.repeat == 0)
+                ctx.repeat = 1;
+        }
+        else if(0 == strcmp(argv[i], "--csv")) {
+            ctx.csv = 1;
+        }
+        else if(0 == strcmp(argv[i], "--keep")) {
+            ctx.keep = 1;
+        }
+        else if(0 == strcmp(argv[i], "--generate-only")) {
+            ctx.generate_only = 1;
+            ctx.keep = 1;
+        }
+        else {
+            fprintf(stderr, "*error* : unknown option : %s\n", argv[i]);
+            fprintf(stderr, "USAGE : [--dir=<dir>] [--size=<n>[K|M|G]] [--profile=<name>[,<name>...]|all] [--repeat=<n>]\n");
+            fprintf(stderr, "        [--bin=<tool dir>] [--csv] [--keep] [--generate-only]\n");
+            fprintf(stderr, "        profiles : cbr vbr mpeg25 crc apic tags corrupt\n");
+            return -1;
+        }
+    }
+
+    if(mkdir(ctx.dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "*error* : corpus directory failed : at %s\n", ctx.dir);
+        return -1;
+    }
+
+    if(ctx.csv)
+        printf("profile,op,backend,bytes,frames,seconds,mb_per_s,frames_per_s,syscalls,peak_rss_kb,status\n");
+    else if(!ctx.generate_only)
+        printf("profile  op       backend      size MB    seconds       MB/s     frames/s   syscalls  peak RSS KB\n");
+
+    for(int profile = 0; profile < MP3_BENCH_PROFILES; profile++) {
+        if(!(ctx.profiles & (1 << profile)))
+            continue;
+
+        memset(&corpus, 0x00, sizeof(mp3_bench_corpus));
+        corpus.profile = (mp3_bench_profile)profile;
+        if(snprintf(corpus.path, sizeof(corpus.path), "%s/%s.mp3", ctx.dir, profile_string[profile]) >= (int)sizeof(corpus.path)) {
+            fprintf(stderr, "*error* : path too long : %s\n", ctx.dir);
+            return -1;
+        }
+
+        if(mp3_bench_generate(&ctx, &corpus)) {
+            fprintf(stderr, "*error* : corpus write failed : at %s\n", corpus.path);
+            return -1;
+        }
+        fprintf(stderr, "generate   : %s   %llu bytes   %llu frames\n",
+            corpus.path, (unsigned long long)corpus.size, (unsigned long long)corpus.frames);//dump
+
+        if(ctx.generate_only)
+            continue;
+
+        for(size_t c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++) {
+            //the editor refuses damaged streams
+            if(bench_cases[c].op == MP3_BENCH_REWRITE && corpus.profile == MP3_BENCH_CORRUPT)
+                continue;
+
+            memset(&best, 0x00, sizeof(best));
+            for(uint32_t r = 0; r < ctx.repeat; r++) {
+                if(mp3_bench_case_run(&ctx, &corpus, &bench_cases[c], &measure))
+                    measure.status = -1;
+                if(r == 0 || measure.status ||
+                    (0 == best.status && measure.seconds < best.seconds))
+                    best = measure;
+                if(measure.status)
+                    break;
+            }
+            if(best.status)
+                failed++;
+            mp3_bench_report(&ctx, &corpus, &bench_cases[c], &best);
+        }
+
+        if(!ctx.keep)
+            remove(corpus.path);
+    }
+
+    if(!ctx.keep)
+        rmdir(ctx.dir);
+
+    //a failed row must not pass as a result table
+    if(failed) {
+        fprintf(stderr, "*error* : %d case(s) failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////
+// corpus generator
+
+//xorshift64*
+static uint64_t
+mp3_bench_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+mp3_bench_fill(uint64_t *state, uint8_t *data, size_t length)
+{
+    uint64_t value;
+
+    while(length >= 8) {
+        value = mp3_bench_random(state);
+        memcpy(data, &value, 8);
+        data += 8;
+        length -= 8;
+    }
+    value = mp3_bench_random(state);
+    memcpy(data, &value, length);
+}
+
+//CRC-16 of the MPEG header, polynomial 0x8005
+static uint16_t
+mp3_bench_crc16(uint16_t crc, const uint8_t *data, size_t length)
+{
+    for(size_t i = 0; i < length; i++) {
+        crc ^= data[i] << 8;
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+//buffered writer of the generator
+typedef struct mp3_bench_output_tag {
+    int fd;
+    uint8_t *buffer;
+    size_t used;
+    uint64_t written;
+} mp3_bench_output;
+
+static int
+mp3_bench_flush(mp3_bench_output *output)
+{
+    size_t done = 0;
+    ssize_t result;
+
+    while(done < output->used) {
+        result = write(output->fd, output->buffer + done, output->used - done);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            return -1;
+        done += result;
+    }
+    output->written += output->used;
+    output->used = 0;
+    return 0;
+}
+
+//room for length bytes at the end of the buffer
+static uint8_t *
+mp3_bench_reserve(mp3_bench_output *output, size_t length)
+{
+    uint8_t *data;
+
+    if(output->used + length > MP3_BENCH_BUFFER &&
+        mp3_bench_flush(output))
+        return NULL;
+    data = output->buffer + output->used;
+    output->used += length;
+    return data;
+}
+
+//random bytes in buffer sized pieces
+static int
+mp3_bench_random_bytes(mp3_bench_output *output, uint64_t *state, uint64_t length)
+{
+    uint8_t *data;
+    size_t chunk;
+
+    while(length) {
+        chunk = length < MP3_BENCH_BUFFER ? (size_t)length : MP3_BENCH_BUFFER;
+        data = mp3_bench_reserve(output, chunk);
+        if(!data)
+            return -1;
+        mp3_bench_fill(state, data, chunk);
+        length -= chunk;
+    }
+    return 0;
+}
+
+static void
+mp3_bench_syncsafe(uint8_t *data, uint32_t value)
+{
+    data[0] = (value >> 21) & 0x7F;
+    data[1] = (value >> 14) & 0x7F;
+    data[2] = (value >> 7) & 0x7F;
+    data[3] = value & 0x7F;
+}
+
+//ID3v2.3 tag holding one APIC frame of picture_size random bytes
+static int
+mp3_bench_id3v2(mp3_bench_output *output, uint64_t *state, uint32_t picture_size)
+{
+    static const uint8_t apic_head[] = { 0x00, 'i', 'm', 'a', 'g', 'e', '/', 'j', 'p', 'e', 'g', 0x00, 0x03, 0x00 };
+    uint32_t frame_size = (uint32_t)sizeof(apic_head) + picture_size;
+    uint8_t *data;
+
+    data = mp3_bench_reserve(output, 10 + 10 + sizeof(apic_head));
+    if(!data)
+        return -1;
+
+    memcpy(data, "ID3\x03\x00\x00", 6);
+    mp3_bench_syncsafe(data + 6, 10 + frame_size);
+    data += 10;
+
+    memcpy(data, "APIC", 4);
+    data[4] = (uint8_t)(frame_size >> 24);
+    data[5] = (uint8_t)(frame_size >> 16);
+    data[6] = (uint8_t)(frame_size >> 8);
+    data[7] = (uint8_t)frame_size;
+    data[8] = 0;
+    data[9] = 0;
+    memcpy(data + 10, apic_head, sizeof(apic_head));
+
+    return mp3_bench_random_bytes(output, state, picture_size);
+}
+
+static void
+mp3_bench_ape_tag(uint8_t *data, uint32_t size, uint8_t header)
+{
+    memcpy(data, "APETAGEX", 8);
+    data[8] = 0xD0;//version 2000
+    data[9] = 0x07;
+    data[10] = 0;
+    data[11] = 0;
+    data[12] = (uint8_t)size;//items and footer
+    data[13] = (uint8_t)(size >> 8);
+    data[14] = (uint8_t)(size >> 16);
+    data[15] = (uint8_t)(size >> 24);
+    memset(data + 16, 0, 16);
+    data[16] = 1;//one item
+    data[23] = header ? 0xA0 : 0x80;//has header, this is the header
+}
+
+//APEv2 tag with one item, then ID3v1
+static int
+mp3_bench_trailers(mp3_bench_output *output, uint64_t *state)
+{
+    uint32_t ape_size = 8 + 6 + MP3_BENCH_APE_ITEM + 32;
+    uint8_t *data;
+
+    data = mp3_bench_reserve(output, 32 + 8 + 6);
+    if(!data)
+        return -1;
+    mp3_bench_ape_tag(data, ape_size, 1);
+    data += 32;
+    data[0] = (uint8_t)MP3_BENCH_APE_ITEM;
+    data[1] = (uint8_t)(MP3_BENCH_APE_ITEM >> 8);
+    memset(data + 2, 0, 6);
+    memcpy(data + 8, "Cover", 6);
+    if(mp3_bench_random_bytes(output, state, MP3_BENCH_APE_ITEM))
+        return -1;
+
+    data = mp3_bench_reserve(output, 32 + 128);
+    if(!data)
+        return -1;
+    mp3_bench_ape_tag(data, ape_size, 0);
+    data += 32;
+    memset(data, ' ', 128);
+    memcpy(data, "TAG", 3);
+    memcpy(data + 3, "mp3bench", 8);
+    data[127] = 12;//genre
+    return 0;
+}
+
+static int
+mp3_bench_generate(mp3_bench_context *ctx, mp3_bench_corpus *corpus)
+{
+    mp3_bench_output output;
+    uint64_t state = 0x9E3779B97F4A7C15ULL + corpus->profile;
+    uint64_t limit = ctx->size;
+    uint8_t version = 3;//mpeg1
+    uint8_t sampling = 0;
+    uint8_t protection = 1;//no CRC
+    uint8_t header[4];
+    uint8_t *data;
+    size_t length;
+    size_t side_info;
+    uint16_t crc;
+    int result = 0;
+
+    memset(&output, 0x00, sizeof(output));
+    output.buffer = (uint8_t *)malloc(MP3_BENCH_BUFFER);
+    if(!output.buffer)
+        return -1;
+
+    output.fd = open(corpus->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);//open
+    if(output.fd < 0) {
+        free(output.buffer);
+        return -1;
+    }
+
+    if(corpus->profile == MP3_BENCH_MPEG25)
+        version = 0;
+    if(corpus->profile == MP3_BENCH_CRC)
+        protection = 0;
+
+    if(corpus->profile == MP3_BENCH_APIC) {
+        uint64_t picture = ctx->size / 8;
+        if(picture > MP3_BENCH_APIC_MAX)
+            picture = MP3_BENCH_APIC_MAX;
+        result = mp3_bench_id3v2(&output, &state, (uint32_t)picture);
+    }
+    if(corpus->profile == MP3_BENCH_TAGS)
+        limit = limit > 8 * 1024 ? limit - 8 * 1024 : 0;//room for the trailers
+
+    while(0 == result &&
+            output.written + output.used < limit) {
+        uint64_t value = mp3_bench_random(&state);
+        uint8_t bitrate = 9;//128 kbit/s
+        uint8_t channel = (uint8_t)((value >> 8) & 3);
+
+        if(corpus->profile == MP3_BENCH_VBR ||
+            corpus->profile == MP3_BENCH_MPEG25)
+            bitrate = (uint8_t)(1 + (value >> 16) % 14);
+
+        header[0] = 0xff;
+        header[1] = (uint8_t)(0xE0 | version << 3 | 1 << 1 | protection);//layer3
+        header[2] = (uint8_t)(bitrate << 4 | sampling << 2 | (value & 1) << 1);
+        header[3] = (uint8_t)(channel << 6 | ((value >> 4) & 3) << 4 | 0x04);//original
+
+        length = mp3_frame_lookup(header)->length;
+        data = mp3_bench_reserve(&output, length);
+        if(!data) {
+            result = -1;
+            break;
+        }
+        memcpy(data, header, 4);
+        mp3_bench_fill(&state, data + 4, length - 4);
+
+        if(!protection) {
+            //header bytes 2 and 3, then the side information
+            if(version == 3)
+                side_info = channel == 3 ? 17 : 32;
+            else
+                side_info = channel == 3 ? 9 : 17;
+            crc = mp3_bench_crc16(0xFFFF, header + 2, 2);
+            crc = mp3_bench_crc16(crc, data + 6, side_info);
+            data[4] = (uint8_t)(crc >> 8);
+            data[5] = (uint8_t)crc;
+        }
+        corpus->frames++;
+
+        if(corpus->profile == MP3_BENCH_CORRUPT &&
+            0 == corpus->frames % MP3_BENCH_JUNK_INTERVAL)
+            result = mp3_bench_random_bytes(&output, &state, 1 + (value >> 32) % MP3_BENCH_JUNK_MAX);
+    }
+
+    if(0 == result && corpus->profile == MP3_BENCH_TAGS)
+        result = mp3_bench_trailers(&output, &state);
+    if(0 == result)
+        result = mp3_bench_flush(&output);
+
+    corpus->size = output.written;
+    if(close(output.fd))//close
+        result = -1;
+    free(output.buffer);
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////
+// measurement
+//
+// The tools run as child processes with their output on /dev/null.
+// Peak RSS comes from wait4(); on Linux the read and write class
+// syscall counts come from /proc/<pid>/io of the exited child before
+// it is reaped. Skip runs in process on the library.
+
+static double
+mp3_bench_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//syscr + syscw of a process, UINT64_MAX if unavailable
+static uint64_t
+mp3_bench_syscalls(const char *proc_io)
+{
+    FILE *fp;
+    char line[128];
+    unsigned long long value;
+    uint64_t count = 0;
+    int found = 0;
+
+    fp = fopen(proc_io, "r");//open
+    if(!fp)
+        return UINT64_MAX;
+    while(fgets(line, sizeof(line), fp)) {
+        if(1 == sscanf(line, "syscr: %llu", &value) ||
+            1 == sscanf(line, "syscw: %llu", &value)) {
+            count += value;
+            found++;
+        }
+    }
+    fclose(fp);//close
+
+    return found == 2 ? count : UINT64_MAX;
+}
+
+static uint64_t
+mp3_bench_rss_kb(long maxrss)
+{
+#ifdef __APPLE__
+    return (uint64_t)maxrss / 1024;//bytes
+#else
+    return (uint64_t)maxrss;
+#endif
+}
+
+static int
+mp3_bench_exec(char *const argv[], const char *input, mp3_bench_measure *measure)
+{
+    struct rusage usage;
+    double begin;
+    pid_t pid;
+    int status;
+
+    begin = mp3_bench_now();
+    pid = fork();
+    if(pid < 0)
+        return -1;
+
+    if(pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if(input) {
+            int input_fd = open(input, O_RDONLY);
+            if(input_fd < 0)
+                _exit(127);
+            dup2(input_fd, 0);
+        }
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    measure->syscalls = UINT64_MAX;
+#ifdef __linux__
+    {
+        siginfo_t info;
+        char proc_io[64];
+
+        //the counters go with the child, read them before reaping it
+        if(0 == waitid(P_PID, pid, &info, WEXITED | WNOWAIT)) {
+            snprintf(proc_io, sizeof(proc_io), "/proc/%d/io", (int)pid);
+            measure->syscalls = mp3_bench_syscalls(proc_io);
+        }
+    }
+#endif
+    if(wait4(pid, &status, 0, &usage) != pid)
+        return -1;
+
+    measure->seconds = mp3_bench_now() - begin;
+    measure->peak_rss = mp3_bench_rss_kb(usage.ru_maxrss);
+    measure->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return 0;
+}
+
+//every frame through mp3_iter_skip(), in process
+static int
+mp3_bench_skip(mp3_bench_corpus *corpus, const char *backend, mp3_bench_measure *measure)
+{
+    static mp3_frame_iter iter;
+    mp3_stream *stream = NULL;
+    mp3_source source;
+    struct rusage usage;
+    uint64_t syscalls;
+    uint64_t begin_pos;
+    uint64_t data_end;
+    uint64_t skipped = 0;
+    double begin;
+    int fd;
+    int result;
+
+    syscalls = mp3_bench_syscalls("/proc/self/io");
+    begin = mp3_bench_now();
+
+    fd = open(corpus->path, O_RDONLY);//open
+    if(fd < 0)
+        return -1;
+
+    if(0 == strcmp(backend, "mmap"))
+        result = mp3_source_open_mmap(&source, fd);
+    else if(0 == strcmp(backend, "stream")) {
+        stream = (mp3_stream *)malloc(sizeof(mp3_stream));
+        result = stream ? 0 : -1;
+        if(stream)
+            mp3_source_open_stream(&source, stream, fd);
+    }
+    else
+        result = mp3_source_open_fd(&source, fd);
+
+    if(0 == result)
+        result = mp3_source_audio_region(&source, &begin_pos, &data_end);
+    if(0 == result) {
+        mp3_iter_init(&iter, &source, begin_pos, data_end);
+        result = mp3_iter_skip(&iter, UINT64_MAX, &skipped);
+        mp3_source_close(&source);
+    }
+    free(stream);
+    close(fd);//close
+
+    measure->seconds = mp3_bench_now() - begin;
+    if(syscalls != UINT64_MAX)
+        syscalls = mp3_bench_syscalls("/proc/self/io") - syscalls;
+    measure->syscalls = syscalls;
+    getrusage(RUSAGE_SELF, &usage);
+    measure->peak_rss = mp3_bench_rss_kb(usage.ru_maxrss);
+
+    //0 is the end of the audio, every frame has to be found
+    measure->status = (result == 0 && skipped == corpus->frames) ? 0 : 1;
+    return 0;
+}
+
+//plain copy, untimed, for the in-place run
+static int
+mp3_bench_copy(const char *src, const char *dst)
+{
+    uint8_t *buffer;
+    ssize_t length;
+    int src_fd;
+    int dst_fd;
+    int result = 0;
+
+    buffer = (uint8_t *)malloc(MP3_BENCH_BUFFER);
+    if(!buffer)
+        return -1;
+    src_fd = open(src, O_RDONLY);//open
+    dst_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);//open
+    if(src_fd < 0 || dst_fd < 0)
+        result = -1;
+
+    while(0 == result &&
+            (length = read(src_fd, buffer, MP3_BENCH_BUFFER)) > 0) {
+        if(write(dst_fd, buffer, length) != length)
+            result = -1;
+    }
+    if(length < 0)
+        result = -1;
+
+    if(src_fd >= 0)
+        close(src_fd);//close
+    if(dst_fd >= 0 && close(dst_fd))//close
+        result = -1;
+    free(buffer);
+    return result;
+}
+
+static int
+mp3_bench_case_run(mp3_bench_context *ctx, mp3_bench_corpus *corpus, const mp3_bench_case *bench_case, mp3_bench_measure *measure)
+{
+    char tool[MP3_BENCH_PATH];
+    char output[MP3_BENCH_PATH];
+    char *argv[8];
+    const char *input = NULL;
+    int argc = 0;
+    int result;
+
+    memset(measure, 0x00, sizeof(mp3_bench_measure));
+
+    if(bench_case->op == MP3_BENCH_SKIP)
+        return mp3_bench_skip(corpus, bench_case->backend, measure);
+
+    //tool and output paths are cut short by a long --bin or --dir
+    if(snprintf(output, sizeof(output), "%s/%s.out.mp3", ctx->dir, profile_string[corpus->profile]) >= (int)sizeof(output))
+        return -1;
+
+    if(bench_case->op == MP3_BENCH_ANALYZE) {
+        if(snprintf(tool, sizeof(tool), "%s/mp3analyzer", ctx->bin) >= (int)sizeof(tool))
+            return -1;
+        argv[argc++] = tool;
+        argv[argc++] = (char *)"--format=summary";
+        if(0 == strcmp(bench_case->backend, "stdio"))
+            argv[argc++] = (char *)"--backend=stdio";
+        else if(0 == strcmp(bench_case->backend, "mmap"))
+            argv[argc++] = (char *)"--backend=mmap";
+        else if(0 == strcmp(bench_case->backend, "parallel"))
+            argv[argc++] = (char *)"--scan-threads=0";
+        if(0 == strcmp(bench_case->backend, "stdin")) {
+            input = corpus->path;
+            argv[argc++] = (char *)"-";
+        }
+        else
+            argv[argc++] = corpus->path;
+    }
+    else {
+        if(snprintf(tool, sizeof(tool), "%s/mp3edit_tag_joint_stereo", ctx->bin) >= (int)sizeof(tool))
+            return -1;
+        argv[argc++] = tool;
+        if(0 == strcmp(bench_case->backend, "in-place")) {
+            if(mp3_bench_copy(corpus->path, output))
+                return -1;
+            argv[argc++] = (char *)"--in-place";
+            argv[argc++] = output;
+        }
+        else if(0 == strcmp(bench_case->backend, "stdin")) {
+            input = corpus->path;
+            argv[argc++] = (char *)"-";
+            argv[argc++] = (char *)"-";
+        }
+        else {
+            argv[argc++] = (char *)(0 == strcmp(bench_case->backend, "zerocopy") ? "--backend=zerocopy" : "--backend=stdio");
+            argv[argc++] = corpus->path;
+            argv[argc++] = output;
+        }
+    }
+    argv[argc] = NULL;
+
+    result = mp3_bench_exec(argv, input, measure);
+    remove(output);
+    return result;
+}
+
+static void
+mp3_bench_report(mp3_bench_context *ctx, mp3_bench_corpus *corpus, const mp3_bench_case *bench_case, mp3_bench_measure *measure)
+{
+    double mb = corpus->size / (1024.0 * 1024.0);
+    double seconds = measure->seconds > 0.0 ? measure->seconds : 1e-9;
+    char syscalls[32];
+
+    if(measure->syscalls == UINT64_MAX)
+        snprintf(syscalls, sizeof(syscalls), "-");
+    else
+        snprintf(syscalls, sizeof(syscalls), "%llu", (unsigned long long)measure->syscalls);
+
+    if(ctx->csv) {
+        printf("%s,%s,%s,%llu,%llu,%.6f,%.1f,%.0f,%s,%llu,%d\n",
+            profile_string[corpus->profile],
+            op_string[bench_case->op],
+            bench_case->backend,
+            (unsigned long long)corpus->size,
+            (unsigned long long)corpus->frames,
+            measure->seconds,
+            mb / seconds,
+            corpus->frames / seconds,
+            syscalls,
+            (unsigned long long)measure->peak_rss,
+            measure->status);
+    }
+    else if(measure->status) {
+        printf("%-8s %-8s %-10s %9.1f   failed (exit %d)\n",
+            profile_string[corpus->profile],
+            op_string[bench_case->op],
+            bench_case->backend,
+            mb,
+            measure->status);
+    }
+    else {
+        printf("%-8s %-8s %-10s %9.1f %10.4f %10.1f %12.0f %10s %12llu\n",
+            profile_string[corpus->profile],
+            op_string[bench_case->op],
+            bench_case->backend,
+            mb,
+            measure->seconds,
+            mb / seconds,
+            corpus->frames / seconds,
+            syscalls,
+            (unsigned long long)measure->peak_rss);
+    }
+    fflush(stdout);
+}
@@ -28,31 +28,81 @@
 #ifdef WIN32
 #include "stdafx.h"
 #include "stdint.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <io.h>
+#include <fcntl.h>
 #else
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <strings.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #endif
 #include "memory.h"
+#include <string.h>
+#include <stdlib.h>
+#include "../mp3scan/mp3scan.h"
+#include "../mp3scan/mp3aio.h"
 
 ///////////////////////////////////////
 
-#define MP3_SAMPLE_PER_FRAME 1152
-#define MP3_BYTE_ATTR_PER_FRAME 144
-
 /**
  * function
  *
  */
-typedef int (*id3_analyzation)(FILE *fp,
+typedef struct mp3demuxer_context_tag mp3demuxer_context;
+typedef struct mp3_frame_index_tag mp3_frame_index;
+typedef struct mp3_writer_tag mp3_writer;
+typedef struct mp3_stream_stats_tag mp3_stream_stats;
+
+typedef struct mp3_vbr_header_tag {
+    mp3_vbr_type type;
+    uint32_t frames;// audio frames, excluding the tag frame
+    uint32_t bytes;
+    uint8_t has_toc;
+    uint8_t toc[100];
+} mp3_vbr_header;
+
+typedef int (*id3_analyzation)(mp3demuxer_context *ctx,
+                            FILE *fp,
                             uint32_t *num_frame,
                             uint32_t *sample_rate,
                             uint8_t *channel,
                             uint8_t *version,
                             uint8_t *layer);
-typedef int (*id3_skip_frame)(FILE *fp, uint32_t *frame);
+typedef int (*id3_skip_frame)(mp3demuxer_context *ctx, FILE *fp, uint32_t *frame);
 
-typedef struct mp3demuxer_context_tag {
+typedef enum mp3_io_backend_tag {
+    MP3_IO_STDIO = 0,// ftell/fread/fseek per frame
+    MP3_IO_MMAP = 1,// whole file mapped, pointer walk
+} mp3_io_backend;
+
+typedef enum mp3_output_format_tag {
+    MP3_OUTPUT_DUMP = 0,// multi-line printf per frame
+    MP3_OUTPUT_SUMMARY = 1,// totals only
+    MP3_OUTPUT_NDJSON = 2,
+    MP3_OUTPUT_CSV = 3,
+    MP3_OUTPUT_BINARY = 4,// mp3_frame_record stream
+    MP3_OUTPUT_STATISTICS = 5,// mp3_stream_stats, no per-frame output
+} mp3_output_format;
+
+struct mp3demuxer_context_tag {
     char *filename;
+    mp3_io_backend io_backend;
 
     uint32_t sample_rate;
     uint8_t sample_bit;
@@ -60,7 +110,29 @@ typedef struct mp3demuxer_context_tag {
 
     id3_analyzation analyze;
     id3_skip_frame skip_frame;
-} mp3demuxer_context;
+
+    mp3_frame_index *index;// NULL unless --index
+
+    uint8_t quiet;// no per-frame dump
+    uint32_t scan_threads;// --scan-threads, mmap backend only
+    uint8_t probe;// --probe
+    mp3_vbr_header vbr_header;
+
+    uint64_t audio_bytes;
+    uint64_t audio_samples;
+
+    uint8_t strict;// --strict, stop at the first broken header
+    uint64_t junk_count;
+    uint64_t junk_bytes;
+
+    mp3_output_format output_format;
+    mp3_writer *writer;// NULL for the dump and summary formats
+    mp3_stream_stats *stats;// --format=statistics
+
+    mp3_sync_search_func sync_search;// --simd, NULL for the library default
+
+    mp3_counters *counters;// --stats, NULL when off
+};
 
 ///////////////////////////////////////
 
@@ -70,7 +142,8 @@ typedef struct mp3demuxer_context_tag {
  *
  */
 static int
-id3_analyzation_v1(FILE *fp,
+id3_analyzation_v1(mp3demuxer_context *ctx,
+                    FILE *fp,
                     uint32_t *num_frame,
                     uint32_t *sample_rate,
                     uint8_t *channel,
@@ -78,15 +151,34 @@ id3_analyzation_v1(FILE *fp,
                     uint8_t *layer);
 
 static int
-id3_analyzation_v1_internal(FILE *fp,
-                    uint32_t begin_pos,
+id3_analyzation_source(mp3demuxer_context *ctx,
+                    FILE *fp,
+                    uint64_t begin_pos,
+                    uint32_t *num_frame,
+                    uint32_t *sample_rate,
+                    uint8_t *channel,
+                    uint8_t *version,
+                    uint8_t *layer);
+static int
+id3_analyzation_v1_internal(mp3demuxer_context *ctx,
+                    mp3_source *source,
+                    uint64_t begin_pos,
+                    uint32_t *num_frame,
+                    uint32_t *sample_rate,
+                    uint8_t *channel,
+                    uint8_t *version,
+                    uint8_t *layer);
+static int
+id3_analyzation_stream(mp3demuxer_context *ctx,
+                    mp3_source *source,
                     uint32_t *num_frame,
                     uint32_t *sample_rate,
                     uint8_t *channel,
                     uint8_t *version,
                     uint8_t *layer);
 static int
-id3_analyzation_v2(FILE *fp,
+id3_analyzation_v2(mp3demuxer_context *ctx,
+                    FILE *fp,
                     uint32_t *num_frame,
                     uint32_t *sample_rate,
                     uint8_t *channel,
@@ -94,13 +186,13 @@ id3_analyzation_v2(FILE *fp,
                     uint8_t *layer);
 
 static int
-id3_skip_frame_v1(FILE *fp, uint32_t *frame);
+id3_skip_frame_v1(mp3demuxer_context *ctx, FILE *fp, uint32_t *frame);
 
 static int
-id3_skip_frame_v1_internal(FILE *fp, uint32_t begin_pos, uint32_t *frame);
+id3_skip_frame_v1_internal(mp3demuxer_context *ctx, FILE *fp, uint32_t begin_pos, uint32_t *frame);
 
 static int
-id3_skip_frame_v2(FILE *fp, uint32_t *frame);
+id3_skip_frame_v2(mp3demuxer_context *ctx, FILE *fp, uint32_t *frame);
 
 /**
  * 
@@ -108,20 +200,388 @@ id3_skip_frame_v2(FILE *fp, uint32_t *frame);
  *
  */
 
-typedef struct mp3_frame_header_tag {
+/**
+ * structured output
+ *
+ * --format=binary writes a 16 byte stream header (MP3_RECORD_MAGIC,
+ * uint32 record size, uint32 reserved) and then one mp3_frame_record
+ * per frame or junk region, in host byte order.
+ */
+#define MP3_WRITER_BUFFER (256 * 1024)
+#define MP3_RECORD_MAGIC "MP3FREC1"
+
+struct mp3_writer_tag {
+    int fd;
+    mp3_output_format format;
+    mp3_counters *counters;
+    char buffer[MP3_WRITER_BUFFER];
+    size_t used;
+    uint8_t error;
+};
+
+typedef struct mp3_frame_record_tag {
+    uint64_t offset;
+    uint32_t frame;
+    uint32_t size;// frame size, junk length for junk records
+    uint32_t bitrate;
+    uint32_t sample_rate;
+    uint8_t type;// 0:frame 1:junk
     uint8_t version;
     uint8_t layer;
-    uint8_t protection_bit;
-    uint8_t bitrate_index;
-    uint8_t sampling_frequency_index;
-    uint8_t padding_bit;
-    uint8_t private_bit;
     uint8_t channel_mode;
     uint8_t mode_extension;
-    uint8_t copyright;
-    uint8_t original;
+    uint8_t flags;// protection, padding, private, copyright, original from bit 0
     uint8_t emphasis;
-} mp3_frame_header;
+    uint8_t reserved;
+} mp3_frame_record;
+
+/**
+ * statistics
+ *
+ */
+#define MP3_STATS_MAX_KBPS 448
+#define MP3_STATS_WINDOW 128// frames per average for the ABR check
+#define MP3_STATS_CHANGES 16// parameter changes listed
+
+typedef struct mp3_stream_change_tag {
+    uint32_t frame;
+    uint64_t pos;
+    uint8_t field;// 0:version 1:layer 2:sampling rate 3:channel mode
+    uint32_t from;
+    uint32_t to;
+} mp3_stream_change;
+
+struct mp3_stream_stats_tag {
+    uint64_t frames;
+    uint64_t bytes;
+    double duration;
+    uint32_t sample_rate;
+    mp3_frame_header last;
+
+    uint64_t bitrate_frames[MP3_STATS_MAX_KBPS + 1];// histogram by kbps
+    uint32_t bitrate_min;
+    uint32_t bitrate_max;
+    uint64_t bitrate_sum;
+
+    uint64_t channel_mode[4];
+    uint64_t mode_extension[4];// joint stereo frames only
+    uint64_t padded;
+    uint64_t protected_frames;
+
+    uint64_t change_count;
+    mp3_stream_change changes[MP3_STATS_CHANGES];
+
+    uint64_t window_bytes;
+    double window_duration;
+    uint32_t window_frames;
+    uint32_t windows;
+    double window_min;// kbps
+    double window_max;
+};
+
+/**
+ * frame index sidecar
+ *
+ * "<file>.idx" holds one entry per frame so that seeking is a lookup
+ * instead of a header walk. It is keyed by the size and mtime of the
+ * mp3 file; when the file only grew the entries are kept and the scan
+ * resumes after the last indexed frame.
+ * The sidecar is written in host byte order.
+ */
+#define MP3_INDEX_MAGIC "MP3FIDX1"
+#define MP3_INDEX_SUFFIX ".idx"
+
+typedef enum mp3_index_state_tag {
+    MP3_INDEX_NONE = 0,// no usable sidecar, full scan
+    MP3_INDEX_GROWN = 1,// entries cover a prefix of the file
+    MP3_INDEX_VALID = 2,// entries cover the whole file
+} mp3_index_state;
+
+typedef struct mp3_frame_index_entry_tag {
+    uint64_t offset;
+    uint32_t header;// 4 header bytes, big endian packed
+    uint32_t size;
+} mp3_frame_index_entry;
+
+typedef struct mp3_frame_index_file_header_tag {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t audio_begin;
+    uint32_t count;
+    uint32_t entry_size;
+} mp3_frame_index_file_header;
+
+struct mp3_frame_index_tag {
+    char *path;// sidecar path
+
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t audio_begin;
+
+    mp3_frame_index_entry *entries;
+    uint32_t count;
+    uint32_t capacity;
+
+    mp3_index_state state;
+    uint8_t dirty;
+};
+
+#ifndef WIN32
+/**
+ * result cache
+ *
+ * --cache=<dir> keeps one entry per analyzed file at
+ * <dir>/<xx>/<device>-<inode>, xx being the low byte of the inode. The
+ * entry holds the summary of a batch analysis and the frame index of
+ * its scan, in host byte order. It answers for the file while device,
+ * inode, size, mtime and the options that change results match, and
+ * with --cache-verify while a hash of the first and last
+ * MP3_CACHE_HASH_BYTES matches too.
+ */
+#define MP3_CACHE_MAGIC "MP3CACH1"
+#define MP3_CACHE_HASH_BYTES (64 * 1024)
+#define MP3_CACHE_TOUCH (24 * 60 * 60)// s, a hit on an older entry refreshes its mtime
+#define MP3_CACHE_TMP_AGE (60 * 60)// s, then a temporary file is a dead writer's
+
+#define MP3_CACHE_PROBE 0x01
+#define MP3_CACHE_STRICT 0x02
+
+typedef struct mp3_cache_key_tag {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;// head and tail, 0 without --cache-verify
+    uint32_t options;// MP3_CACHE_PROBE, MP3_CACHE_STRICT
+    uint32_t reserved;
+} mp3_cache_key;
+
+typedef struct mp3_cache_entry_tag {
+    char magic[8];
+    mp3_cache_key key;
+    int32_t result;
+    int32_t format;// 1:mp3v1 2:mp3v2
+    uint32_t num_frame;
+    uint32_t sample_rate;
+    uint32_t channel;
+    uint32_t probe;// mp3_vbr_type
+    uint64_t audio_bytes;
+    uint64_t audio_samples;
+    uint64_t junk_count;
+    uint64_t junk_bytes;
+    uint64_t audio_begin;
+    uint32_t count;// frame index entries after the entry
+    uint32_t entry_size;
+    uint64_t index_checksum;
+    uint64_t checksum;// of the entry up to here
+} mp3_cache_entry;
+
+typedef struct mp3_cache_tag {
+    const char *dir;
+    uint8_t verify;// --cache-verify
+    uint32_t expire;// days, --cache-expire; 0:keep
+    mode_t mode;// of entries, 0666 less the umask
+} mp3_cache;
+
+/**
+ * batch analysis
+ *
+ */
+#define MP3_BATCH_PACK_FILE_SIZE (1024 * 1024)// smaller files are packed
+#define MP3_BATCH_PACK_BYTES (8 * 1024 * 1024)
+#define MP3_BATCH_PACK_FILES 64
+
+typedef struct mp3_batch_file_tag {
+    char *path;
+    uint64_t size;
+    size_t seq;// input order
+} mp3_batch_file;
+
+typedef struct mp3_batch_task_tag {
+    size_t first;// into the size sorted file array
+    size_t count;
+    uint64_t bytes;
+} mp3_batch_task;
+
+typedef struct mp3_batch_queue_tag {
+    pthread_mutex_t lock;
+    size_t *tasks;
+    size_t head;// owner pops here
+    size_t tail;// thieves pop here
+} mp3_batch_queue;
+
+typedef struct mp3_batch_tag {
+    mp3_batch_file *files;
+    size_t file_count;
+    size_t file_capacity;
+
+    mp3_batch_task *tasks;
+    size_t task_count;
+
+    mp3_batch_queue *queues;
+    uint32_t threads;// 0:auto
+
+    mp3_io_backend io_backend;
+    uint8_t probe;
+    uint8_t strict;
+    mp3_sync_search_func sync_search;
+    uint8_t ordered;
+    uint8_t use_aio;// --aio, read ahead per worker; --probe still reads through stdio
+    mp3_aio_backend aio_backend;
+    mp3_cache *cache;// --cache, NULL when off
+
+    pthread_mutex_t output_lock;
+    char **pending;// --ordered: finished lines waiting for their turn
+    size_t next_seq;
+
+    mp3_counters *counters;// --stats, workers add theirs here
+} mp3_batch;
+
+/**
+ * follow
+ *
+ * "<file>.follow" holds where the last run stopped, in host byte order.
+ * It is keyed by device and inode; offset is the first frame or junk
+ * region that was not reported yet.
+ */
+#define MP3_FOLLOW_MAGIC "MP3FPOS1"
+#define MP3_FOLLOW_SUFFIX ".follow"
+#define MP3_FOLLOW_INTERVAL 1000// ms
+
+typedef struct mp3_follow_state_tag {
+    char magic[8];
+    uint64_t device;
+    uint64_t inode;
+    uint64_t offset;
+    uint64_t frames;
+    uint64_t audio_bytes;
+    uint64_t audio_samples;
+    uint64_t junk_count;
+    uint64_t junk_bytes;
+    uint32_t sample_rate;// of the last frame
+    uint32_t reserved;
+} mp3_follow_state;
+
+typedef struct mp3_follow_tag {
+    char *state_path;
+    uint32_t interval;// ms, --interval: longest delay of totals and state
+    uint32_t idle;// s, --idle: stop when the file stops growing, 0:never
+    uint8_t poll;// --follow=poll, no inotify
+
+    mp3_follow_state state;
+    uint64_t saved_offset;
+    uint8_t resumed;
+    uint8_t gone;// moved or deleted
+    int notify_fd;// -1 when polling
+} mp3_follow;
+
+/**
+ * daemon
+ *
+ */
+#define MP3_DAEMON_MESSAGE (64 * 1024)// longest request
+#define MP3_DAEMON_RESPONSE 512
+#define MP3_DAEMON_LATENCIES 1024// recent requests in the percentiles
+#define MP3_DAEMON_STOP_CHECK 500// ms
+
+typedef enum mp3_daemon_op_tag {
+    MP3_DAEMON_ANALYZE = 0,
+    MP3_DAEMON_PROBE = 1,
+    MP3_DAEMON_SEEK = 2,
+} mp3_daemon_op;
+
+typedef struct mp3_daemon_job_tag mp3_daemon_job;
+struct mp3_daemon_job_tag {
+    char *request;// as received, the coalescing key
+    mp3_daemon_op op;
+    const char *path;// into request
+    uint32_t frame;// seek
+    char response[MP3_DAEMON_RESPONSE];
+    uint32_t waiters;// connections answered by this job
+    uint8_t done;
+    mp3_daemon_job *next;// queue, then the running list
+};
+
+typedef struct mp3_daemon_tag {
+    uint32_t threads;// 0:auto
+    mp3_io_backend io_backend;
+    uint8_t strict;
+    mp3_sync_search_func sync_search;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;// a job was queued, or stop
+    pthread_cond_t done;// a job finished
+    mp3_daemon_job *head;// queued, oldest first
+    mp3_daemon_job *tail;
+    mp3_daemon_job *running;
+    uint32_t queued;
+    uint32_t busy;
+    uint8_t stop;
+
+    uint64_t served;
+    uint64_t coalesced;// requests that joined a job
+    uint64_t failed;
+    uint32_t latency[MP3_DAEMON_LATENCIES];// us, ring
+    uint64_t latency_count;
+
+    mp3_cache *cache;// --cache, NULL when off
+} mp3_daemon;
+
+typedef struct mp3_daemon_client_tag {
+    mp3_daemon *daemon;
+    int fd;
+} mp3_daemon_client;
+
+/**
+ * parallel scan
+ *
+ */
+#define MP3_PARALLEL_MIN_CHUNK (1024 * 1024)
+
+typedef struct mp3_scan_event_tag {
+    uint64_t offset;
+    uint64_t junk_length;// 0:frame
+} mp3_scan_event;
+
+typedef struct mp3_scan_chunk_tag {
+    mp3_source *source;
+    size_t data_end;
+
+    size_t range_begin;
+    size_t range_end;
+    uint8_t exact_start;// first chunk: no sync search
+
+    uint8_t strict;
+    mp3_sync_search_func sync_search;
+    mp3_frame_iter iter;
+    mp3_counters counters;// added to the run's after the join
+
+    size_t start;// first frame, SIZE_MAX if none found
+    size_t end;// first frame at or past range_end
+    mp3_scan_event *events;
+    size_t count;
+    size_t capacity;
+    int result;
+
+    pthread_t thread;
+    uint8_t started;
+} mp3_scan_chunk;
+
+typedef struct mp3_batch_worker_tag {
+    mp3_batch *batch;
+    uint32_t id;
+    pthread_t thread;
+    uint8_t started;
+    size_t failed;
+    size_t cache_hits;
+    size_t cache_stored;
+    mp3_counters counters;
+} mp3_batch_worker;
+#endif
 
 typedef struct mp3_id3v1_tag {
 }mp3_id3v1;
@@ -148,54 +608,85 @@ static uint32_t mediatype_table[][4] =
     {Unknown, MPEG1A, MPEG1A, MPEG1A}
 };
 
-//[version][layer][value]
-static uint32_t bitrate_table[][4][16] = 
-{
-    {//mpeg2.5
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2.5
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2.5
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0} //mpeg2.5
-    },
-    {//reserved
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0} //reserved
-    },
-    {//mpeg2
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2 L3
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2 L2
-        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0}//mpeg2 L1
-    },
-    {//mpeg1
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},//mpeg1 L3
-        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},//mpeg1 L2
-        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0}//mpeg1 L1
-    }
-};
 
-//[version][index]
-static uint32_t sampling_rate_table[][4] = 
-{
-    {11025, 12000, 8000, 0},//mpeg2.5
-    {0, 0, 0, 0},//reserved
-    {22050, 24000, 16000, 0},//mpeg2
-    {44100, 48000, 32000, 0} //mpeg1
-};
+static int
+mp3demuxer_select(mp3demuxer_context *ctx, const uint8_t *mp3_header);
 
-//
-static uint32_t channel_table[] = 
-{
-    2, 2, 2, 1
-};
+#ifndef WIN32
+static int
+mp3_batch_add_path(mp3_batch *batch, const char *path, uint8_t from_directory);
+static int
+mp3_batch_add_list(mp3_batch *batch, const char *list_path);
+static int
+mp3_batch_run(mp3_batch *batch);
+static void
+mp3_batch_free(mp3_batch *batch);
+static void
+mp3_batch_analyze_task_aio(mp3_batch *batch, mp3_batch_worker *worker, mp3_batch_task *task, mp3_aio_reader *reader);
+
+static int
+mp3_follow_run(mp3demuxer_context *ctx, mp3_follow *follow, FILE *report);
+
+static int
+mp3_daemon_run(mp3_daemon *daemon, const char *path);
 
+static int
+mp3_parallel_scan(mp3demuxer_context *ctx,
+                    mp3_source *source,
+                    size_t begin_pos,
+                    size_t data_end,
+                    mp3_frame_header *header,
+                    size_t *frame_count);
+#endif
 
 static void
 dump_mp3header(uint32_t frame_num, size_t pos, mp3_frame_header *header);
 
+static void
+mp3_writer_init(mp3_writer *writer, mp3_output_format format);
+static int
+mp3_writer_flush(mp3_writer *writer);
+static void
+mp3_writer_junk(mp3_writer *writer, size_t pos, size_t length);
+static void
+mp3_emit_frame(mp3demuxer_context *ctx, uint32_t frame_num, size_t pos, mp3_frame_header *header);
+
+static void
+mp3_stats_frame(mp3_stream_stats *stats, uint32_t frame_num, size_t pos, const mp3_frame_header *header);
+static void
+mp3_stats_print(mp3_stream_stats *stats, FILE *out);
+
+static void
+mp3_report_junk(mp3demuxer_context *ctx, size_t pos, size_t length);
+
+static int
+mp3_verify_crc(mp3demuxer_context *ctx, mp3_source *source, FILE *report);
+static int
+mp3_side_info_stats(mp3demuxer_context *ctx, mp3_source *source, FILE *report);
+
+static int
+id3_probe_vbr_header(mp3demuxer_context *ctx,
+                    FILE *fp,
+                    uint32_t begin_pos,
+                    uint32_t *num_frame,
+                    uint32_t *sample_rate,
+                    uint8_t *channel,
+                    uint8_t *version,
+                    uint8_t *layer);
+
+static int
+mp3_index_load(mp3_frame_index *index, const char *filename);
+static int
+mp3_index_save(mp3_frame_index *index);
+static void
+mp3_index_free(mp3_frame_index *index);
+static int
+mp3_index_append(mp3_frame_index *index, size_t pos, const uint8_t *data, size_t frame_size);
+static size_t
+mp3_index_replay(mp3demuxer_context *ctx, size_t begin_pos, mp3_frame_header *header, size_t *frame_count);
+static int
+mp3_index_skip(mp3_frame_index *index, FILE *fp, uint32_t *frame);
+
 ///////////////////////////////////////
 
 
@@ -204,7 +695,14 @@ int main(int argc, char* argv[])
 {
     if(argc < 2) {
         fprintf(stderr, "*error* : comnadline argument must be lager than 1\n");
-        fprintf(stderr, "USAGE : <input mp3 file>\n");
+        fprintf(stderr, "USAGE : [--backend=stdio|mmap] [--scan-threads=<n>] [--index] [--probe] [--strict] [--simd=auto|avx2|sse2|scalar]\n");
+        fprintf(stderr, "        [--format=dump|summary|ndjson|csv|binary|statistics] [--seek=<frame>] [--stats[=json]] <input mp3 file|->\n");
+        fprintf(stderr, "        --batch [--threads=<n>] [--ordered] [--aio[=uring|pool]] [--list=<file>|-] [<file or directory> ...]\n");
+        fprintf(stderr, "        [--cache=<dir> [--cache-verify] [--cache-expire=<days>]] with --batch or --daemon\n");
+        fprintf(stderr, "        --follow[=poll] [--state=<file>] [--interval=<ms>] [--idle=<seconds>] <input mp3 file>\n");
+        fprintf(stderr, "        --daemon=<socket> [--threads=<n>]\n");
+        fprintf(stderr, "        --verify-crc [--strict] [--stats[=json]] <input mp3 file|->\n");
+        fprintf(stderr, "        --side-info [--strict] [--stats[=json]] <input mp3 file|->\n");
         return -1;
     }
 
@@ -214,90 +712,696 @@ int main(int argc, char* argv[])
     FILE *fp;
     uint8_t mp3_header[4];
     size_t read_size;
+    mp3_frame_index frame_index;
+    uint8_t use_index = 0;
+    uint8_t use_seek = 0;
+    uint32_t seek_frame = 0;
+    uint8_t use_batch = 0;
+    uint8_t ordered = 0;
+    uint8_t use_aio = 0;
+    mp3_aio_backend aio_backend = MP3_AIO_AUTO;
+    uint32_t threads = 0;
+    const char *simd = NULL;
+    mp3_writer *writer = NULL;
+    mp3_stream_stats *stats = NULL;
+    mp3_stream *stream = NULL;
+    mp3_source stream_source;
+    mp3_counters counters;
+    uint8_t use_stats = 0;// 1:human 2:json
+    uint64_t phase_begin;
+    uint8_t use_follow = 0;// 1:inotify when available 2:polling
+    const char *state_path = NULL;
+    uint32_t interval = MP3_FOLLOW_INTERVAL;
+    uint32_t idle = 0;
+    const char *daemon_path = NULL;
+    mp3_cache cache;
+    uint8_t use_cache = 0;
+    uint8_t verify_crc = 0;
+    uint8_t side_info = 0;
 
     //init
     memset(&mp3demuxer, 0x00, sizeof(mp3demuxer_context));
+    memset(&cache, 0x00, sizeof(mp3_cache));
+    mp3_counters_init(&counters);
 
-    mp3demuxer.filename = argv[1];
+    //options
+    for(int i = 1; i < argc; i++) {
+        if(0 == strcmp(argv[i], "--backend=stdio")) {
+            mp3demuxer.io_backend = MP3_IO_STDIO;
+        }
+        else if(0 == strcmp(argv[i], "--backend=mmap")) {
+#ifdef WIN32
+            fprintf(stderr, "*error* : mmap backend is not supported on this platform\n");
+            return -1;
+#else
+            mp3demuxer.io_backend = MP3_IO_MMAP;
+#endif
+        }
+        else if(0 == strcmp(argv[i], "--index")) {
+            use_index = 1;
+        }
+        else if(0 == strcmp(argv[i], "--probe")) {
+            mp3demuxer.probe = 1;
+        }
+        else if(0 == strncmp(argv[i], "--format=", 9)) {
+            static const char* format_string[] = { "dump", "summary", "ndjson", "csv", "binary", "statistics" };
+            int format;
 
-    //check header
-    fp = fopen(mp3demuxer.filename, "rb");//open
-    if(!fp) {
-        fprintf(stderr, "*error* : file open failed : at %s\n", mp3demuxer.filename);
-    fclose(fp);//close
-        return -1;
+            for(format = 0; format < 6; format++) {
+                if(0 == strcmp(argv[i] + 9, format_string[format]))
+                    break;
+            }
+            if(format == 6) {
+                fprintf(stderr, "*error* : unknown output format : %s\n", argv[i] + 9);
+                return -1;
+            }
+            mp3demuxer.output_format = (mp3_output_format)format;
+        }
+        else if(0 == strcmp(argv[i], "--strict")) {
+            mp3demuxer.strict = 1;
+        }
+        else if(0 == strncmp(argv[i], "--simd=", 7)) {
+            simd = argv[i] + 7;
+            if(0 == strcmp(simd, "auto"))
+                simd = NULL;
+            else if(strcmp(simd, "avx2") && strcmp(simd, "sse2") && strcmp(simd, "scalar")) {
+                fprintf(stderr, "*error* : unknown simd variant : %s\n", simd);
+                return -1;
+            }
+        }
+        else if(0 == strncmp(argv[i], "--scan-threads=", 15)) {
+#ifdef WIN32
+            fprintf(stderr, "*error* : parallel scan is not supported on this platform\n");
+            return -1;
+#else
+            mp3demuxer.scan_threads = (uint32_t)strtoul(argv[i] + 15, NULL, 10);
+            if(mp3demuxer.scan_threads == 0) {
+                long cores = sysconf(_SC_NPROCESSORS_ONLN);
+                mp3demuxer.scan_threads = cores > 0 ? (uint32_t)cores : 1;
+            }
+            mp3demuxer.io_backend = MP3_IO_MMAP;
+#endif
+        }
+        else if(0 == strcmp(argv[i], "--batch")) {
+            use_batch = 1;
+        }
+        else if(0 == strcmp(argv[i], "--ordered")) {
+            ordered = 1;
+        }
+        else if(0 == strcmp(argv[i], "--aio") ||
+                0 == strcmp(argv[i], "--aio=auto")) {
+            use_aio = 1;
+            aio_backend = MP3_AIO_AUTO;
+        }
+        else if(0 == strcmp(argv[i], "--aio=uring")) {
+            use_aio = 1;
+            aio_backend = MP3_AIO_URING;
+        }
+        else if(0 == strcmp(argv[i], "--aio=pool")) {
+            use_aio = 1;
+            aio_backend = MP3_AIO_POOL;
+        }
+        else if(0 == strncmp(argv[i], "--threads=", 10)) {
+            threads = (uint32_t)strtoul(argv[i] + 10, NULL, 10);
+        }
+        else if(0 == strncmp(argv[i], "--list=", 7)) {
+            use_batch = 1;
+        }
+        else if(0 == strncmp(argv[i], "--seek=", 7)) {
+            use_seek = 1;
+            seek_frame = (uint32_t)strtoul(argv[i] + 7, NULL, 10);
+        }
+        else if(0 == strcmp(argv[i], "--stats")) {
+            use_stats = 1;
+        }
+        else if(0 == strcmp(argv[i], "--stats=json")) {
+            use_stats = 2;
+        }
+        else if(0 == strcmp(argv[i], "--follow")) {
+            use_follow = 1;
+        }
+        else if(0 == strcmp(argv[i], "--follow=poll")) {
+            use_follow = 2;
+        }
+        else if(0 == strncmp(argv[i], "--state=", 8)) {
+            state_path = argv[i] + 8;
+        }
+        else if(0 == strncmp(argv[i], "--interval=", 11)) {
+            interval = (uint32_t)strtoul(argv[i] + 11, NULL, 10);
+            if(interval == 0)
+                interval = 1;
+        }
+        else if(0 == strncmp(argv[i], "--idle=", 7)) {
+            idle = (uint32_t)strtoul(argv[i] + 7, NULL, 10);
+        }
+        else if(0 == strncmp(argv[i], "--daemon=", 9)) {
+            daemon_path = argv[i] + 9;
+        }
+        else if(0 == strncmp(argv[i], "--cache=", 8)) {
+            use_cache = 1;
+            cache.dir = argv[i] + 8;
+        }
+        else if(0 == strcmp(argv[i], "--verify-crc")) {
+            verify_crc = 1;
+        }
+        else if(0 == strcmp(argv[i], "--side-info")) {
+            side_info = 1;
+        }
+        else if(0 == strcmp(argv[i], "--cache-verify")) {
+            cache.verify = 1;
+        }
+        else if(0 == strncmp(argv[i], "--cache-expire=", 15)) {
+            cache.expire = (uint32_t)strtoul(argv[i] + 15, NULL, 10);
+        }
+        else if(0 == strncmp(argv[i], "--", 2)) {
+            fprintf(stderr, "*error* : unknown option : %s\n", argv[i]);
+            return -1;
+        }
+        else {
+            mp3demuxer.filename = argv[i];
+        }
     }
-    read_size = fread(mp3_header, 1, 4, fp);
-    fclose(fp);//close
 
-    if(read_size != 4) {
-        fprintf(stderr, "*error* : invalid file size\n");
+    mp3demuxer.sync_search = mp3_sync_search_select(simd, NULL);
+    if(use_stats)
+        mp3demuxer.counters = &counters;
+
+    if(use_cache) {
+#ifdef WIN32
+        fprintf(stderr, "*error* : result cache is not supported on this platform\n");
         return -1;
-    }
+#else
+        mode_t mask = umask(0);
 
-    if(mp3_header[0] == 0xff ||
-        (mp3_header[1] & 0xe0) == 0xe0) {//MP3Header
-            mp3demuxer.analyze = id3_analyzation_v1;
-            mp3demuxer.skip_frame = id3_skip_frame_v1;
-            printf("mp3v1\n");
-    }
-    else if (mp3_header[0] == 0x49 &&
-                mp3_header[1] == 0x44 &&
-                mp3_header[2] == 0x33) {//ID3Header
-            mp3demuxer.analyze = id3_analyzation_v2;
-            mp3demuxer.skip_frame = id3_skip_frame_v2;
-            printf("mp3v2\n");
+        umask(mask);
+        cache.mode = 0666 & ~mask;
+        if(!use_batch && !daemon_path) {
+            fprintf(stderr, "*error* : --cache needs --batch or --daemon\n");
+            return -1;
+        }
+        if(mkdir(cache.dir, 0777) && errno != EEXIST) {
+            fprintf(stderr, "*error* : cache directory unavailable : at %s\n", cache.dir);
+            return -1;
+        }
+#endif
     }
-    else {
-        fprintf(stderr, "*error* : invalid header\n");
+
+    if(use_batch) {
+#ifdef WIN32
+        fprintf(stderr, "*error* : batch mode is not supported on this platform\n");
         return -1;
+#else
+        mp3_batch batch;
+        int result = 0;
+
+        memset(&batch, 0x00, sizeof(mp3_batch));
+        batch.io_backend = mp3demuxer.io_backend;
+        batch.probe = mp3demuxer.probe;
+        batch.strict = mp3demuxer.strict;
+        batch.sync_search = mp3demuxer.sync_search;
+        batch.ordered = ordered;
+        batch.threads = threads;
+        batch.use_aio = use_aio;
+        batch.aio_backend = aio_backend;
+        if(use_aio) {
+            mp3_aio *aio = mp3_aio_create(aio_backend);
+            if(!aio) {
+                fprintf(stderr, "*error* : %s\n", aio_backend == MP3_AIO_URING ?
+                    "io_uring is not available here, try --aio=pool" : "async read engine failed to start");
+                return -1;
+            }
+            mp3_aio_destroy(aio);
+        }
+        batch.counters = mp3demuxer.counters;
+        if(use_cache)
+            batch.cache = &cache;
+
+        for(int i = 1; i < argc && 0 == result; i++) {
+            if(0 == strncmp(argv[i], "--list=", 7)) {
+                result = mp3_batch_add_list(&batch, argv[i] + 7);
+                if(result)
+                    fprintf(stderr, "*error* : list open failed : at %s\n", argv[i] + 7);
+            }
+            else if(0 != strncmp(argv[i], "--", 2)) {
+                result = mp3_batch_add_path(&batch, argv[i], 0);
+            }
+        }
+        if(0 == result)
+            result = mp3_batch_run(&batch);
+        if(result >= 0 && use_stats)
+            mp3_counters_print(&counters, use_stats == 2, stderr);
+
+        mp3_batch_free(&batch);
+        return result < 0 ? -1 : result;
+#endif
     }
 
-    
-    //check header
-    fp = fopen(mp3demuxer.filename, "rb");//open
-    if(!fp) {
-        fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.filename);
+    if(daemon_path) {
+#ifdef WIN32
+        fprintf(stderr, "*error* : daemon mode is not supported on this platform\n");
         return -1;
-    }
+#else
+        mp3_daemon daemon;
 
-    uint32_t num_frame;
-    uint32_t sample_rate;
-    uint8_t channel;
-    uint8_t version;
-    uint8_t layer;
+        memset(&daemon, 0x00, sizeof(mp3_daemon));
+        daemon.threads = threads;
+        daemon.io_backend = mp3demuxer.io_backend;
+        daemon.strict = mp3demuxer.strict;
+        daemon.sync_search = mp3demuxer.sync_search;
+        if(use_cache)
+            daemon.cache = &cache;
 
-    if(mp3demuxer.analyze(fp,
-                        &num_frame,
-                        &sample_rate,
-                        &channel,
-                        &version,
-                        &layer)) {
-        fprintf(stderr, "*error* : analyzation failed\n");
-        fclose(fp);//close
+        return mp3_daemon_run(&daemon, daemon_path);
+#endif
+    }
+
+    if(!mp3demuxer.filename) {
+        fprintf(stderr, "*error* : no input mp3 file\n");
         return -1;
     }
-    fclose(fp);//close
 
+    if(use_follow) {
+#ifdef WIN32
+        fprintf(stderr, "*error* : follow mode is not supported on this platform\n");
+        return -1;
+#else
+        mp3_follow follow;
+        FILE *report = (mp3demuxer.output_format <= MP3_OUTPUT_SUMMARY ||
+                        mp3demuxer.output_format == MP3_OUTPUT_STATISTICS) ? stdout : stderr;
+        int result = -1;
 
-    return 0;
-}
+        if(0 == strcmp(mp3demuxer.filename, "-") || use_index || use_seek ||
+            mp3demuxer.probe || mp3demuxer.io_backend == MP3_IO_MMAP) {
+            fprintf(stderr, "*error* : --follow needs a file and does not take --index, --seek, --probe or the mmap backend\n");
+            return -1;
+        }
 
-///////////////////////////////////////////////////////////////////
-static int
-id3_analyzation_v1(FILE *fp,
+        memset(&follow, 0x00, sizeof(mp3_follow));
+        follow.interval = interval;
+        follow.idle = idle;
+        follow.poll = (use_follow == 2);
+        if(state_path) {
+            follow.state_path = (char *)malloc(strlen(state_path) + 1);
+            if(follow.state_path)
+                strcpy(follow.state_path, state_path);
+        }
+        else {
+            follow.state_path = (char *)malloc(strlen(mp3demuxer.filename) + sizeof(MP3_FOLLOW_SUFFIX));
+            if(follow.state_path) {
+                strcpy(follow.state_path, mp3demuxer.filename);
+                strcat(follow.state_path, MP3_FOLLOW_SUFFIX);
+            }
+        }
+
+        if(mp3demuxer.output_format == MP3_OUTPUT_SUMMARY)
+            mp3demuxer.quiet = 1;
+        else if(mp3demuxer.output_format == MP3_OUTPUT_STATISTICS)
+            mp3demuxer.stats = stats = (mp3_stream_stats *)calloc(1, sizeof(mp3_stream_stats));
+        else if(mp3demuxer.output_format != MP3_OUTPUT_DUMP) {
+            mp3demuxer.writer = writer = (mp3_writer *)malloc(sizeof(mp3_writer));
+            if(writer) {
+                mp3_writer_init(writer, mp3demuxer.output_format);
+                writer->counters = mp3demuxer.counters;
+            }
+        }
+
+        //formats after summary need a writer or the statistics
+        if(follow.state_path &&
+            (mp3demuxer.output_format <= MP3_OUTPUT_SUMMARY || writer || stats))
+            result = mp3_follow_run(&mp3demuxer, &follow, report);
+        if(result >= 0 && use_stats)
+            mp3_counters_print(&counters, use_stats == 2, stderr);
+
+        free(writer);
+        free(stats);
+        free(follow.state_path);
+        return result < 0 ? -1 : 0;
+#endif
+    }
+
+    if(verify_crc || side_info) {
+        mp3_source source;
+        int result;
+
+        if(verify_crc && side_info) {
+            fprintf(stderr, "*error* : --verify-crc and --side-info are separate passes\n");
+            return -1;
+        }
+        fp = NULL;
+        if(0 == strcmp(mp3demuxer.filename, "-")) {
+            stream = (mp3_stream *)malloc(sizeof(mp3_stream));
+            if(!stream)
+                return -1;
+#ifdef WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            mp3_source_open_stream(&source, stream, fileno(stdin));
+        }
+        else {
+            fp = fopen(mp3demuxer.filename, "rb");//open
+            if(!fp) {
+                fprintf(stderr, "*error* : file open failed : at %s\n", mp3demuxer.filename);
+                return -1;
+            }
+#ifndef WIN32
+            if(mp3_source_open_mmap(&source, fileno(fp)))
+#endif
+            if(mp3_source_open_fd(&source, fileno(fp))) {
+                fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.filename);
+                fclose(fp);//close
+                return -1;
+            }
+        }
+        source.counters = mp3demuxer.counters;
+
+        phase_begin = mp3_counters_begin(mp3demuxer.counters);
+        result = verify_crc ?
+            mp3_verify_crc(&mp3demuxer, &source, stdout) :
+            mp3_side_info_stats(&mp3demuxer, &source, stdout);
+        mp3_counters_end(mp3demuxer.counters, MP3_PHASE_SCAN, phase_begin);
+        mp3_source_close(&source);
+        if(fp)
+            fclose(fp);//close
+        free(stream);
+
+        if(result < 0) {
+            fprintf(stderr, "*error* : analyzation failed\n");
+            return -1;
+        }
+        if(use_stats)
+            mp3_counters_print(&counters, use_stats == 2, stderr);
+        return result;
+    }
+
+    //"-" reads a pipe front to back
+    if(0 == strcmp(mp3demuxer.filename, "-")) {
+        if(use_index || use_seek || mp3demuxer.probe || mp3demuxer.io_backend == MP3_IO_MMAP) {
+            fprintf(stderr, "*error* : --index, --seek, --probe and the mmap backend need a seekable file\n");
+            return -1;
+        }
+        stream = (mp3_stream *)malloc(sizeof(mp3_stream));
+        if(!stream)
+            return -1;
+#ifdef WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        mp3_source_open_stream(&stream_source, stream, fileno(stdin));
+        stream_source.counters = mp3demuxer.counters;
+    }
+
+    //check header
+    if(stream) {
+        read_size = stream_source.read(&stream_source, 0, mp3_header, 4) ? 0 : 4;
+    }
+    else {
+        fp = fopen(mp3demuxer.filename, "rb");//open
+        if(!fp) {
+            fprintf(stderr, "*error* : file open failed : at %s\n", mp3demuxer.filename);
+            return -1;
+        }
+        read_size = fread(mp3_header, 1, 4, fp);
+        fclose(fp);//close
+    }
+
+    if(read_size != 4) {
+        fprintf(stderr, "*error* : invalid file size\n");
+        free(stream);
+        return -1;
+    }
+
+    //machine readable formats keep stdout for records only
+    FILE *report = (mp3demuxer.output_format <= MP3_OUTPUT_SUMMARY ||
+                    mp3demuxer.output_format == MP3_OUTPUT_STATISTICS) ? stdout : stderr;
+
+    switch(mp3demuxer_select(&mp3demuxer, mp3_header)) {
+    case 1:
+        fprintf(report, "mp3v1\n");
+        break;
+    case 2:
+        fprintf(report, "mp3v2\n");
+        break;
+    default:
+        fprintf(stderr, "*error* : invalid header\n");
+        free(stream);
+        return -1;
+    }
+
+    //frame index
+    if(use_index) {
+        if(mp3_index_load(&frame_index, mp3demuxer.filename))
+            fprintf(stderr, "*warning* : frame index unavailable : at %s\n", mp3demuxer.filename);
+        else
+            mp3demuxer.index = &frame_index;
+    }
+    
+    //check header
+    fp = NULL;
+    if(!stream) {
+        fp = fopen(mp3demuxer.filename, "rb");//open
+        if(!fp) {
+            fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.filename);
+            if(mp3demuxer.index)
+                mp3_index_free(mp3demuxer.index);
+            return -1;
+        }
+    }
+
+    uint32_t num_frame;
+    uint32_t sample_rate;
+    uint8_t channel;
+    uint8_t version;
+    uint8_t layer;
+    int result;
+
+    if(mp3demuxer.output_format == MP3_OUTPUT_SUMMARY)
+        mp3demuxer.quiet = 1;
+    else if(mp3demuxer.output_format == MP3_OUTPUT_STATISTICS) {
+        stats = (mp3_stream_stats *)calloc(1, sizeof(mp3_stream_stats));
+        if(!stats) {
+            if(fp)
+                fclose(fp);//close
+            free(stream);
+            if(mp3demuxer.index)
+                mp3_index_free(mp3demuxer.index);
+            return -1;
+        }
+        mp3demuxer.stats = stats;
+        mp3demuxer.probe = 0;//the headers are needed
+    }
+    else if(mp3demuxer.output_format != MP3_OUTPUT_DUMP) {
+        writer = (mp3_writer *)malloc(sizeof(mp3_writer));
+        if(!writer) {
+            if(fp)
+                fclose(fp);//close
+            free(stream);
+            if(mp3demuxer.index)
+                mp3_index_free(mp3demuxer.index);
+            return -1;
+        }
+        mp3_writer_init(writer, mp3demuxer.output_format);
+        writer->counters = mp3demuxer.counters;
+        mp3demuxer.writer = writer;
+    }
+
+    phase_begin = mp3_counters_begin(mp3demuxer.counters);
+    if(stream) {
+        result = id3_analyzation_stream(&mp3demuxer,
+                            &stream_source,
+                            &num_frame,
+                            &sample_rate,
+                            &channel,
+                            &version,
+                            &layer);
+        free(stream);
+    }
+    else {
+        result = mp3demuxer.analyze(&mp3demuxer,
+                            fp,
+                            &num_frame,
+                            &sample_rate,
+                            &channel,
+                            &version,
+                            &layer);
+        fclose(fp);//close
+    }
+    mp3_counters_end(mp3demuxer.counters, MP3_PHASE_SCAN, phase_begin);
+
+    if(writer) {
+        phase_begin = mp3_counters_begin(mp3demuxer.counters);
+        if(mp3_writer_flush(writer) && 0 == result) {
+            fprintf(stderr, "*error* : output write failed\n");
+            result = -1;
+        }
+        mp3_counters_end(mp3demuxer.counters, MP3_PHASE_OUTPUT, phase_begin);
+        free(writer);
+        mp3demuxer.writer = NULL;
+    }
+
+    if(stats) {
+        if(0 == result)
+            mp3_stats_print(stats, report);
+        free(stats);
+        mp3demuxer.stats = NULL;
+    }
+
+    if(result) {
+        fprintf(stderr, "*error* : analyzation failed\n");
+        if(mp3demuxer.index)
+            mp3_index_free(mp3demuxer.index);
+        return -1;
+    }
+
+    if(mp3demuxer.probe || mp3demuxer.output_format == MP3_OUTPUT_SUMMARY) {
+        static const char* probe_string[] = { "scan", "Xing", "Info", "VBRI" };
+        double duration = sample_rate ? (double)mp3demuxer.audio_samples / sample_rate : 0.0;
+
+        if(mp3demuxer.probe)
+            fprintf(report, "Probe      : %s\n", probe_string[mp3demuxer.vbr_header.type]);//dump
+        fprintf(report, "Frames     : %u\n", num_frame);//dump
+        fprintf(report, "Duration   : %.3f\n", duration);//dump
+        fprintf(report, "Bitrate    : %u\n", duration > 0.0 ? (uint32_t)(mp3demuxer.audio_bytes * 8 / duration) : 0);//dump
+    }
+
+    if(mp3demuxer.junk_count)
+        fprintf(report, "Junk Total : %llu regions   %llu bytes\n",
+            (unsigned long long)mp3demuxer.junk_count,
+            (unsigned long long)mp3demuxer.junk_bytes);//dump
+
+    if(mp3demuxer.index &&
+        (mp3demuxer.index->dirty || mp3demuxer.index->state != MP3_INDEX_VALID)) {
+        if(mp3_index_save(mp3demuxer.index))
+            fprintf(stderr, "*warning* : frame index write failed : at %s\n", mp3demuxer.index->path);
+    }
+
+    //seek
+    if(use_seek) {
+        fp = fopen(mp3demuxer.filename, "rb");//open
+        if(!fp) {
+            fprintf(stderr, "*error* : file open for seek failed : at %s\n", mp3demuxer.filename);
+            if(mp3demuxer.index)
+                mp3_index_free(mp3demuxer.index);
+            return -1;
+        }
+
+        phase_begin = mp3_counters_begin(mp3demuxer.counters);
+        result = mp3demuxer.skip_frame(&mp3demuxer, fp, &seek_frame);
+        mp3_counters_end(mp3demuxer.counters, MP3_PHASE_SCAN, phase_begin);
+        if(result < 0) {
+            fprintf(stderr, "*error* : seek failed\n");
+            fclose(fp);//close
+            if(mp3demuxer.index)
+                mp3_index_free(mp3demuxer.index);
+            return -1;
+        }
+        fprintf(report, "Seek       : %u%s   Pos : %ld\n", seek_frame, result ? " (end)" : "", ftell(fp));//dump
+        fclose(fp);//close
+    }
+
+    if(mp3demuxer.index)
+        mp3_index_free(mp3demuxer.index);
+
+    //stderr: stdout may carry records
+    if(use_stats)
+        mp3_counters_print(&counters, use_stats == 2, stderr);
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////
+//pick the analysis functions from the first 4 bytes, 1:mp3v1 2:mp3v2 -2:unknown
+static int
+mp3demuxer_select(mp3demuxer_context *ctx, const uint8_t *mp3_header)
+{
+    if(mp3_header[0] == 0xff ||
+        (mp3_header[1] & 0xe0) == 0xe0) {//MP3Header
+            ctx->analyze = id3_analyzation_v1;
+            ctx->skip_frame = id3_skip_frame_v1;
+            return 1;
+    }
+    else if (mp3_header[0] == 0x49 &&
+                mp3_header[1] == 0x44 &&
+                mp3_header[2] == 0x33) {//ID3Header
+            ctx->analyze = id3_analyzation_v2;
+            ctx->skip_frame = id3_skip_frame_v2;
+            return 2;
+    }
+
+    return -2;
+}
+
+static int
+id3_analyzation_v1(mp3demuxer_context *ctx,
+                    FILE *fp,
+                    uint32_t *num_frame,
+                    uint32_t *sample_rate,
+                    uint8_t *channel,
+                    uint8_t *version,
+                    uint8_t *layer)
+{
+    if(ctx->probe &&
+        0 == id3_probe_vbr_header(ctx, fp, 0, num_frame, sample_rate, channel, version, layer))
+        return 0;
+
+    return id3_analyzation_source(ctx, fp, 0, num_frame, sample_rate, channel, version, layer);
+}
+
+//open the byte source of the selected backend, then scan it
+static int
+id3_analyzation_source(mp3demuxer_context *ctx,
+                    FILE *fp,
+                    uint64_t begin_pos,
+                    uint32_t *num_frame,
+                    uint32_t *sample_rate,
+                    uint8_t *channel,
+                    uint8_t *version,
+                    uint8_t *layer)
+{
+    mp3_source source;
+    int result;
+
+#ifndef WIN32
+    if(ctx->io_backend == MP3_IO_MMAP)
+        result = mp3_source_open_mmap(&source, fileno(fp));
+    else
+#endif
+        result = mp3_source_open_fd(&source, fileno(fp));
+    if(result)
+        return -1;
+    source.counters = ctx->counters;
+
+    result = id3_analyzation_v1_internal(ctx, &source, begin_pos, num_frame, sample_rate, channel, version, layer);
+
+    mp3_source_close(&source);
+    return result;
+}
+
+//a source the caller opened, pipe input or batch read ahead; the ID3v2
+//tag is skipped on the way
+static int
+id3_analyzation_stream(mp3demuxer_context *ctx,
+                    mp3_source *source,
                     uint32_t *num_frame,
                     uint32_t *sample_rate,
                     uint8_t *channel,
                     uint8_t *version,
                     uint8_t *layer)
 {
-    return id3_analyzation_v1_internal(fp, 0, num_frame, sample_rate, channel, version, layer);
+    uint64_t begin_pos;
+    uint64_t data_end;
+
+    //a cut ID3v2 header fails as in id3_analyzation_v2
+    if(ctx->analyze == id3_analyzation_v2 && source->size < 10)
+        return -1;
+    if(mp3_source_audio_region(source, &begin_pos, &data_end))
+        return -1;
+
+    return id3_analyzation_v1_internal(ctx, source, begin_pos, num_frame, sample_rate, channel, version, layer);
 }
 //[t[̏Ȃ
 static int
-id3_analyzation_v1_internal(FILE *fp,
-                    uint32_t begin_pos,
+id3_analyzation_v1_internal(mp3demuxer_context *ctx,
+                    mp3_source *source,
+                    uint64_t begin_pos,
                     uint32_t *num_frame,
                     uint32_t *sample_rate,
                     uint8_t *channel,
@@ -305,285 +1409,2777 @@ id3_analyzation_v1_internal(FILE *fp,
                     uint8_t *layer)
 {
     mp3_frame_header header;
-    uint8_t data[4];
-    size_t read_size;
+    mp3_frame_iter iter;
+    mp3_frame_event event;
     size_t frame_count = 0;
 
-    size_t frame_size = 0;
-    size_t data_end;
-    
-    size_t pos = 0;
+    uint64_t audio_begin;
+    uint64_t data_end;
 
-    uint32_t sr, br;
+    size_t pos;
+    int result;
 
-    uint8_t tag_exist = 0;
+    memset(&header, 0, sizeof(header));
 
-    if(fseek(fp, 0, SEEK_END))//end
+    //TAG
+    if(mp3_source_audio_region(source, &audio_begin, &data_end))
         return -1;
 
-    data_end = ftell(fp);
+    if(!ctx->quiet && ctx->output_format == MP3_OUTPUT_DUMP) {
+        printf("Data Start : %zd\n", (size_t)begin_pos);//dump
+        if(!source->stream)
+            printf("Data End   : %zd\n", (size_t)data_end);//dump
+    }
+
+    pos = begin_pos;
+    if(ctx->index)
+        pos = mp3_index_replay(ctx, begin_pos, &header, &frame_count);
 
-    //TAG
-    if(data_end > 128) {
-        fseek(fp, -128, SEEK_END);
-        fread(data, 1, 4, fp);
-        if(0 == memcmp(data, "TAG", 3))
-            tag_exist = 1;
-    }
-    if(tag_exist)
-        data_end -= 128;
+#ifndef WIN32
+    if(source->data &&
+        ctx->scan_threads > 1 &&
+        pos < data_end &&
+        data_end - pos >= 2 * MP3_PARALLEL_MIN_CHUNK) {
+        result = mp3_parallel_scan(ctx, source, pos, data_end, &header, &frame_count);
+        if(result)
+            return result;
+        pos = data_end;
+    }
+#endif
+
+    mp3_iter_init(&iter, source, pos, data_end);
+    iter.strict = ctx->strict;
+    if(ctx->sync_search)
+        iter.sync_search = ctx->sync_search;
+
+    while ((result = mp3_iter_next(&iter, &event)) > 0) {
+
+        if(event.type == MP3_EVENT_JUNK) {
+            mp3_report_junk(ctx, event.offset, event.size);
+            continue;
+        }
+        header = event.header;
+
+        if(!ctx->quiet)
+            mp3_emit_frame(ctx, frame_count, event.offset, &header);
+
+        frame_count++;
+
+        if(ctx->index && mp3_index_append(ctx->index, event.offset, event.raw, event.size))
+            return -1;
+
+        ctx->audio_bytes += event.size;
+        ctx->audio_samples += mp3_samples_per_frame(&header);
+    }
+    if(result < 0)
+        return result;//error
+
+    //a stream knows its end only now
+    if(source->stream && !ctx->quiet && ctx->output_format == MP3_OUTPUT_DUMP)
+        printf("Data End   : %zd\n", (size_t)iter.data_end);//dump
+
+    *num_frame = frame_count;
+    *sample_rate = sampling_rate_table[header.version][header.sampling_frequency_index];
+    *channel = channel_table[header.channel_mode];
+    *version = header.version;
+    *layer = header.layer;
+
+    return 0;
+}
+
+static int
+id3_analyzation_v2(mp3demuxer_context *ctx,
+                    FILE *fp,
+                    uint32_t *num_frame,
+                    uint32_t *sample_rate,
+                    uint8_t *channel,
+                    uint8_t *version,
+                    uint8_t *layer)
+{
+    uint8_t data[10];
+    uint32_t read_size;
+    uint32_t id3v2_length;
+
+    read_size = fread(data, 1, 10, fp);
+    if(read_size != 10)
+        return -1;
     
-    printf("Data Start : %zd\n", begin_pos);//dump
-    printf("Data End   : %zd\n", data_end);//dump
+    if(data[0] != 0x49 ||
+        data[1] != 0x44 ||
+        data[2] != 0x33)
+        return -2;
+
+    id3v2_length = 0;
+    id3v2_length = ((data[6] & 0x7F) << 21) |
+                    ((data[7] & 0x7F) << 14) |
+                    ((data[8] & 0x7F) << 7) |
+                    ((data[9] & 0x7F) << 0);
 
-    if(fseek(fp, begin_pos, SEEK_SET))//start
+    if(fseek(fp, id3v2_length, SEEK_CUR))
         return -1;
 
-    while (1) {
-        
-        pos = ftell(fp);
+    if(ctx->probe &&
+        0 == id3_probe_vbr_header(ctx, fp, 10 + id3v2_length, num_frame, sample_rate, channel, version, layer))
+        return 0;
 
-        if(data_end <= pos)
-            break;//end
-    
-        read_size = fread(data, 1, 4, fp);
+    //search
 
-        if(read_size < 4) {
-            return -1;//error
-        }
+    return id3_analyzation_source(ctx, fp, 10 + id3v2_length, num_frame, sample_rate, channel, version, layer);
+}
+
+static int
+id3_skip_frame_v1(mp3demuxer_context *ctx, FILE *fp, uint32_t *frame)
+{
+    int result;
+    uint32_t skip_first = 1;
+
+    if(ctx->index && ctx->index->state == MP3_INDEX_VALID)
+        return mp3_index_skip(ctx->index, fp, frame);
+
+    result = id3_skip_frame_v1_internal(ctx, fp, 0, &skip_first);
+    if(0 != result)//skip first frame
+        return result;
+    if(1 != skip_first)
+        return -2;
+
+    return id3_skip_frame_v1_internal(ctx, fp, ftell(fp), frame);
+}
 
+static int
+id3_skip_frame_v1_internal(mp3demuxer_context *ctx, FILE *fp, uint32_t begin_pos, uint32_t *frame)
+{
+    mp3_source source;
+    mp3_frame_iter iter;
+    uint64_t frame_count = 0;
+
+    uint64_t audio_begin;
+    uint64_t data_end;
+    int result = 0;
+
+    if(mp3_source_open_fd(&source, fileno(fp)))
+        return -1;
+    source.counters = ctx->counters;
+
+    //TAG
+    if(mp3_source_audio_region(&source, &audio_begin, &data_end))
+        return -1;
+
+    mp3_iter_init(&iter, &source, begin_pos, data_end);
+    iter.strict = ctx->strict;
+    if(ctx->sync_search)
+        iter.sync_search = ctx->sync_search;
+
+    result = mp3_iter_skip(&iter, *frame, &frame_count);
+    if(result == 0 ||
+        (result == -1 && source.size - iter.pos < 4)) {
+        *frame = (uint32_t)frame_count;
+        result = 1;//end
+    }
+    else if(result > 0)
+        result = 0;
+
+    mp3_source_close(&source);
+
+    if(result >= 0 && fseek(fp, iter.pos, SEEK_SET))
+        return -1;
+
+    return result;
+}
+static int
+id3_skip_frame_v2(mp3demuxer_context *ctx, FILE *fp, uint32_t *frame)
+{
+    uint8_t data[10];
+    uint32_t read_size;
+    uint32_t id3v2_length;
+
+    uint32_t skip_first = 1;
+
+    if(ctx->index && ctx->index->state == MP3_INDEX_VALID)
+        return mp3_index_skip(ctx->index, fp, frame);
 
-#if 1
-        if(data[0] != 0xff ||
-            (data[1] & 0xe0) != 0xe0)
-                return -2;//error
+    if(fseek(fp, 0, SEEK_SET))
+        return -1;
+
+    read_size = fread(data, 1, 10, fp);
+    if(read_size != 10)
+        return -1;
+    
+    if(data[0] != 0x49 ||
+        data[1] != 0x44 ||
+        data[2] != 0x33)
+        return -1;
+
+    id3v2_length = 0;
+    id3v2_length = ((data[6] & 0x7F) << 21) |
+                    ((data[7] & 0x7F) << 14) |
+                    ((data[8] & 0x7F) << 7) |
+                    ((data[9] & 0x7F) << 0);
+
+    if(fseek(fp, id3v2_length, SEEK_CUR))
+        return -1;
+
+    int result;
+    result = id3_skip_frame_v1_internal(ctx, fp, ftell(fp), &skip_first);
+    if(0 != result)//skip first frame
+        return result;
+    if(1 != skip_first)
+        return -2;
+
+    return id3_skip_frame_v1_internal(ctx, fp, ftell(fp), frame);
+}
+
+///////////////////////////////////////////////////////////////////
+// Xing/Info/VBRI probe
+//
+// The first frame of most encodes carries a Xing/Info (LAME) or VBRI
+// (Fraunhofer) header with the frame count and byte count of the stream.
+// When it agrees with the file size, analysis is answered from it
+// without walking the frames.
+
+static uint32_t
+mp3_read_be32(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) |
+            ((uint32_t)data[1] << 16) |
+            ((uint32_t)data[2] << 8) |
+            ((uint32_t)data[3] << 0);
+}
+
+//0:found 1:no header
+static int
+mp3_parse_vbr_header(const uint8_t *frame, size_t frame_size, mp3_frame_header *header, mp3_vbr_header *vbr)
+{
+    size_t offset = 0;
+    uint32_t flags;
+    mp3_vbr_type type;
+
+    memset(vbr, 0x00, sizeof(mp3_vbr_header));
+
+    type = mp3_frame_vbr_tag(header, frame, frame_size, &offset);
+    if((type == MP3_VBR_XING || type == MP3_VBR_INFO) &&
+        offset + 8 <= frame_size) {
+
+        vbr->type = type;
+        flags = mp3_read_be32(frame + offset + 4);
+        offset += 8;
+
+        if(flags & 0x01) {//frames
+            if(offset + 4 > frame_size)
+                return 1;
+            vbr->frames = mp3_read_be32(frame + offset);
+            offset += 4;
+        }
+        if(flags & 0x02) {//bytes
+            if(offset + 4 > frame_size)
+                return 1;
+            vbr->bytes = mp3_read_be32(frame + offset);
+            offset += 4;
+        }
+        if(flags & 0x04) {//toc
+            if(offset + 100 > frame_size)
+                return 1;
+            memcpy(vbr->toc, frame + offset, 100);
+            vbr->has_toc = 1;
+        }
+        return vbr->frames ? 0 : 1;
+    }
+
+    if(type == MP3_VBR_VBRI &&
+        offset + 18 <= frame_size) {
+        vbr->type = MP3_VBR_VBRI;
+        vbr->bytes = mp3_read_be32(frame + offset + 10);
+        vbr->frames = mp3_read_be32(frame + offset + 14);
+        return vbr->frames ? 0 : 1;
+    }
+
+    return 1;
+}
+
+//0:answered from the header 1:fall back to the scan -1:error
+static int
+id3_probe_vbr_header(mp3demuxer_context *ctx,
+                    FILE *fp,
+                    uint32_t begin_pos,
+                    uint32_t *num_frame,
+                    uint32_t *sample_rate,
+                    uint8_t *channel,
+                    uint8_t *version,
+                    uint8_t *layer)
+{
+    mp3_frame_header header;
+    mp3_source source;
+    uint8_t frame[4096];
+    size_t read_size;
+    size_t frame_size;
+    uint64_t audio_begin;
+    uint64_t data_end;
+    size_t region;
+    size_t min_size, max_size;
+    mp3_vbr_header *vbr = &ctx->vbr_header;
+
+    //ID3v1 and APEv2 trailers
+    fflush(fp);
+    if(mp3_source_open_fd(&source, fileno(fp)))
+        return -1;
+    if(mp3_source_audio_region(&source, &audio_begin, &data_end)) {
+        mp3_source_close(&source);
+        return -1;
+    }
+    mp3_source_close(&source);
+    if(data_end <= begin_pos)
+        return 1;
+    region = data_end - begin_pos;
+
+    if(fseek(fp, begin_pos, SEEK_SET))
+        return -1;
+    read_size = fread(frame, 1, sizeof(frame), fp);
+    if(read_size < 4 ||
+        frame[0] != 0xff ||
+        (frame[1] & 0xe0) != 0xe0)
+        return 1;
+
+    parse_mp3header(frame, &header);
+    frame_size = mp3_frame_size(&header);
+    if(frame_size < 4)
+        return 1;
+    if(frame_size > read_size)
+        frame_size = read_size;
+
+    if(mp3_parse_vbr_header(frame, frame_size, &header, vbr))
+        return 1;
+
+    //quick check against the file size
+    if(vbr->bytes) {
+        if(vbr->bytes > region + region / 64 ||
+            vbr->bytes < region - region / 64) {
+            vbr->type = MP3_VBR_NONE;
+            return 1;
+        }
+    }
+    else {
+        mp3_frame_header bound = header;
+
+        bound.padding_bit = 0;
+        bound.bitrate_index = 1;
+        min_size = mp3_frame_size(&bound);
+        bound.bitrate_index = 14;
+        bound.padding_bit = 1;
+        max_size = mp3_frame_size(&bound);
+        if(region / vbr->frames < min_size ||
+            region / vbr->frames > max_size) {
+            vbr->type = MP3_VBR_NONE;
+            return 1;
+        }
+        vbr->bytes = (uint32_t)region;
+    }
+
+    //the tag frame itself is a frame of the stream, as the scan counts it
+    ctx->audio_bytes = region;
+    ctx->audio_samples = ((uint64_t)vbr->frames + 1) * mp3_samples_per_frame(&header);
+
+    *num_frame = vbr->frames + 1;
+    *sample_rate = sampling_rate_table[header.version][header.sampling_frequency_index];
+    *channel = channel_table[header.channel_mode];
+    *version = header.version;
+    *layer = header.layer;
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////
+// frame index
+
+static void
+mp3_index_stat(const struct stat *st, int64_t *mtime_sec, int64_t *mtime_nsec)
+{
+    *mtime_sec = st->st_mtime;
+#if defined(WIN32)
+    *mtime_nsec = 0;
+#elif defined(__APPLE__)
+    *mtime_nsec = st->st_mtimespec.tv_nsec;
+#else
+    *mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+}
+
+static uint32_t
+mp3_index_pack(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) |
+            ((uint32_t)data[1] << 16) |
+            ((uint32_t)data[2] << 8) |
+            ((uint32_t)data[3] << 0);
+}
+
+static void
+mp3_index_unpack(uint32_t header, uint8_t *data)
+{
+    data[0] = (header >> 24) & 0xff;
+    data[1] = (header >> 16) & 0xff;
+    data[2] = (header >> 8) & 0xff;
+    data[3] = (header >> 0) & 0xff;
+}
+
+//0:loaded(state tells how much is usable) -1:error
+static int
+mp3_index_load(mp3_frame_index *index, const char *filename)
+{
+    struct stat st;
+    FILE *fp;
+    FILE *mp3_fp;
+    mp3_frame_index_file_header file_header;
+    mp3_frame_index_entry *last;
+    uint8_t data[4];
+    size_t read_size;
+
+    memset(index, 0x00, sizeof(mp3_frame_index));
+
+    if(stat(filename, &st))
+        return -1;
+
+    index->file_size = st.st_size;
+    mp3_index_stat(&st, &index->mtime_sec, &index->mtime_nsec);
+
+    index->path = (char *)malloc(strlen(filename) + sizeof(MP3_INDEX_SUFFIX));
+    if(!index->path)
+        return -1;
+    strcpy(index->path, filename);
+    strcat(index->path, MP3_INDEX_SUFFIX);
+
+    fp = fopen(index->path, "rb");
+    if(!fp)
+        return 0;//no sidecar yet
+
+    read_size = fread(&file_header, 1, sizeof(file_header), fp);
+    if(read_size != sizeof(file_header) ||
+        0 != memcmp(file_header.magic, MP3_INDEX_MAGIC, 8) ||
+        file_header.entry_size != sizeof(mp3_frame_index_entry) ||
+        file_header.count == 0 ||
+        file_header.file_size > index->file_size) {
+        fclose(fp);
+        return 0;//stale or foreign, rebuild
+    }
+
+    index->entries = (mp3_frame_index_entry *)malloc(file_header.count * sizeof(mp3_frame_index_entry));
+    if(!index->entries) {
+        fclose(fp);
+        return -1;
+    }
+    read_size = fread(index->entries, sizeof(mp3_frame_index_entry), file_header.count, fp);
+    fclose(fp);
+    if(read_size != file_header.count) {
+        mp3_index_free(index);
+        return mp3_index_load(index, filename) ? -1 : 0;
+    }
+
+    index->count = file_header.count;
+    index->capacity = file_header.count;
+    index->audio_begin = file_header.audio_begin;
+
+    if(file_header.file_size == index->file_size &&
+        file_header.mtime_sec == index->mtime_sec &&
+        file_header.mtime_nsec == index->mtime_nsec) {
+        index->state = MP3_INDEX_VALID;
+        return 0;
+    }
+
+    if(file_header.file_size == index->file_size)
+        goto rebuild;//rewritten in place
+
+    //the file grew: keep the entries if the last indexed frame is still
+    //there and the old tail was not an ID3v1 tag
+    mp3_fp = fopen(filename, "rb");
+    if(!mp3_fp)
+        goto rebuild;
+
+    last = &index->entries[index->count - 1];
+    if(fseek(mp3_fp, last->offset, SEEK_SET) ||
+        4 != fread(data, 1, 4, mp3_fp) ||
+        mp3_index_pack(data) != last->header) {
+        fclose(mp3_fp);
+        goto rebuild;
+    }
+    if(file_header.file_size > 128) {
+        if(fseek(mp3_fp, file_header.file_size - 128, SEEK_SET) ||
+            4 != fread(data, 1, 4, mp3_fp) ||
+            0 == memcmp(data, "TAG", 3)) {
+            fclose(mp3_fp);
+            goto rebuild;
+        }
+    }
+    fclose(mp3_fp);
+
+    index->state = MP3_INDEX_GROWN;
+    return 0;
+
+rebuild:
+    index->count = 0;
+    index->state = MP3_INDEX_NONE;
+    return 0;
+}
+
+static int
+mp3_index_save(mp3_frame_index *index)
+{
+    mp3_frame_index_file_header file_header;
+    char *tmp_path;
+    FILE *fp;
+    size_t wrote_size;
+
+    memset(&file_header, 0x00, sizeof(file_header));
+    memcpy(file_header.magic, MP3_INDEX_MAGIC, 8);
+    file_header.file_size = index->file_size;
+    file_header.mtime_sec = index->mtime_sec;
+    file_header.mtime_nsec = index->mtime_nsec;
+    file_header.audio_begin = index->audio_begin;
+    file_header.count = index->count;
+    file_header.entry_size = sizeof(mp3_frame_index_entry);
+
+    //write aside and rename so a reader never sees a torn sidecar
+    tmp_path = (char *)malloc(strlen(index->path) + 5);
+    if(!tmp_path)
+        return -1;
+    strcpy(tmp_path, index->path);
+    strcat(tmp_path, ".tmp");
+
+    fp = fopen(tmp_path, "wb");
+    if(!fp) {
+        free(tmp_path);
+        return -1;
+    }
+    wrote_size = fwrite(&file_header, 1, sizeof(file_header), fp);
+    if(wrote_size == sizeof(file_header))
+        wrote_size = fwrite(index->entries, sizeof(mp3_frame_index_entry), index->count, fp);
+    if(fclose(fp) || wrote_size != index->count) {
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+#ifdef WIN32
+    remove(index->path);
+#endif
+    if(rename(tmp_path, index->path)) {
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+
+    index->state = MP3_INDEX_VALID;
+    index->dirty = 0;
+    return 0;
+}
+
+static void
+mp3_index_free(mp3_frame_index *index)
+{
+    free(index->entries);
+    free(index->path);
+    memset(index, 0x00, sizeof(mp3_frame_index));
+}
+
+static int
+mp3_index_append(mp3_frame_index *index, size_t pos, const uint8_t *data, size_t frame_size)
+{
+    mp3_frame_index_entry *entry;
+
+    if(index->count == index->capacity) {
+        uint32_t capacity = index->capacity ? index->capacity * 2 : 4096;
+        entry = (mp3_frame_index_entry *)realloc(index->entries, capacity * sizeof(mp3_frame_index_entry));
+        if(!entry)
+            return -1;
+        index->entries = entry;
+        index->capacity = capacity;
+    }
+
+    entry = &index->entries[index->count++];
+    entry->offset = pos;
+    entry->header = mp3_index_pack(data);
+    entry->size = (uint32_t)frame_size;
+    index->dirty = 1;
+
+    return 0;
+}
+
+//dump the indexed frames and return the position the scan resumes from
+static size_t
+mp3_index_replay(mp3demuxer_context *ctx, size_t begin_pos, mp3_frame_header *header, size_t *frame_count)
+{
+    mp3_frame_index *index = ctx->index;
+    mp3_frame_index_entry *entry;
+    uint8_t data[4];
+    size_t pos = begin_pos;
+    uint32_t i;
+
+    if(index->count == 0 || index->audio_begin != begin_pos) {
+        index->count = 0;//ID3v2 tag changed, start over
+        index->state = MP3_INDEX_NONE;
+        index->audio_begin = begin_pos;
+        index->dirty = 1;
+        return begin_pos;
+    }
+
+    for(i = 0; i < index->count; i++) {
+        entry = &index->entries[i];
+        if(entry->offset > pos)
+            mp3_report_junk(ctx, pos, entry->offset - pos);//gap left by a resync
+        pos = entry->offset + entry->size;
+
+        mp3_index_unpack(entry->header, data);
+        parse_mp3header(data, header);
+        if(!ctx->quiet)
+            mp3_emit_frame(ctx, i, entry->offset, header);
+
+        ctx->audio_bytes += entry->size;
+        ctx->audio_samples += mp3_samples_per_frame(header);
+    }
+    *frame_count = index->count;
+
+    entry = &index->entries[index->count - 1];
+    return entry->offset + entry->size;
+}
+
+//same contract as id3_skip_frame_v1 : the first frame is skipped too
+static int
+mp3_index_skip(mp3_frame_index *index, FILE *fp, uint32_t *frame)
+{
+    mp3_frame_index_entry *entry;
+    uint64_t target = (uint64_t)*frame + 1;
+
+    if(index->count == 0)
+        return -2;
+
+    if(target < index->count) {
+        if(fseek(fp, index->entries[target].offset, SEEK_SET))
+            return -1;
+        return 0;
+    }
+
+    //landing just past the last frame is still a seek, not the end
+    entry = &index->entries[index->count - 1];
+    if(fseek(fp, entry->offset + entry->size, SEEK_SET))
+        return -1;
+    if(target == index->count)
+        return 0;
+    *frame = index->count - 1;
+    return 1;
+}
+
+#ifndef WIN32
+///////////////////////////////////////////////////////////////////
+// result cache
+//
+// Writers fill a temporary file next to the entry and rename it over
+// the entry, so a reader sees a whole entry or the one before; racing
+// writers leave one of theirs. The key is taken before the file is
+// read, so a file that changes during the analysis is stored under its
+// old mtime and misses next time. Dropping an entry only costs a scan,
+// which is what makes expiry safe.
+
+//FNV-1a
+static uint64_t
+mp3_cache_fnv(uint64_t hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t i;
+
+    for(i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define MP3_CACHE_FNV_BASIS 0xcbf29ce484222325ULL
+
+static int
+mp3_cache_hash(int fd, uint64_t size, uint64_t *hash)
+{
+    uint8_t *buffer;
+    size_t head = size < MP3_CACHE_HASH_BYTES ? (size_t)size : MP3_CACHE_HASH_BYTES;
+    size_t tail = size - head < MP3_CACHE_HASH_BYTES ? (size_t)(size - head) : MP3_CACHE_HASH_BYTES;
+    mp3_source source;
+
+    buffer = (uint8_t *)malloc(MP3_CACHE_HASH_BYTES);
+    if(!buffer || mp3_source_open_fd(&source, fd)) {
+        free(buffer);
+        return -1;
+    }
+
+    *hash = MP3_CACHE_FNV_BASIS;
+    if(head && source.read(&source, 0, buffer, head)) {
+        free(buffer);
+        return -1;
+    }
+    *hash = mp3_cache_fnv(*hash, buffer, head);
+    if(tail && source.read(&source, size - tail, buffer, tail)) {
+        free(buffer);
+        return -1;
+    }
+    *hash = mp3_cache_fnv(*hash, buffer, tail);
+    if(*hash == 0)
+        *hash = 1;//0 is no hash
+
+    free(buffer);
+    return 0;
+}
+
+static char *
+mp3_cache_path(mp3_cache *cache, const mp3_cache_key *key, uint8_t make_dir)
+{
+    char *path = (char *)malloc(strlen(cache->dir) + 64);
+
+    if(!path)
+        return NULL;
+    sprintf(path, "%s/%02x", cache->dir, (unsigned int)(key->inode & 0xff));
+    if(make_dir && mkdir(path, 0777) && errno != EEXIST) {
+        free(path);
+        return NULL;
+    }
+    sprintf(path + strlen(path), "/%llx-%llx",
+        (unsigned long long)key->device, (unsigned long long)key->inode);
+    return path;
+}
+
+//0:key made -1:not a readable file
+static int
+mp3_cache_key_make(mp3_cache *cache, const char *filename, uint32_t options, mp3_cache_key *key)
+{
+    struct stat st;
+    int fd;
+    int result = 0;
+
+    memset(key, 0x00, sizeof(mp3_cache_key));
+    if(stat(filename, &st) || !S_ISREG(st.st_mode))
+        return -1;
+
+    key->device = st.st_dev;
+    key->inode = st.st_ino;
+    key->size = st.st_size;
+    mp3_index_stat(&st, &key->mtime_sec, &key->mtime_nsec);
+    key->options = options;
+
+    if(cache->verify) {
+        fd = open(filename, O_RDONLY);
+        if(fd < 0)
+            return -1;
+        result = mp3_cache_hash(fd, key->size, &key->hash);
+        close(fd);
+    }
+
+    return result;
+}
+
+//0:hit 1:miss; index is filled when given and the entry has one
+static int
+mp3_cache_load(mp3_cache *cache, const mp3_cache_key *key, mp3_cache_entry *entry, mp3_frame_index *index)
+{
+    char *path;
+    FILE *fp;
+    struct stat st;
+    time_t now;
+    int result = 1;
+
+    path = mp3_cache_path(cache, key, 0);
+    if(!path)
+        return 1;
+    fp = fopen(path, "rb");
+    if(!fp) {
+        free(path);
+        return 1;
+    }
+
+    if(sizeof(mp3_cache_entry) != fread(entry, 1, sizeof(mp3_cache_entry), fp) ||
+        0 != memcmp(entry->magic, MP3_CACHE_MAGIC, 8) ||
+        entry->checksum != mp3_cache_fnv(MP3_CACHE_FNV_BASIS, entry, offsetof(mp3_cache_entry, checksum)) ||
+        0 != memcmp(&entry->key, key, sizeof(mp3_cache_key)) ||
+        entry->entry_size != sizeof(mp3_frame_index_entry))
+        goto done;//changed, torn by a crash or foreign
+
+    if(index && entry->count) {
+        memset(index, 0x00, sizeof(mp3_frame_index));
+        index->entries = (mp3_frame_index_entry *)malloc(entry->count * sizeof(mp3_frame_index_entry));
+        if(!index->entries ||
+            entry->count != fread(index->entries, sizeof(mp3_frame_index_entry), entry->count, fp) ||
+            entry->index_checksum != mp3_cache_fnv(MP3_CACHE_FNV_BASIS, index->entries, entry->count * sizeof(mp3_frame_index_entry))) {
+            mp3_index_free(index);
+            goto done;
+        }
+        index->count = entry->count;
+        index->capacity = entry->count;
+        index->audio_begin = entry->audio_begin;
+        index->file_size = key->size;
+        index->mtime_sec = key->mtime_sec;
+        index->mtime_nsec = key->mtime_nsec;
+        index->state = MP3_INDEX_VALID;
+    }
+    result = 0;
+
+    //keep what is used from expiring, at most one write a day
+    now = time(NULL);
+    if(0 == fstat(fileno(fp), &st) && now - st.st_mtime > MP3_CACHE_TOUCH)
+        utimensat(AT_FDCWD, path, NULL, 0);
+
+done:
+    fclose(fp);
+    free(path);
+    return result;
+}
+
+static int
+mp3_cache_store(mp3_cache *cache, mp3_cache_entry *entry, const mp3_frame_index *index)
+{
+    char *path;
+    char *tmp_path;
+    FILE *fp;
+    int fd;
+    size_t wrote_size = 0;
+
+    memcpy(entry->magic, MP3_CACHE_MAGIC, 8);
+    entry->count = index ? index->count : 0;
+    entry->entry_size = sizeof(mp3_frame_index_entry);
+    entry->index_checksum = mp3_cache_fnv(MP3_CACHE_FNV_BASIS, index ? index->entries : NULL, entry->count * sizeof(mp3_frame_index_entry));
+    entry->checksum = mp3_cache_fnv(MP3_CACHE_FNV_BASIS, entry, offsetof(mp3_cache_entry, checksum));
+
+    path = mp3_cache_path(cache, &entry->key, 1);
+    if(!path)
+        return -1;
+    tmp_path = (char *)malloc(strlen(path) + 16);
+    if(!tmp_path) {
+        free(path);
+        return -1;
+    }
+    //one name per writer, in the directory of the entry
+    strcpy(tmp_path, path);
+    strcpy(strrchr(tmp_path, '/') + 1, ".tmp.XXXXXX");
+
+    fd = mkstemp(tmp_path);
+    fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if(!fp) {
+        if(fd >= 0) {
+            close(fd);
+            remove(tmp_path);
+        }
+        free(tmp_path);
+        free(path);
+        return -1;
+    }
+    fchmod(fd, cache->mode);
+
+    if(sizeof(mp3_cache_entry) == fwrite(entry, 1, sizeof(mp3_cache_entry), fp))
+        wrote_size = entry->count ? fwrite(index->entries, sizeof(mp3_frame_index_entry), entry->count, fp) : 0;
+    if(fclose(fp) || wrote_size != entry->count ||
+        rename(tmp_path, path)) {
+        remove(tmp_path);
+        free(tmp_path);
+        free(path);
+        return -1;
+    }
+
+    free(tmp_path);
+    free(path);
+    return 0;
+}
+
+//entries not used for --cache-expire days, and temporary files of dead writers
+static void
+mp3_cache_expire(mp3_cache *cache)
+{
+    char *path;
+    DIR *top;
+    DIR *dir;
+    struct dirent *shard;
+    struct dirent *item;
+    struct stat st;
+    time_t now = time(NULL);
+    size_t length;
+
+    path = (char *)malloc(strlen(cache->dir) + 512);
+    if(!path)
+        return;
+    top = opendir(cache->dir);
+    if(!top) {
+        free(path);
+        return;
+    }
+
+    while((shard = readdir(top))) {
+        if(strlen(shard->d_name) != 2)
+            continue;
+        sprintf(path, "%s/%s", cache->dir, shard->d_name);
+        length = strlen(path);
+        dir = opendir(path);
+        if(!dir)
+            continue;
+        while((item = readdir(dir))) {
+            if(0 == strcmp(item->d_name, ".") || 0 == strcmp(item->d_name, "..") ||
+                strlen(item->d_name) > 256)
+                continue;
+            sprintf(path + length, "/%s", item->d_name);
+            if(lstat(path, &st) || !S_ISREG(st.st_mode))
+                continue;
+            if(0 == strncmp(item->d_name, ".tmp.", 5) ?
+                now - st.st_mtime > MP3_CACHE_TMP_AGE :
+                cache->expire && now - st.st_mtime > (time_t)cache->expire * 24 * 60 * 60)
+                unlink(path);
+        }
+        closedir(dir);
+    }
+
+    closedir(top);
+    free(path);
+}
+#endif
+
+#ifndef WIN32
+///////////////////////////////////////////////////////////////////
+// batch analysis
+//
+// Files come from directories (recursively, *.mp3 only), list files or
+// stdin. They are sorted largest first and cut into tasks: a large file
+// is a task of its own, small files are packed together. Tasks are dealt
+// round-robin to per-thread deques; a worker takes from the head of its
+// own deque and steals from the tail of the others when it runs dry.
+// One result line is written per file as soon as it is done, or in
+// input order with --ordered.
+
+static int
+mp3_batch_add_file(mp3_batch *batch, const char *path, uint64_t size)
+{
+    mp3_batch_file *file;
+
+    if(batch->file_count == batch->file_capacity) {
+        size_t capacity = batch->file_capacity ? batch->file_capacity * 2 : 1024;
+        file = (mp3_batch_file *)realloc(batch->files, capacity * sizeof(mp3_batch_file));
+        if(!file)
+            return -1;
+        batch->files = file;
+        batch->file_capacity = capacity;
+    }
+
+    file = &batch->files[batch->file_count];
+    file->path = strdup(path);
+    if(!file->path)
+        return -1;
+    file->size = size;
+    file->seq = batch->file_count++;
+
+    return 0;
+}
+
+static int
+mp3_batch_has_mp3_suffix(const char *name)
+{
+    size_t length = strlen(name);
+
+    return length > 4 && 0 == strcasecmp(name + length - 4, ".mp3");
+}
+
+static int
+mp3_batch_add_path(mp3_batch *batch, const char *path, uint8_t from_directory)
+{
+    struct stat st;
+    struct dirent **entries;
+    char *child;
+    int entry_count;
+    int i;
+    int result = 0;
+
+    if(stat(path, &st))
+        return from_directory ? 0 : mp3_batch_add_file(batch, path, 0);//reported as failed
+
+    if(S_ISREG(st.st_mode)) {
+        if(from_directory && !mp3_batch_has_mp3_suffix(path))
+            return 0;
+        return mp3_batch_add_file(batch, path, st.st_size);
+    }
+    if(!S_ISDIR(st.st_mode))
+        return 0;
+
+    //sorted so that --ordered output does not depend on the filesystem
+    entry_count = scandir(path, &entries, NULL, alphasort);
+    if(entry_count < 0) {
+        fprintf(stderr, "*warning* : directory open failed : at %s\n", path);
+        return 0;
+    }
+    for(i = 0; i < entry_count; i++) {
+        if(0 == result &&
+            0 != strcmp(entries[i]->d_name, ".") &&
+            0 != strcmp(entries[i]->d_name, "..")) {
+            child = (char *)malloc(strlen(path) + strlen(entries[i]->d_name) + 2);
+            if(child) {
+                sprintf(child, "%s/%s", path, entries[i]->d_name);
+                result = mp3_batch_add_path(batch, child, 1);
+                free(child);
+            }
+            else {
+                result = -1;
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    return result;
+}
+
+//one path per line, "-" reads stdin
+static int
+mp3_batch_add_list(mp3_batch *batch, const char *list_path)
+{
+    FILE *fp;
+    char line[4096];
+    size_t length;
+    int result = 0;
+
+    fp = strcmp(list_path, "-") ? fopen(list_path, "r") : stdin;
+    if(!fp)
+        return -1;
+
+    while(0 == result && fgets(line, sizeof(line), fp)) {
+        length = strlen(line);
+        while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if(length == 0)
+            continue;
+        result = mp3_batch_add_path(batch, line, 0);
+    }
+
+    if(fp != stdin)
+        fclose(fp);
+    return result;
+}
+
+static int
+mp3_batch_compare_size(const void *a, const void *b)
+{
+    const mp3_batch_file *file_a = (const mp3_batch_file *)a;
+    const mp3_batch_file *file_b = (const mp3_batch_file *)b;
+
+    if(file_a->size != file_b->size)
+        return file_a->size < file_b->size ? 1 : -1;
+    return file_a->seq < file_b->seq ? -1 : (file_a->seq > file_b->seq);
+}
+
+static int
+mp3_batch_plan(mp3_batch *batch)
+{
+    mp3_batch_task *task = NULL;
+    size_t i;
+
+    qsort(batch->files, batch->file_count, sizeof(mp3_batch_file), mp3_batch_compare_size);
+
+    batch->tasks = (mp3_batch_task *)malloc((batch->file_count ? batch->file_count : 1) * sizeof(mp3_batch_task));
+    if(!batch->tasks)
+        return -1;
+
+    for(i = 0; i < batch->file_count; i++) {
+        uint64_t size = batch->files[i].size;
+
+        if(!task ||
+            size >= MP3_BATCH_PACK_FILE_SIZE ||
+            task->bytes + size > MP3_BATCH_PACK_BYTES ||
+            task->count >= MP3_BATCH_PACK_FILES ||
+            task->bytes >= MP3_BATCH_PACK_FILE_SIZE) {
+            task = &batch->tasks[batch->task_count++];
+            task->first = i;
+            task->count = 0;
+            task->bytes = 0;
+        }
+        task->count++;
+        task->bytes += size;
+    }
+
+    batch->queues = (mp3_batch_queue *)calloc(batch->threads, sizeof(mp3_batch_queue));
+    if(!batch->queues)
+        return -1;
+    for(i = 0; i < batch->threads; i++) {
+        pthread_mutex_init(&batch->queues[i].lock, NULL);
+        batch->queues[i].tasks = (size_t *)malloc((batch->task_count / batch->threads + 1) * sizeof(size_t));
+        if(!batch->queues[i].tasks)
+            return -1;
+    }
+    for(i = 0; i < batch->task_count; i++) {
+        mp3_batch_queue *queue = &batch->queues[i % batch->threads];
+        queue->tasks[queue->tail++] = i;
+    }
+
+    return 0;
+}
+
+//-1 when every deque is empty
+static ssize_t
+mp3_batch_take(mp3_batch *batch, uint32_t self)
+{
+    mp3_batch_queue *queue;
+    ssize_t task = -1;
+    uint32_t i;
+
+    queue = &batch->queues[self];
+    pthread_mutex_lock(&queue->lock);
+    if(queue->head < queue->tail)
+        task = queue->tasks[queue->head++];
+    pthread_mutex_unlock(&queue->lock);
+    if(task >= 0)
+        return task;
+
+    for(i = 1; i < batch->threads && task < 0; i++) {
+        queue = &batch->queues[(self + i) % batch->threads];
+        pthread_mutex_lock(&queue->lock);
+        if(queue->head < queue->tail)
+            task = queue->tasks[--queue->tail];
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return task;
+}
+
+static void
+mp3_batch_emit(mp3_batch *batch, size_t seq, char *line)
+{
+    pthread_mutex_lock(&batch->output_lock);
+    if(!batch->ordered) {
+        fputs(line, stdout);
+        free(line);
+    }
+    else {
+        batch->pending[seq] = line;
+        while(batch->next_seq < batch->file_count && batch->pending[batch->next_seq]) {
+            fputs(batch->pending[batch->next_seq], stdout);
+            free(batch->pending[batch->next_seq]);
+            batch->pending[batch->next_seq++] = NULL;
+        }
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&batch->output_lock);
+}
+
+static void
+mp3_batch_emit_summary(mp3_batch *batch, mp3_batch_file *file, const mp3_cache_entry *summary)
+{
+    double duration = summary->sample_rate ? (double)summary->audio_samples / summary->sample_rate : 0.0;
+    char *line;
+
+    line = (char *)malloc(strlen(file->path) + 128);
+    if(!line)
+        return;
+    sprintf(line, "%d\t%u\t%u\t%u\t%.3f\t%u\t%s\n",
+        summary->result,
+        summary->num_frame,
+        summary->sample_rate,
+        summary->channel,
+        duration,
+        duration > 0.0 ? (uint32_t)(summary->audio_bytes * 8 / duration) : 0,
+        file->path);
+    mp3_batch_emit(batch, file->seq, line);
+}
+
+//0:answered from the cache 1:not cached, key is set -1:no key
+static int
+mp3_batch_cache_answer(mp3_batch *batch, mp3_batch_worker *worker, mp3_batch_file *file, mp3_cache_key *key)
+{
+    mp3_cache_entry entry;
+
+    if(mp3_cache_key_make(batch->cache, file->path,
+                        (batch->probe ? MP3_CACHE_PROBE : 0) | (batch->strict ? MP3_CACHE_STRICT : 0), key))
+        return -1;
+    if(mp3_cache_load(batch->cache, key, &entry, NULL))
+        return 1;
+
+    mp3_batch_emit_summary(batch, file, &entry);
+    worker->cache_hits++;
+    if(entry.result)
+        worker->failed++;
+    return 0;
+}
+
+//source is the read ahead of --aio, NULL to open the file here; the
+//result goes to the cache under key when it is given
+static int
+mp3_batch_analyze_file(mp3_batch *batch, mp3_batch_worker *worker, mp3_batch_file *file, mp3_source *source, const mp3_cache_key *key)
+{
+    mp3demuxer_context ctx;
+    mp3_counters *counters = batch->counters ? &worker->counters : NULL;
+    mp3_frame_index index;
+    mp3_cache_entry summary;
+    FILE *fp;
+    uint8_t mp3_header[4];
+    uint32_t num_frame = 0;
+    uint32_t sample_rate = 0;
+    uint8_t channel = 0;
+    uint8_t version = 0;
+    uint8_t layer = 0;
+    uint64_t begin;
+    int format = 0;
+    int result;
+
+    memset(&ctx, 0x00, sizeof(mp3demuxer_context));
+    ctx.filename = file->path;
+    ctx.counters = counters;
+    ctx.io_backend = batch->io_backend;
+    ctx.probe = batch->probe;
+    ctx.strict = batch->strict;
+    ctx.sync_search = batch->sync_search;
+    ctx.quiet = 1;
+
+    //the scan fills a frame index for the cache
+    memset(&index, 0x00, sizeof(mp3_frame_index));
+    if(key)
+        ctx.index = &index;
+
+    if(source) {
+        if(source->read(source, 0, mp3_header, 4))
+            result = -1;
+        else if((format = mp3demuxer_select(&ctx, mp3_header)) < 0)
+            result = -2;
+        else {
+            begin = mp3_counters_begin(counters);
+            result = id3_analyzation_stream(&ctx, source, &num_frame, &sample_rate, &channel, &version, &layer);
+            mp3_counters_end(counters, MP3_PHASE_SCAN, begin);
+        }
+    }
+    //opened once: the format check and the analysis share the handle
+    else if(!(fp = fopen(file->path, "rb"))) {
+        result = -1;
+    }
+    else {
+        if(4 != fread(mp3_header, 1, 4, fp) ||
+            fseek(fp, 0, SEEK_SET))
+            result = -1;
+        else if((format = mp3demuxer_select(&ctx, mp3_header)) < 0)
+            result = -2;
+        else {
+            begin = mp3_counters_begin(counters);
+            result = ctx.analyze(&ctx, fp, &num_frame, &sample_rate, &channel, &version, &layer);
+            mp3_counters_end(counters, MP3_PHASE_SCAN, begin);
+        }
+        fclose(fp);
+    }
+
+    memset(&summary, 0x00, sizeof(mp3_cache_entry));
+    summary.result = result;
+    summary.format = format;
+    if(0 == result) {
+        summary.num_frame = num_frame;
+        summary.sample_rate = sample_rate;
+        summary.channel = channel;
+        summary.probe = ctx.vbr_header.type;
+        summary.audio_bytes = ctx.audio_bytes;
+        summary.audio_samples = ctx.audio_samples;
+        summary.junk_count = ctx.junk_count;
+        summary.junk_bytes = ctx.junk_bytes;
+        summary.audio_begin = index.audio_begin;
+    }
+    mp3_batch_emit_summary(batch, file, &summary);
+
+    //read errors may pass, format errors stay
+    if(key && result != -1) {
+        summary.key = *key;
+        if(0 == mp3_cache_store(batch->cache, &summary, 0 == result ? &index : NULL))
+            worker->cache_stored++;
+    }
+    mp3_index_free(&index);
+
+    return result;
+}
+
+static void *
+mp3_batch_worker_main(void *arg)
+{
+    mp3_batch_worker *worker = (mp3_batch_worker *)arg;
+    mp3_batch *batch = worker->batch;
+    mp3_batch_task *task;
+    mp3_aio_reader *reader = NULL;
+    mp3_aio *aio = NULL;
+    ssize_t task_id;
+    size_t i;
+
+    //one engine and read ahead per worker, stdio if it cannot start
+    if(batch->use_aio && !batch->probe) {
+        aio = mp3_aio_create(batch->aio_backend);
+        reader = (mp3_aio_reader *)malloc(sizeof(mp3_aio_reader));
+        if(!aio || !reader || mp3_aio_reader_init(reader, aio)) {
+            free(reader);
+            reader = NULL;
+        }
+    }
+
+    while((task_id = mp3_batch_take(batch, worker->id)) >= 0) {
+        task = &batch->tasks[task_id];
+        if(reader) {
+            mp3_batch_analyze_task_aio(batch, worker, task, reader);
+            continue;
+        }
+        for(i = 0; i < task->count; i++) {
+            mp3_batch_file *file = &batch->files[task->first + i];
+            mp3_cache_key key;
+            int cached = batch->cache ? mp3_batch_cache_answer(batch, worker, file, &key) : -1;
+
+            if(0 != cached &&
+                mp3_batch_analyze_file(batch, worker, file, NULL, cached > 0 ? &key : NULL))
+                worker->failed++;
+        }
+    }
+
+    if(reader) {
+        mp3_aio_reader_free(reader);
+        free(reader);
+    }
+    mp3_aio_destroy(aio);
+    return NULL;
+}
+
+//the files of a task are read ahead together: head, tail and frames
+static void
+mp3_batch_analyze_task_aio(mp3_batch *batch, mp3_batch_worker *worker, mp3_batch_task *task, mp3_aio_reader *reader)
+{
+    mp3_aio_file files[MP3_BATCH_PACK_FILES];
+    mp3_cache_key keys[MP3_BATCH_PACK_FILES];
+    int cached[MP3_BATCH_PACK_FILES];
+    mp3_source source;
+    struct stat st;
+    size_t i;
+
+    for(i = 0; i < task->count; i++) {
+        //cached files are answered before anything is read ahead
+        cached[i] = batch->cache ? mp3_batch_cache_answer(batch, worker, &batch->files[task->first + i], &keys[i]) : -1;
+        files[i].fd = -1;
+        files[i].size = 0;
+        if(0 == cached[i])
+            continue;
+
+        files[i].fd = open(batch->files[task->first + i].path, O_RDONLY);
+        if(files[i].fd >= 0 && fstat(files[i].fd, &st)) {
+            close(files[i].fd);
+            files[i].fd = -1;
+        }
+        if(files[i].fd >= 0)
+            files[i].size = st.st_size;
+    }
+
+    reader->counters = batch->counters ? &worker->counters : NULL;
+    mp3_aio_reader_start(reader, files, task->count);
+
+    for(i = 0; i < task->count; i++) {
+        mp3_aio_reader_open(reader, &files[i], &source);
+        if(0 != cached[i] &&
+            mp3_batch_analyze_file(batch, worker, &batch->files[task->first + i],
+                files[i].fd >= 0 ? &source : NULL, cached[i] > 0 ? &keys[i] : NULL))
+            worker->failed++;
+        mp3_aio_reader_close(reader, &files[i]);
+    }
+    mp3_aio_reader_finish(reader);
+
+    for(i = 0; i < task->count; i++) {
+        if(files[i].fd >= 0)
+            close(files[i].fd);
+    }
+}
+
+static int
+mp3_batch_run(mp3_batch *batch)
+{
+    mp3_batch_worker *workers;
+    uint32_t i;
+    size_t failed = 0;
+    size_t cache_hits = 0;
+    size_t cache_stored = 0;
+
+    if(batch->threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        batch->threads = cores > 0 ? (uint32_t)cores : 1;
+    }
+
+    if(mp3_batch_plan(batch))
+        return -1;
+
+    if(batch->ordered) {
+        batch->pending = (char **)calloc(batch->file_count ? batch->file_count : 1, sizeof(char *));
+        if(!batch->pending)
+            return -1;
+    }
+    pthread_mutex_init(&batch->output_lock, NULL);
+
+    workers = (mp3_batch_worker *)calloc(batch->threads, sizeof(mp3_batch_worker));
+    if(!workers)
+        return -1;
+
+    for(i = 0; i < batch->threads; i++) {
+        workers[i].batch = batch;
+        workers[i].id = i;
+        if(pthread_create(&workers[i].thread, NULL, mp3_batch_worker_main, &workers[i])) {
+            workers[i].started = 0;
+            mp3_batch_worker_main(&workers[i]);//run inline
+            continue;
+        }
+        workers[i].started = 1;
+    }
+    for(i = 0; i < batch->threads; i++) {
+        if(workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        failed += workers[i].failed;
+        cache_hits += workers[i].cache_hits;
+        cache_stored += workers[i].cache_stored;
+        if(batch->counters)
+            mp3_counters_add(batch->counters, &workers[i].counters);
+    }
+    free(workers);
+
+    pthread_mutex_destroy(&batch->output_lock);
+
+    //stderr: stdout carries the result lines
+    if(batch->cache) {
+        fprintf(stderr, "Cache      : %zu hits   %zu stored\n", cache_hits, cache_stored);//dump
+        mp3_cache_expire(batch->cache);
+    }
+
+    return failed ? 1 : 0;
+}
+
+static void
+mp3_batch_free(mp3_batch *batch)
+{
+    size_t i;
+
+    for(i = 0; i < batch->file_count; i++)
+        free(batch->files[i].path);
+    free(batch->files);
+    free(batch->tasks);
+    if(batch->queues) {
+        for(i = 0; i < batch->threads; i++) {
+            pthread_mutex_destroy(&batch->queues[i].lock);
+            free(batch->queues[i].tasks);
+        }
+        free(batch->queues);
+    }
+    free(batch->pending);
+    memset(batch, 0x00, sizeof(mp3_batch));
+}
+#endif
+
+#ifndef WIN32
+///////////////////////////////////////////////////////////////////
+// follow
+//
+// The file is kept open and walked again whenever it grows: at once on
+// an inotify event, otherwise every interval. Records go out after each
+// walk, rolling totals and the resume state at most once per interval.
+// The state is saved after the records it covers are written, so a
+// restart repeats records rather than losing them.
+
+static volatile sig_atomic_t mp3_follow_stop = 0;
+
+static void
+mp3_follow_signal(int signal_number)
+{
+    (void)signal_number;
+    mp3_follow_stop = 1;
+}
+
+static int
+mp3_follow_state_load(mp3_follow *follow, const struct stat *st)
+{
+    mp3_follow_state state;
+    FILE *fp;
+    size_t read_size;
+
+    fp = fopen(follow->state_path, "rb");
+    if(!fp)
+        return 0;//first run
+
+    read_size = fread(&state, 1, sizeof(state), fp);
+    fclose(fp);
+    if(read_size != sizeof(state) ||
+        0 != memcmp(state.magic, MP3_FOLLOW_MAGIC, 8) ||
+        state.device != (uint64_t)st->st_dev ||
+        state.inode != (uint64_t)st->st_ino ||
+        state.offset > (uint64_t)st->st_size)
+        return -1;//another or a rewritten file
+
+    follow->state = state;
+    follow->resumed = 1;
+    return 0;
+}
+
+static int
+mp3_follow_state_save(mp3_follow *follow)
+{
+    char *tmp_path;
+    FILE *fp;
+    size_t wrote_size;
+
+    //write aside and rename, as the frame index
+    tmp_path = (char *)malloc(strlen(follow->state_path) + 5);
+    if(!tmp_path)
+        return -1;
+    strcpy(tmp_path, follow->state_path);
+    strcat(tmp_path, ".tmp");
+
+    fp = fopen(tmp_path, "wb");
+    if(!fp) {
+        free(tmp_path);
+        return -1;
+    }
+    wrote_size = fwrite(&follow->state, 1, sizeof(follow->state), fp);
+    if(fclose(fp) || wrote_size != sizeof(follow->state) ||
+        rename(tmp_path, follow->state_path)) {
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+
+    follow->saved_offset = follow->state.offset;
+    return 0;
+}
+
+static void
+mp3_follow_watch(mp3_follow *follow, const char *filename)
+{
+    follow->notify_fd = -1;
+#ifdef __linux__
+    if(follow->poll)
+        return;
+    follow->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(follow->notify_fd < 0)
+        return;
+    if(inotify_add_watch(follow->notify_fd, filename,
+                        IN_MODIFY | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB) < 0) {
+        close(follow->notify_fd);
+        follow->notify_fd = -1;
+    }
+#else
+    (void)filename;
+#endif
+}
+
+//sleep until the file changes or timeout ms pass
+static void
+mp3_follow_wait(mp3_follow *follow, const char *filename, int timeout)
+{
+#ifdef __linux__
+    if(follow->notify_fd >= 0) {
+        struct pollfd pfd;
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *event;
+        ssize_t length;
+        ssize_t i;
+
+        pfd.fd = follow->notify_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, timeout) <= 0)
+            return;//timeout or signal
+
+        while((length = read(follow->notify_fd, events, sizeof(events))) > 0) {
+            for(i = 0; i < length; i += sizeof(struct inotify_event) + event->len) {
+                event = (const struct inotify_event *)(events + i);
+                if(event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                    follow->gone = 1;
+            }
+        }
+        return;
+    }
+#endif
+
+    struct stat st;
+
+    poll(NULL, 0, timeout);
+    if(stat(filename, &st) ||
+        (uint64_t)st.st_dev != follow->state.device ||
+        (uint64_t)st.st_ino != follow->state.inode)
+        follow->gone = 1;//rotated away
+}
+
+static void
+mp3_follow_report(mp3demuxer_context *ctx, mp3_follow *follow, FILE *report)
+{
+    double duration = follow->state.sample_rate ? (double)ctx->audio_samples / follow->state.sample_rate : 0.0;
+
+    fprintf(report, "Follow     : frames %llu   duration %.3f   bitrate %u   pos %llu\n",
+        (unsigned long long)follow->state.frames, duration,
+        duration > 0.0 ? (uint32_t)(ctx->audio_bytes * 8 / duration) : 0,
+        (unsigned long long)follow->state.offset);//dump
+    fflush(report);
+}
+
+//walk what was written since the last call; records are flushed here
+static int
+mp3_follow_walk(mp3demuxer_context *ctx, mp3_follow *follow, mp3_frame_iter *iter)
+{
+    mp3_frame_event event;
+    uint64_t phase_begin;
+    int result;
+
+    phase_begin = mp3_counters_begin(ctx->counters);
+    while((result = mp3_iter_next(iter, &event)) > 0) {
+        if(event.type == MP3_EVENT_JUNK) {
+            mp3_report_junk(ctx, event.offset, event.size);
+            continue;
+        }
+
+        if(!ctx->quiet)
+            mp3_emit_frame(ctx, (uint32_t)follow->state.frames, event.offset, &event.header);
+
+        follow->state.frames++;
+        follow->state.sample_rate = sampling_rate_table[event.header.version][event.header.sampling_frequency_index];
+        ctx->audio_bytes += event.size;
+        ctx->audio_samples += mp3_samples_per_frame(&event.header);
+    }
+    mp3_counters_end(ctx->counters, MP3_PHASE_SCAN, phase_begin);
+    if(result < 0)
+        return result;
+
+    //bounded latency: nothing stays in a buffer between walks
+    phase_begin = mp3_counters_begin(ctx->counters);
+    if(ctx->writer)
+        result = mp3_writer_flush(ctx->writer);
+    else if(fflush(stdout))
+        result = -1;
+    mp3_counters_end(ctx->counters, MP3_PHASE_OUTPUT, phase_begin);
+
+    follow->state.offset = iter->pos;
+    follow->state.audio_bytes = ctx->audio_bytes;
+    follow->state.audio_samples = ctx->audio_samples;
+    follow->state.junk_count = ctx->junk_count;
+    follow->state.junk_bytes = ctx->junk_bytes;
+    return result;
+}
+
+static int
+mp3_follow_run(mp3demuxer_context *ctx, mp3_follow *follow, FILE *report)
+{
+    mp3_source source;
+    mp3_frame_iter *iter;
+    struct sigaction action;
+    struct stat st;
+    uint8_t data[10];
+    uint64_t begin_pos;
+    uint64_t end_pos;
+    uint64_t now;
+    uint64_t last_growth;
+    uint64_t last_tick;
+    uint64_t tick_frames;
+    uint64_t interval_ns = (uint64_t)follow->interval * 1000000;
+    int64_t timeout;
+    uint8_t started = 0;
+    int fd;
+    int result = 0;
+
+    fd = open(ctx->filename, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "*error* : file open failed : at %s\n", ctx->filename);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    memset(&follow->state, 0x00, sizeof(follow->state));
+    memcpy(follow->state.magic, MP3_FOLLOW_MAGIC, 8);
+    follow->state.device = st.st_dev;
+    follow->state.inode = st.st_ino;
+    if(mp3_follow_state_load(follow, &st))
+        fprintf(stderr, "*warning* : follow state does not match, starting over : at %s\n", follow->state_path);
+    follow->saved_offset = follow->state.offset;
+    ctx->audio_bytes = follow->state.audio_bytes;
+    ctx->audio_samples = follow->state.audio_samples;
+    ctx->junk_count = follow->state.junk_count;
+    ctx->junk_bytes = follow->state.junk_bytes;
+
+    iter = (mp3_frame_iter *)malloc(sizeof(mp3_frame_iter));
+    if(!iter || mp3_source_open_fd(&source, fd)) {
+        free(iter);
+        close(fd);
+        return -1;
+    }
+    source.counters = ctx->counters;
+
+    mp3_follow_watch(follow, ctx->filename);
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = mp3_follow_signal;//no SA_RESTART, poll returns
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    fprintf(report, "Follow     : %s   %s %llu   %s\n", ctx->filename,
+        follow->resumed ? "resume at" : "from", (unsigned long long)follow->state.offset,
+        follow->notify_fd >= 0 ? "inotify" : "polling");//dump
+    fflush(report);
+
+    last_growth = last_tick = mp3_clock_ns();
+    tick_frames = follow->state.frames;
+
+    while(!mp3_follow_stop) {
+        if(started) {
+            result = mp3_iter_refresh(iter);
+            if(result < 0) {
+                fprintf(stderr, "*error* : file truncated or unreadable : at %s\n", ctx->filename);
+                break;
+            }
+            if(result > 0)
+                last_growth = mp3_clock_ns();
+        }
+        else if(0 == fstat(fd, &st) && (uint64_t)st.st_size != source.size) {
+            source.size = st.st_size;
+            last_growth = mp3_clock_ns();
+        }
+
+        //the first header decides what to skip, a resume starts on a frame
+        if(!started && source.size >= 4 &&
+            0 == source.read(&source, 0, data, source.size < 10 ? 4 : 10)) {
+            result = mp3demuxer_select(ctx, data);
+            if(result < 0) {
+                fprintf(stderr, "*error* : invalid header\n");
+                break;
+            }
+            if(result == 1 || source.size >= 10) {
+                if(mp3_source_audio_region(&source, &begin_pos, &end_pos)) {
+                    result = -1;
+                    break;
+                }
+                if(follow->resumed)
+                    begin_pos = follow->state.offset;
+                else
+                    follow->state.offset = begin_pos;
+                fprintf(report, "%s\n", result == 1 ? "mp3v1" : "mp3v2");
+                if(!ctx->quiet && ctx->output_format == MP3_OUTPUT_DUMP)
+                    printf("Data Start : %zd\n", (size_t)begin_pos);//dump
+
+                mp3_iter_init(iter, &source, begin_pos, UINT64_MAX);
+                iter->follow = 1;
+                iter->strict = ctx->strict;
+                if(ctx->sync_search)
+                    iter->sync_search = ctx->sync_search;
+                started = 1;
+            }
+            result = 0;
+        }
+
+        if(started && (result = mp3_follow_walk(ctx, follow, iter))) {
+            fprintf(stderr, "*error* : %s\n", result == -2 ? "broken header" : "read or output failed");
+            break;
+        }
+
+        now = mp3_clock_ns();
+        if(now - last_tick >= interval_ns) {
+            if((ctx->quiet || ctx->stats) && follow->state.frames != tick_frames)
+                mp3_follow_report(ctx, follow, report);//rolling totals
+            if(follow->state.offset != follow->saved_offset &&
+                mp3_follow_state_save(follow))
+                fprintf(stderr, "*warning* : follow state write failed : at %s\n", follow->state_path);
+            tick_frames = follow->state.frames;
+            last_tick = now;
+        }
+
+        if(follow->gone) {
+            fprintf(stderr, "*warning* : file moved or deleted, stopped : at %s\n", ctx->filename);
+            break;
+        }
+        if(follow->idle && now - last_growth >= (uint64_t)follow->idle * 1000000000)
+            break;
+
+        timeout = (int64_t)((last_tick + interval_ns - now) / 1000000);
+        mp3_follow_wait(follow, ctx->filename, timeout > 0 ? (int)timeout : 0);
+    }
+
+    //a cut last frame or unjudged junk stays for the next run
+    if(follow->state.offset != follow->saved_offset &&
+        mp3_follow_state_save(follow))
+        fprintf(stderr, "*warning* : follow state write failed : at %s\n", follow->state_path);
+
+    if(0 == result) {
+        if(ctx->stats)
+            mp3_stats_print(ctx->stats, report);
+        else
+            mp3_follow_report(ctx, follow, report);
+        fprintf(report, "Pending    : %llu bytes\n",
+            (unsigned long long)(source.size - follow->state.offset));//dump
+        if(ctx->junk_count)
+            fprintf(report, "Junk Total : %llu regions   %llu bytes\n",
+                (unsigned long long)ctx->junk_count,
+                (unsigned long long)ctx->junk_bytes);//dump
+    }
+
+    if(follow->notify_fd >= 0)
+        close(follow->notify_fd);
+    mp3_source_close(&source);
+    free(iter);
+    close(fd);
+    return result;
+}
+#endif
+
+#ifndef WIN32
+///////////////////////////////////////////////////////////////////
+// daemon
+//
+// Every message on the socket is a 4 byte big endian length and that
+// many bytes. Requests are text:
+//
+//   analyze <path>
+//   probe <path>
+//   seek <frame> <path>
+//   stats
+//
+// and each is answered with one JSON object. Connections have a thread
+// each and wait for their job; the jobs run on a fixed pool of workers
+// that stay up between requests. A request equal to one that is queued
+// or running waits for that job instead of queueing its own.
+
+static volatile sig_atomic_t mp3_daemon_stop = 0;
+
+static void
+mp3_daemon_signal(int signal_number)
+{
+    (void)signal_number;
+    mp3_daemon_stop = 1;
+}
+
+//0:ok -1:error or closed
+static int
+mp3_daemon_read(int fd, void *buffer, size_t length)
+{
+    size_t done = 0;
+
+    while(done < length) {
+        ssize_t result = read(fd, (char *)buffer + done, length - done);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            return -1;
+        done += result;
+    }
+    return 0;
+}
+
+static int
+mp3_daemon_reply(int fd, const char *response)
+{
+    size_t length = strlen(response);
+    uint8_t prefix[4];
+    struct iovec iov[2];
+    size_t done = 0;
+
+    prefix[0] = (length >> 24) & 0xff;
+    prefix[1] = (length >> 16) & 0xff;
+    prefix[2] = (length >> 8) & 0xff;
+    prefix[3] = (length >> 0) & 0xff;
+
+    while(done < length + 4) {
+        ssize_t result;
+        int count = 0;
+
+        if(done < 4) {
+            iov[count].iov_base = prefix + done;
+            iov[count++].iov_len = 4 - done;
+        }
+        iov[count].iov_base = (void *)(response + (done > 4 ? done - 4 : 0));
+        iov[count++].iov_len = length - (done > 4 ? done - 4 : 0);
+
+        result = writev(fd, iov, count);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            return -1;
+        done += result;
+    }
+    return 0;
+}
+
+//0:ok -2:not a request
+static int
+mp3_daemon_parse(mp3_daemon_job *job)
+{
+    char *end;
+
+    if(0 == strncmp(job->request, "analyze ", 8)) {
+        job->op = MP3_DAEMON_ANALYZE;
+        job->path = job->request + 8;
+    }
+    else if(0 == strncmp(job->request, "probe ", 6)) {
+        job->op = MP3_DAEMON_PROBE;
+        job->path = job->request + 6;
+    }
+    else if(0 == strncmp(job->request, "seek ", 5)) {
+        job->op = MP3_DAEMON_SEEK;
+        job->frame = (uint32_t)strtoul(job->request + 5, &end, 10);
+        if(end == job->request + 5 || *end != ' ')
+            return -2;
+        job->path = end + 1;
+    }
+    else
+        return -2;
+
+    return *job->path ? 0 : -2;
+}
+
+static void
+mp3_daemon_summary(mp3_daemon_job *job, const mp3_cache_entry *summary, uint8_t probe)
+{
+    static const char* probe_string[] = { "scan", "Xing", "Info", "VBRI" };
+    double duration;
+
+    if(summary->result < 0) {
+        snprintf(job->response, sizeof(job->response), "{\"result\":%d}", summary->result);
+        return;
+    }
+
+    duration = summary->sample_rate ? (double)summary->audio_samples / summary->sample_rate : 0.0;
+    snprintf(job->response, sizeof(job->response),
+        "{\"result\":0,\"format\":\"mp3v%d\",\"frames\":%u,\"sample_rate\":%u,\"channel\":%u,"
+        "\"duration\":%.3f,\"bitrate\":%u,\"junk\":%llu,\"junk_bytes\":%llu%s%s%s}",
+        summary->format, summary->num_frame, summary->sample_rate, summary->channel, duration,
+        duration > 0.0 ? (uint32_t)(summary->audio_bytes * 8 / duration) : 0,
+        (unsigned long long)summary->junk_count,
+        (unsigned long long)summary->junk_bytes,
+        probe ? ",\"probe\":\"" : "",
+        probe ? probe_string[summary->probe] : "",
+        probe ? "\"" : "");
+}
+
+static void
+mp3_daemon_execute(mp3_daemon *daemon, mp3_daemon_job *job)
+{
+    mp3demuxer_context ctx;
+    mp3_frame_index index;
+    mp3_cache_entry summary;
+    mp3_cache_key key;
+    uint8_t use_key = 0;
+    FILE *fp;
+    uint8_t mp3_header[4];
+    uint32_t num_frame = 0;
+    uint32_t sample_rate = 0;
+    uint8_t channel = 0;
+    uint8_t version = 0;
+    uint8_t layer = 0;
+    uint32_t frame = job->frame;
+    long pos = 0;
+    int format = 0;
+    int result;
+
+    memset(&ctx, 0x00, sizeof(mp3demuxer_context));
+    ctx.filename = (char *)job->path;
+    ctx.io_backend = daemon->io_backend;
+    ctx.probe = (job->op == MP3_DAEMON_PROBE);
+    ctx.strict = daemon->strict;
+    ctx.sync_search = daemon->sync_search;
+    ctx.quiet = 1;
+
+    //a seek walks the frame index of an analyze entry, an analyze or
+    //probe answers from its own entry or scans into one
+    memset(&index, 0x00, sizeof(mp3_frame_index));
+    memset(&summary, 0x00, sizeof(mp3_cache_entry));
+    if(daemon->cache &&
+        0 == mp3_cache_key_make(daemon->cache, job->path,
+                            (ctx.probe ? MP3_CACHE_PROBE : 0) | (ctx.strict ? MP3_CACHE_STRICT : 0), &key)) {
+        use_key = 1;
+        if(0 == mp3_cache_load(daemon->cache, &key, &summary, job->op == MP3_DAEMON_SEEK ? &index : NULL)) {
+            if(job->op != MP3_DAEMON_SEEK) {
+                mp3_daemon_summary(job, &summary, ctx.probe);
+                return;
+            }
+            if(index.count)
+                ctx.index = &index;
+        }
+        else if(job->op != MP3_DAEMON_SEEK)
+            ctx.index = &index;
+    }
+
+    if(!(fp = fopen(job->path, "rb"))) {
+        result = -1;
+    }
+    else {
+        if(4 != fread(mp3_header, 1, 4, fp) ||
+            fseek(fp, 0, SEEK_SET))
+            result = -1;
+        else if((format = mp3demuxer_select(&ctx, mp3_header)) < 0)
+            result = -2;
+        else if(job->op == MP3_DAEMON_SEEK) {
+            result = ctx.skip_frame(&ctx, fp, &frame);
+            pos = ftell(fp);
+        }
+        else
+            result = ctx.analyze(&ctx, fp, &num_frame, &sample_rate, &channel, &version, &layer);
+        fclose(fp);
+    }
+
+    if(job->op == MP3_DAEMON_SEEK) {
+        mp3_index_free(&index);
+        if(result < 0)
+            snprintf(job->response, sizeof(job->response), "{\"result\":%d}", result);
+        else
+            snprintf(job->response, sizeof(job->response),
+                "{\"result\":0,\"format\":\"mp3v%d\",\"frame\":%u,\"pos\":%ld,\"end\":%s}",
+                format, frame, pos, result ? "true" : "false");
+        return;
+    }
+
+    memset(&summary, 0x00, sizeof(mp3_cache_entry));
+    summary.result = result;
+    summary.format = format;
+    if(0 == result) {
+        summary.num_frame = num_frame;
+        summary.sample_rate = sample_rate;
+        summary.channel = channel;
+        summary.probe = ctx.vbr_header.type;
+        summary.audio_bytes = ctx.audio_bytes;
+        summary.audio_samples = ctx.audio_samples;
+        summary.junk_count = ctx.junk_count;
+        summary.junk_bytes = ctx.junk_bytes;
+        summary.audio_begin = index.audio_begin;
+    }
+    mp3_daemon_summary(job, &summary, ctx.probe);
+
+    //read errors may pass, format errors stay
+    if(use_key && result != -1) {
+        summary.key = key;
+        mp3_cache_store(daemon->cache, &summary, 0 == result ? &index : NULL);
+    }
+    mp3_index_free(&index);
+}
+
+static void *
+mp3_daemon_worker_main(void *arg)
+{
+    mp3_daemon *daemon = (mp3_daemon *)arg;
+    mp3_daemon_job *job;
+    mp3_daemon_job **link;
+
+    pthread_mutex_lock(&daemon->lock);
+    while(1) {
+        while(!daemon->stop && !daemon->head)
+            pthread_cond_wait(&daemon->work, &daemon->lock);
+        if(daemon->stop)
+            break;
+
+        job = daemon->head;
+        daemon->head = job->next;
+        if(!daemon->head)
+            daemon->tail = NULL;
+        daemon->queued--;
+        job->next = daemon->running;
+        daemon->running = job;
+        daemon->busy++;
+        pthread_mutex_unlock(&daemon->lock);
+
+        mp3_daemon_execute(daemon, job);
+
+        pthread_mutex_lock(&daemon->lock);
+        for(link = &daemon->running; *link != job; link = &(*link)->next)
+            ;
+        *link = job->next;
+        daemon->busy--;
+        job->done = 1;
+        pthread_cond_broadcast(&daemon->done);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+
+    return NULL;
+}
+
+static int
+mp3_daemon_compare_latency(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+mp3_daemon_stats(mp3_daemon *daemon, char *response, size_t size)
+{
+    uint32_t latency[MP3_DAEMON_LATENCIES];
+    uint32_t queued;
+    uint32_t busy;
+    uint64_t served;
+    uint64_t coalesced;
+    uint64_t failed;
+    size_t count;
+
+    pthread_mutex_lock(&daemon->lock);
+    queued = daemon->queued;
+    busy = daemon->busy;
+    served = daemon->served;
+    coalesced = daemon->coalesced;
+    failed = daemon->failed;
+    count = daemon->latency_count < MP3_DAEMON_LATENCIES ? (size_t)daemon->latency_count : MP3_DAEMON_LATENCIES;
+    memcpy(latency, daemon->latency, count * sizeof(uint32_t));
+    pthread_mutex_unlock(&daemon->lock);
+
+    qsort(latency, count, sizeof(uint32_t), mp3_daemon_compare_latency);
+
+    //nearest rank over the recent requests
+    snprintf(response, size,
+        "{\"threads\":%u,\"queue\":%u,\"running\":%u,\"served\":%llu,\"coalesced\":%llu,\"failed\":%llu,"
+        "\"latency_us\":{\"samples\":%zu,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u}}",
+        daemon->threads, queued, busy,
+        (unsigned long long)served,
+        (unsigned long long)coalesced,
+        (unsigned long long)failed,
+        count,
+        count ? latency[(count - 1) * 50 / 100] : 0,
+        count ? latency[(count - 1) * 90 / 100] : 0,
+        count ? latency[(count - 1) * 99 / 100] : 0,
+        count ? latency[count - 1] : 0);
+}
+
+//queue the request or join the same one, then wait for its result
+static void
+mp3_daemon_request(mp3_daemon *daemon, const char *request, char *response, size_t size)
+{
+    uint64_t begin = mp3_clock_ns();
+    mp3_daemon_job *job;
+    mp3_daemon_job *list[2];
+    uint64_t latency;
+    int i;
+
+    if(0 == strcmp(request, "stats")) {
+        mp3_daemon_stats(daemon, response, size);
+        return;
+    }
+
+    pthread_mutex_lock(&daemon->lock);
+    list[0] = daemon->head;
+    list[1] = daemon->running;
+    job = NULL;
+    for(i = 0; i < 2 && !job; i++) {
+        for(job = list[i]; job && strcmp(job->request, request); job = job->next)
+            ;
+    }
+
+    if(job) {
+        daemon->coalesced++;
+    }
+    else {
+        job = (mp3_daemon_job *)calloc(1, sizeof(mp3_daemon_job));
+        if(job)
+            job->request = (char *)malloc(strlen(request) + 1);
+        if(!job || !job->request) {
+            pthread_mutex_unlock(&daemon->lock);
+            if(job)
+                free(job);
+            snprintf(response, size, "{\"result\":-1}");
+            return;
+        }
+        strcpy(job->request, request);
+        if(mp3_daemon_parse(job)) {
+            pthread_mutex_unlock(&daemon->lock);
+            free(job->request);
+            free(job);
+            snprintf(response, size, "{\"result\":-2,\"error\":\"unknown request\"}");
+            return;
+        }
+
+        if(daemon->tail)
+            daemon->tail->next = job;
+        else
+            daemon->head = job;
+        daemon->tail = job;
+        daemon->queued++;
+        pthread_cond_signal(&daemon->work);
+    }
+
+    job->waiters++;
+    while(!job->done)
+        pthread_cond_wait(&daemon->done, &daemon->lock);
+    snprintf(response, size, "%s", job->response);
+
+    latency = (mp3_clock_ns() - begin) / 1000;
+    daemon->latency[daemon->latency_count++ % MP3_DAEMON_LATENCIES] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+    daemon->served++;
+    if(0 != strncmp(job->response, "{\"result\":0", 11))
+        daemon->failed++;
+
+    if(--job->waiters == 0) {
+        free(job->request);
+        free(job);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+static void *
+mp3_daemon_client_main(void *arg)
+{
+    mp3_daemon_client *client = (mp3_daemon_client *)arg;
+    char response[MP3_DAEMON_RESPONSE];
+    uint8_t prefix[4];
+    uint32_t length;
+    char *request;
+
+    request = (char *)malloc(MP3_DAEMON_MESSAGE + 1);
+    while(request && 0 == mp3_daemon_read(client->fd, prefix, 4)) {
+        length = mp3_read_be32(prefix);
+        if(length > MP3_DAEMON_MESSAGE ||
+            mp3_daemon_read(client->fd, request, length))
+            break;
+        request[length] = '\0';
+
+        mp3_daemon_request(client->daemon, request, response, sizeof(response));
+        if(mp3_daemon_reply(client->fd, response))
+            break;
+    }
+
+    free(request);
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+//threads run with the stop signals blocked, so that they reach the listener
+static int
+mp3_daemon_spawn(pthread_t *thread, void *(*main)(void *), void *arg, uint8_t detach)
+{
+    sigset_t block;
+    sigset_t old;
+    pthread_attr_t attr;
+    int result;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    pthread_attr_init(&attr);
+    if(detach)
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    result = pthread_create(thread, &attr, main, arg);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return result ? -1 : 0;
+}
+
+static int
+mp3_daemon_run(mp3_daemon *daemon, const char *path)
+{
+    struct sockaddr_un addr;
+    struct sigaction action;
+    struct stat st;
+    mp3_daemon_client *client;
+    pthread_t *workers;
+    pthread_t thread;
+    uint32_t started;
+    uint32_t i;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "*error* : socket path too long : at %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if(0 == lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);//left by an earlier run
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fd, SOMAXCONN)) {
+        fprintf(stderr, "*error* : socket listen failed : at %s\n", path);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if(daemon->threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        daemon->threads = cores > 0 ? (uint32_t)cores : 1;
+    }
+    workers = (pthread_t *)calloc(daemon->threads, sizeof(pthread_t));
+    if(!workers) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    pthread_mutex_init(&daemon->lock, NULL);
+    pthread_cond_init(&daemon->work, NULL);
+    pthread_cond_init(&daemon->done, NULL);
+
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = mp3_daemon_signal;//no SA_RESTART, poll returns
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);//a client that left is a failed write
+
+    for(started = 0; started < daemon->threads; started++) {
+        if(mp3_daemon_spawn(&workers[started], mp3_daemon_worker_main, daemon, 0))
+            break;
+    }
+    if(started == 0) {
+        fprintf(stderr, "*error* : worker start failed\n");
+        mp3_daemon_stop = 1;
+    }
+    else {
+        printf("Daemon     : %s   %u threads\n", path, started);//dump
+        fflush(stdout);
+    }
+
+    while(!mp3_daemon_stop) {
+        struct pollfd pfd;
+        int client_fd;
+
+        //bounded, a stop signal may land between the check and the wait
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, MP3_DAEMON_STOP_CHECK) <= 0)
+            continue;
+
+        client_fd = accept(fd, NULL, NULL);
+        if(client_fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EMFILE || errno == ENFILE) {
+                poll(NULL, 0, 100);//until a connection closes
+                continue;
+            }
+            fprintf(stderr, "*error* : accept failed\n");
+            break;
+        }
+
+        client = (mp3_daemon_client *)malloc(sizeof(mp3_daemon_client));
+        if(!client) {
+            close(client_fd);
+            continue;
+        }
+        client->daemon = daemon;
+        client->fd = client_fd;
+        if(mp3_daemon_spawn(&thread, mp3_daemon_client_main, client, 1)) {
+            close(client_fd);
+            free(client);
+        }
+    }
+
+    close(fd);
+    unlink(path);
+
+    //running jobs finish, queued ones are dropped with their connections
+    pthread_mutex_lock(&daemon->lock);
+    daemon->stop = 1;
+    pthread_cond_broadcast(&daemon->work);
+    pthread_mutex_unlock(&daemon->lock);
+    for(i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    return started ? 0 : -1;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////
+// CRC verification
+//
+// --verify-crc walks the frames and checks the CRC-16 of every
+// protected Layer III frame. Only the header, CRC and side info at the
+// start of a frame are touched, so a mapped file is checked at the
+// speed its pages come in.
+
+//0:all good 1:bad frames -1:I/O error -2:format error
+static int
+mp3_verify_crc(mp3demuxer_context *ctx, mp3_source *source, FILE *report)
+{
+    mp3_frame_iter iter;
+    mp3_frame_event event;
+    uint64_t audio_begin;
+    uint64_t data_end;
+    uint64_t frame_num = 0;
+    uint64_t checked = 0;
+    uint64_t bad = 0;
+    uint64_t unprotected = 0;
+    uint64_t unchecked = 0;
+    uint16_t stored;
+    uint16_t computed;
+    int result;
+
+    if(mp3_source_audio_region(source, &audio_begin, &data_end))
+        return -1;
+
+    mp3_iter_init(&iter, source, audio_begin, data_end);
+    iter.strict = ctx->strict;
+    if(ctx->sync_search)
+        iter.sync_search = ctx->sync_search;
+
+    while(0 < (result = mp3_iter_next(&iter, &event))) {
+        if(event.type == MP3_EVENT_JUNK)
+            continue;
+
+        if(event.header.protection_bit)
+            unprotected++;
+        else {
+            result = mp3_iter_crc(&iter, &event, &stored, &computed);
+            if(result < 0)
+                break;
+            if(result == 2)
+                unchecked++;
+            else
+                checked++;
+            if(result == 1) {
+                bad++;
+                fprintf(report, "CRC error  : frame : %llu   pos : %llu   stored : %04x   computed : %04x\n",
+                    (unsigned long long)frame_num, (unsigned long long)event.offset, stored, computed);//dump
+            }
+        }
+        frame_num++;
+    }
+    if(result < 0)
+        return result;
+
+    fprintf(report, "CRC        : %llu checked   %llu bad   %llu unprotected   %llu unchecked\n",
+        (unsigned long long)checked, (unsigned long long)bad,
+        (unsigned long long)unprotected, (unsigned long long)unchecked);//dump
+    return bad ? 1 : 0;
+}
+
+///////////////////////////////////////////////////////////////////
+// side info statistics
+//
+// --side-info parses the Layer III side info of every frame and sums
+// up what it tells about the encoder: how often it switched to short
+// blocks, how much of the bit reservoir it borrowed and how many bits
+// of a frame carry audio. As with --verify-crc only the first bytes of
+// a frame are read, nothing is decoded.
+
+typedef struct mp3_side_info_totals_tag {
+    uint64_t frames;// Layer III frames parsed
+    uint64_t skipped;// other layers and cut frames
+    uint64_t granules;// granule and channel pairs
+    uint64_t block_type[4];
+    uint64_t mixed;
+    uint64_t borrowed;// frames with main_data_begin > 0
+    uint64_t main_data_begin;
+    uint32_t main_data_begin_max;
+    uint64_t bits;// part2_3_length
+    uint64_t capacity;// main data bits the frames themselves hold
+    uint64_t global_gain;
+    uint32_t global_gain_min;
+    uint32_t global_gain_max;
+    uint64_t big_values;
+    uint64_t invalid;// big_values over 288
+} mp3_side_info_totals;
+
+static double
+mp3_ratio(uint64_t count, uint64_t total)
+{
+    return total ? (double)count / total : 0.0;
+}
+
+//0:all good 1:invalid side info -1:I/O error -2:format error
+static int
+mp3_side_info_stats(mp3demuxer_context *ctx, mp3_source *source, FILE *report)
+{
+    mp3_frame_iter iter;
+    mp3_frame_event event;
+    mp3_side_info info;
+    mp3_side_info_totals totals;
+    mp3_granule_info *granule;
+    uint64_t audio_begin;
+    uint64_t data_end;
+    size_t head;
+    int result;
+
+    if(mp3_source_audio_region(source, &audio_begin, &data_end))
+        return -1;
+
+    memset(&totals, 0x00, sizeof(mp3_side_info_totals));
+    totals.global_gain_min = 255;
+
+    mp3_iter_init(&iter, source, audio_begin, data_end);
+    iter.strict = ctx->strict;
+    if(ctx->sync_search)
+        iter.sync_search = ctx->sync_search;
+
+    while(0 < (result = mp3_iter_next(&iter, &event))) {
+        if(event.type == MP3_EVENT_JUNK)
+            continue;
+
+        result = mp3_iter_side_info(&iter, &event, &info);
+        if(result < 0)
+            break;
+        if(result == 2) {
+            totals.skipped++;
+            continue;
+        }
+
+        totals.frames++;
+        totals.main_data_begin += info.main_data_begin;
+        if(info.main_data_begin) {
+            totals.borrowed++;
+            if(info.main_data_begin > totals.main_data_begin_max)
+                totals.main_data_begin_max = info.main_data_begin;
+        }
+        head = (event.header.protection_bit ? 4 : 6) + mp3_side_info_length(&event.header);
+        totals.capacity += (event.size - head) * 8;
+
+        for(uint32_t gr = 0; gr < info.granules; gr++) {
+            for(uint32_t ch = 0; ch < info.channels; ch++) {
+                granule = &info.granule[gr][ch];
+                totals.granules++;
+                totals.block_type[granule->block_type]++;
+                totals.mixed += granule->mixed_block;
+                totals.bits += granule->part2_3_length;
+                totals.global_gain += granule->global_gain;
+                if(granule->global_gain < totals.global_gain_min)
+                    totals.global_gain_min = granule->global_gain;
+                if(granule->global_gain > totals.global_gain_max)
+                    totals.global_gain_max = granule->global_gain;
+                totals.big_values += granule->big_values;
+                if(granule->big_values > 288)
+                    totals.invalid++;
+            }
+        }
+    }
+    if(result < 0)
+        return result;
 
-#else
-        if(data[0] != 0xff ||
-            (data[1] & 0xe0) != 0xe0) {
+    fprintf(report, "Side info  : %llu frames   %llu granules   %llu skipped\n",
+        (unsigned long long)totals.frames, (unsigned long long)totals.granules,
+        (unsigned long long)totals.skipped);//dump
+    if(totals.frames == 0)
+        return 0;
+    fprintf(report, "Blocks     : long %.2f%%   start %.2f%%   short %.2f%%   stop %.2f%%   mixed %.2f%%\n",
+        100.0 * mp3_ratio(totals.block_type[0], totals.granules),
+        100.0 * mp3_ratio(totals.block_type[1], totals.granules),
+        100.0 * mp3_ratio(totals.block_type[2], totals.granules),
+        100.0 * mp3_ratio(totals.block_type[3], totals.granules),
+        100.0 * mp3_ratio(totals.mixed, totals.granules));//dump
+    fprintf(report, "Reservoir  : main_data_begin avg %.1f max %u   borrowed in %.2f%% of frames\n",
+        mp3_ratio(totals.main_data_begin, totals.frames), totals.main_data_begin_max,
+        100.0 * mp3_ratio(totals.borrowed, totals.frames));//dump
+    fprintf(report, "Bits       : %.1f per frame   %.1f per granule   %.2f%% of the main data space\n",
+        mp3_ratio(totals.bits, totals.frames), mp3_ratio(totals.bits, totals.granules),
+        100.0 * mp3_ratio(totals.bits, totals.capacity));//dump
+    fprintf(report, "Gain       : global_gain avg %.1f min %u max %u   big_values avg %.1f\n",
+        mp3_ratio(totals.global_gain, totals.granules), totals.global_gain_min, totals.global_gain_max,
+        mp3_ratio(totals.big_values, totals.granules));//dump
+    if(totals.invalid)
+        fprintf(report, "Invalid    : %llu granules with big_values over 288\n",
+            (unsigned long long)totals.invalid);//dump
 
-                while(true) {
-                    read_size = fread(data, 1, 4, fp);
+    return totals.invalid ? 1 : 0;
+}
 
-                    if(read_size < 4) {
-                        return RME_IO_ERROR;//error
-                    }
+///////////////////////////////////////////////////////////////////
+// resynchronization
+//
+// The iterator reports the bytes between a broken header and the next
+// trusted sync as one junk region.
 
-                    if(data[0] == 0xff &&
-                        data[1] == 0xff &&
-                        data[2] == 0xff &&
-                        data[3] == 0xff)
-                        break;
-                }
-                continue;
-        }
-#endif
+static void
+mp3_report_junk(mp3demuxer_context *ctx, size_t pos, size_t length)
+{
+    uint64_t begin = mp3_counters_begin(ctx->counters);
 
-        header.version = (data[1] & 0x18) >> 3;
-        header.layer = (data[1] & 0x06) >> 1;
-        header.protection_bit = (data[1] & 0x01);
-        header.bitrate_index = (data[2] & 0xF0) >> 4;
-        header.sampling_frequency_index = (data[2] & 0x06) >> 2;
-        header.padding_bit = (data[2] & 0x02) >> 1;
-        header.private_bit = (data[2] & 0x01);
-        header.channel_mode = (data[3] & 0xc0) >> 6;
-        header.mode_extension = (data[3] & 0x30) >> 4;
-        header.copyright = (data[3] & 0x08) >> 3;
-        header.original = (data[3] & 0x04) >> 2;
-        header.emphasis = (data[3] & 0x03);
-
-        dump_mp3header(frame_count, pos, &header);//dump
+    ctx->junk_count++;
+    ctx->junk_bytes += length;
 
-        frame_count++;
+    if(ctx->writer)
+        mp3_writer_junk(ctx->writer, pos, length);
+    else if(!ctx->quiet && ctx->output_format == MP3_OUTPUT_DUMP)
+        printf("Junk       : Pos : %zd   length : %zd\n", pos, length);//dump
 
-        sr = sampling_rate_table[header.version][header.sampling_frequency_index];//sampling rate
-        br = bitrate_table[header.version][header.layer][header.bitrate_index] * 1000;//bitrate
+    mp3_counters_end(ctx->counters, MP3_PHASE_OUTPUT, begin);
+}
 
-        frame_size = (MP3_BYTE_ATTR_PER_FRAME * br / sr) + header.padding_bit;
+#ifndef WIN32
+///////////////////////////////////////////////////////////////////
+// parallel scan
+//
+// The audio region is cut into one byte range per thread. A worker
+// other than the first one does not know where a frame starts, so it
+// resyncs from the start of its range, then walks frames (and junk)
+// until it passes the end of its range. Stitching checks that each
+// chunk starts exactly where the previous one ended; a chunk that
+// locked onto a false sync is walked again from the right offset, so
+// numbering and totals are those of the serial scan.
 
-        if(fseek(fp, frame_size - 4, SEEK_CUR))
+static int
+mp3_scan_chunk_append(mp3_scan_chunk *chunk, size_t pos, size_t junk_length)
+{
+    if(chunk->count == chunk->capacity) {
+        size_t capacity = chunk->capacity ? chunk->capacity * 2 : 4096;
+        mp3_scan_event *events = (mp3_scan_event *)realloc(chunk->events, capacity * sizeof(mp3_scan_event));
+        if(!events)
             return -1;
+        chunk->events = events;
+        chunk->capacity = capacity;
     }
-
-    *num_frame = frame_count;
-    *sample_rate = sampling_rate_table[header.version][header.sampling_frequency_index];
-    *channel = channel_table[header.channel_mode];
-    *version = header.version;
-    *layer = header.layer;
-
+    chunk->events[chunk->count].offset = pos;
+    chunk->events[chunk->count].junk_length = junk_length;
+    chunk->count++;
     return 0;
 }
 
-static int
-id3_analyzation_v2(FILE *fp,
-                    uint32_t *num_frame,
-                    uint32_t *sample_rate,
-                    uint8_t *channel,
-                    uint8_t *version,
-                    uint8_t *layer)
+static void
+mp3_scan_chunk_iter(mp3_scan_chunk *chunk, size_t pos)
 {
-    uint8_t data[10];
-    uint32_t read_size;
-    uint32_t id3v2_length;
+    mp3_iter_init(&chunk->iter, chunk->source, pos, chunk->data_end);
+    chunk->iter.counters = chunk->source->counters ? &chunk->counters : NULL;//one set per thread
+    chunk->iter.strict = chunk->strict;
+    if(chunk->sync_search)
+        chunk->iter.sync_search = chunk->sync_search;
+}
 
-    read_size = fread(data, 1, 10, fp);
-    if(read_size != 10)
-        return -1;
-    
-    if(data[0] != 0x49 ||
-        data[1] != 0x44 ||
-        data[2] != 0x33)
-        return -2;
+//walk frames from pos until the first frame at or past range_end
+static void
+mp3_scan_chunk_walk(mp3_scan_chunk *chunk, size_t pos)
+{
+    mp3_frame_event event;
+    int result;
 
-    id3v2_length = 0;
-    id3v2_length = ((data[6] & 0x7F) << 21) |
-                    ((data[7] & 0x7F) << 14) |
-                    ((data[8] & 0x7F) << 7) |
-                    ((data[9] & 0x7F) << 0);
+    chunk->start = pos;
+    chunk->count = 0;
+    chunk->result = 0;
 
-    if(fseek(fp, id3v2_length, SEEK_CUR))
-        return -1;
+    mp3_scan_chunk_iter(chunk, pos);
 
-    //search
+    while(chunk->iter.pos < chunk->range_end) {
+        result = mp3_iter_next(&chunk->iter, &event);
+        if(result == 0)
+            break;//end
+        if(result < 0) {
+            chunk->result = result;//error
+            break;
+        }
+        if(mp3_scan_chunk_append(chunk, event.offset, event.type == MP3_EVENT_JUNK ? event.size : 0)) {
+            chunk->result = -1;
+            break;
+        }
+    }
 
-    return id3_analyzation_v1_internal(fp, ftell(fp), num_frame, sample_rate, channel, version, layer);
+    chunk->end = chunk->iter.pos;
 }
 
-static int
-id3_skip_frame_v1(FILE *fp, uint32_t *frame)
+static void *
+mp3_scan_chunk_main(void *arg)
 {
-    int result;
-    uint32_t skip_first = 1;
-    result = id3_skip_frame_v1_internal(fp, 0, &skip_first);
-    if(0 != result)//skip first frame
-        return result;
-    if(1 != skip_first)
-        return -2;
+    mp3_scan_chunk *chunk = (mp3_scan_chunk *)arg;
+    uint64_t pos;
+
+    if(chunk->exact_start) {
+        mp3_scan_chunk_walk(chunk, chunk->range_begin);
+        return NULL;
+    }
 
-    return id3_skip_frame_v1_internal(fp, ftell(fp), frame);
+    mp3_scan_chunk_iter(chunk, chunk->range_begin);
+    if(mp3_iter_resync(&chunk->iter, chunk->range_begin, chunk->range_end, &pos)) {
+        chunk->start = SIZE_MAX;
+        chunk->count = 0;
+        return NULL;
+    }
+    if(pos < chunk->range_end) {
+        mp3_scan_chunk_walk(chunk, pos);
+        return NULL;
+    }
+
+    chunk->start = SIZE_MAX;//no sync in range, stitching walks it
+    chunk->count = 0;
+    return NULL;
 }
 
 static int
-id3_skip_frame_v1_internal(FILE *fp, uint32_t begin_pos, uint32_t *frame)
+mp3_parallel_scan(mp3demuxer_context *ctx,
+                    mp3_source *source,
+                    size_t begin_pos,
+                    size_t data_end,
+                    mp3_frame_header *header,
+                    size_t *frame_count)
 {
-    mp3_frame_header header;
-    uint8_t data[4];
-    size_t read_size;
-    size_t frame_count = 0;
-
-    size_t frame_size = 0;
+    const uint8_t *base = source->data;
+    mp3_scan_chunk *chunks;
+    mp3_scan_event *event;
+    uint32_t threads = ctx->scan_threads;
+    size_t region = data_end - begin_pos;
+    size_t expected;
+    size_t frame_size;
+    size_t i, j;
+    int result = 0;
 
-    uint32_t sr, br;
+    if(region / threads < MP3_PARALLEL_MIN_CHUNK)
+        threads = (uint32_t)(region / MP3_PARALLEL_MIN_CHUNK);
+    if(threads < 2)
+        threads = 2;
 
-    uint8_t tag_exist = 0;
-
-    if(fseek(fp, begin_pos, SEEK_SET))//start
+    chunks = (mp3_scan_chunk *)calloc(threads, sizeof(mp3_scan_chunk));
+    if(!chunks)
         return -1;
 
-    while (frame_count < *frame) {
-    
-        read_size = fread(data, 1, 4, fp);
+    for(i = 0; i < threads; i++) {
+        chunks[i].source = source;
+        chunks[i].data_end = data_end;
+        chunks[i].range_begin = begin_pos + region / threads * i;
+        chunks[i].range_end = (i + 1 == threads) ? data_end : begin_pos + region / threads * (i + 1);
+        chunks[i].exact_start = (i == 0);
+        chunks[i].strict = ctx->strict;
+        chunks[i].sync_search = ctx->sync_search;
+        if(pthread_create(&chunks[i].thread, NULL, mp3_scan_chunk_main, &chunks[i]))
+            mp3_scan_chunk_main(&chunks[i]);//run inline
+        else
+            chunks[i].started = 1;
+    }
+    for(i = 0; i < threads; i++) {
+        if(chunks[i].started)
+            pthread_join(chunks[i].thread, NULL);
+    }
 
-        if(read_size < 4) {
-            *frame = frame_count;
-            if(feof(fp))
-                return 1;
-            else
-                return -1;//error
+    //stitch
+    expected = chunks[0].end;
+    for(i = 1; i < threads && 0 == chunks[i - 1].result; i++) {
+        if(expected >= chunks[i].range_end) {
+            chunks[i].count = 0;//covered by the previous chunk
+            chunks[i].end = expected;
+            continue;
         }
-        
-#if 1
-        if(data[0] != 0xff ||
-            (data[1] & 0xe0) != 0xe0)
-                return -2;//error
-
-#else
-        if(data[0] != 0xff ||
-            (data[1] & 0xe0) != 0xe0) {
-
-                while(true) {
-                    read_size = fread(data, 1, 4, fp);
+        if(chunks[i].start != expected)
+            mp3_scan_chunk_walk(&chunks[i], expected);//false sync or none
+        expected = chunks[i].end;
+    }
+    for(; i < threads; i++)
+        chunks[i].count = 0;//after an error
 
-                    if(read_size < 4) {
-                        return RME_IO_ERROR;//error
-                    }
+    //frames in order
+    for(i = 0; i < threads; i++) {
+        for(j = 0; j < chunks[i].count; j++) {
+            event = &chunks[i].events[j];
 
-                    if(data[0] == 0xff &&
-                        data[1] == 0xff &&
-                        data[2] == 0xff &&
-                        data[3] == 0xff)
-                        break;
-                }
+            if(event->junk_length) {
+                mp3_report_junk(ctx, event->offset, event->junk_length);
                 continue;
-        }
-#endif
+            }
 
-        header.version = (data[1] & 0x18) >> 3;
-        header.layer = (data[1] & 0x06) >> 1;
-        header.protection_bit = (data[1] & 0x01);
-        header.bitrate_index = (data[2] & 0xF0) >> 4;
-        header.sampling_frequency_index = (data[2] & 0x06) >> 2;
-        header.padding_bit = (data[2] & 0x02) >> 1;
-        header.private_bit = (data[2] & 0x01);
-        header.channel_mode = (data[3] & 0xc0) >> 6;
-        header.mode_extension = (data[3] & 0x30) >> 4;
-        header.copyright = (data[3] & 0x08) >> 3;
-        header.original = (data[3] & 0x04) >> 2;
-        header.emphasis = (data[3] & 0x03);
+            parse_mp3header(base + event->offset, header);
 
-        frame_count++;
+            if(!ctx->quiet)
+                mp3_emit_frame(ctx, *frame_count, event->offset, header);
 
-        sr = sampling_rate_table[header.version][header.sampling_frequency_index];//sampling rate
-        br = bitrate_table[header.version][header.layer][header.bitrate_index] * 1000;//bitrate
+            (*frame_count)++;
 
-        frame_size = (MP3_BYTE_ATTR_PER_FRAME * br / sr) + header.padding_bit;
+            frame_size = mp3_frame_size(header);
 
-        if(fseek(fp, frame_size - 4, SEEK_CUR))
-            return -1;
+            if(ctx->index && mp3_index_append(ctx->index, event->offset, base + event->offset, frame_size)) {
+                chunks[i].result = -1;
+                break;
+            }
+
+            ctx->audio_bytes += frame_size;
+            ctx->audio_samples += mp3_samples_per_frame(header);
+        }
+        if(chunks[i].result) {
+            result = chunks[i].result;
+            break;
+        }
     }
 
+    for(i = 0; i < threads; i++) {
+        if(ctx->counters)
+            mp3_counters_add(ctx->counters, &chunks[i].counters);
+        free(chunks[i].events);
+    }
+    free(chunks);
 
-    return 0;
+    return result;
 }
-static int
-id3_skip_frame_v2(FILE *fp, uint32_t *frame)
-{
-    uint8_t data[10];
-    uint32_t read_size;
-    uint32_t id3v2_length;
-
-    uint32_t skip_first = 1;
-
-    if(fseek(fp, 0, SEEK_SET))
-        return -1;
-
-    read_size = fread(data, 1, 10, fp);
-    if(read_size != 10)
-        return -1;
-    
-    if(data[0] != 0x49 ||
-        data[1] != 0x44 ||
-        data[2] != 0x33)
-        return -1;
-
-    id3v2_length = 0;
-    id3v2_length = ((data[6] & 0x7F) << 21) |
-                    ((data[7] & 0x7F) << 14) |
-                    ((data[8] & 0x7F) << 7) |
-                    ((data[9] & 0x7F) << 0);
-
-    if(fseek(fp, id3v2_length, SEEK_CUR))
-        return -1;
-
-    int result;
-    result = id3_skip_frame_v1_internal(fp, ftell(fp), &skip_first);
-    if(0 != result)//skip first frame
-        return result;
-    if(1 != skip_first)
-        return -2;
 
-    return id3_skip_frame_v1_internal(fp, ftell(fp), frame);
-}
+#endif
 
 ////////////////////////////////////////////////
 
@@ -660,7 +4256,7 @@ dump_mp3header(uint32_t frame_num, size_t pos, mp3_frame_header *header) {
     uint32_t sr = sampling_rate_table[header->version][header->sampling_frequency_index];//sampling rate
     uint32_t br = bitrate_table[header->version][header->layer][header->bitrate_index] * 1000;//bitrate
 
-    uint32_t frame_size = (MP3_BYTE_ATTR_PER_FRAME * br / sr) + header->padding_bit;
+    uint32_t frame_size = (uint32_t)mp3_frame_size(header);
     
     //dump
     printf(
@@ -690,4 +4286,435 @@ dump_mp3header(uint32_t frame_num, size_t pos, mp3_frame_header *header) {
         
 }
 
+///////////////////////////////////////////////////////////////////
+// structured output
+//
+// Frame records are formatted by hand into a large buffer that goes
+// out with one write per MP3_WRITER_BUFFER bytes, so that machine
+// readable output keeps up with the scan. stdout must not be written
+// through stdio while the writer holds data.
+
+static int
+mp3_writer_flush(mp3_writer *writer)
+{
+    size_t done = 0;
+
+    while(done < writer->used) {
+        if(writer->counters)
+            writer->counters->write_calls++;
+#ifdef WIN32
+        size_t written = fwrite(writer->buffer + done, 1, writer->used - done, stdout);
+        if(written == 0) {
+            writer->error = 1;
+            break;
+        }
+#else
+        ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0) {
+            writer->error = 1;
+            break;
+        }
+#endif
+        done += written;
+    }
+    if(writer->counters)
+        writer->counters->bytes_written += done;
+    writer->used = 0;
+
+    return writer->error ? -1 : 0;
+}
+
+static inline void
+mp3_writer_reserve(mp3_writer *writer, size_t length)
+{
+    if(MP3_WRITER_BUFFER - writer->used < length)
+        mp3_writer_flush(writer);
+}
+
+static inline void
+mp3_writer_put(mp3_writer *writer, const char *str, size_t length)
+{
+    memcpy(writer->buffer + writer->used, str, length);
+    writer->used += length;
+}
+
+static inline void
+mp3_writer_put_u64(mp3_writer *writer, uint64_t value)
+{
+    char digits[20];
+    size_t n = 0;
+
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while(value);
+
+    while(n)
+        writer->buffer[writer->used++] = digits[--n];
+}
+
+#define MP3_WRITER_PUT_LITERAL(writer, str) mp3_writer_put(writer, str, sizeof(str) - 1)
+
+static void
+mp3_writer_init(mp3_writer *writer, mp3_output_format format)
+{
+    memset(writer, 0x00, sizeof(mp3_writer));
+    writer->fd = 1;
+    writer->format = format;
+
+    fflush(stdout);
+#ifdef WIN32
+    if(format == MP3_OUTPUT_BINARY)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    switch(format) {
+    case MP3_OUTPUT_CSV:
+        MP3_WRITER_PUT_LITERAL(writer,
+            "frame,pos,size,version,layer,bitrate,sample_rate,channel_mode,mode_extension,"
+            "protection,padding,private,copyright,original,emphasis\n");
+        break;
+    case MP3_OUTPUT_BINARY: {
+        uint32_t record_size = sizeof(mp3_frame_record);
+        mp3_writer_put(writer, MP3_RECORD_MAGIC, 8);
+        mp3_writer_put(writer, (const char *)&record_size, 4);
+        mp3_writer_put(writer, "\0\0\0\0", 4);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void
+mp3_writer_frame(mp3_writer *writer, uint32_t frame_num, size_t pos, const mp3_frame_header *header)
+{
+    uint32_t sr = sampling_rate_table[header->version][header->sampling_frequency_index];//sampling rate
+    uint32_t br = bitrate_table[header->version][header->layer][header->bitrate_index] * 1000;//bitrate
+    uint32_t frame_size = (uint32_t)mp3_frame_size(header);
+
+    mp3_writer_reserve(writer, 512);
+
+    switch(writer->format) {
+    case MP3_OUTPUT_NDJSON:
+        MP3_WRITER_PUT_LITERAL(writer, "{\"frame\":");
+        mp3_writer_put_u64(writer, frame_num);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"pos\":");
+        mp3_writer_put_u64(writer, pos);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"size\":");
+        mp3_writer_put_u64(writer, frame_size);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"version\":");
+        mp3_writer_put_u64(writer, header->version);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"layer\":");
+        mp3_writer_put_u64(writer, header->layer);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"bitrate\":");
+        mp3_writer_put_u64(writer, br);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"sample_rate\":");
+        mp3_writer_put_u64(writer, sr);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"channel_mode\":");
+        mp3_writer_put_u64(writer, header->channel_mode);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"mode_extension\":");
+        mp3_writer_put_u64(writer, header->mode_extension);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"protection\":");
+        mp3_writer_put_u64(writer, header->protection_bit);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"padding\":");
+        mp3_writer_put_u64(writer, header->padding_bit);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"private\":");
+        mp3_writer_put_u64(writer, header->private_bit);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"copyright\":");
+        mp3_writer_put_u64(writer, header->copyright);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"original\":");
+        mp3_writer_put_u64(writer, header->original);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"emphasis\":");
+        mp3_writer_put_u64(writer, header->emphasis);
+        MP3_WRITER_PUT_LITERAL(writer, "}\n");
+        break;
+
+    case MP3_OUTPUT_CSV: {
+        const uint32_t fields[] = {
+            frame_size, header->version, header->layer, br, sr,
+            header->channel_mode, header->mode_extension,
+            header->protection_bit, header->padding_bit, header->private_bit,
+            header->copyright, header->original, header->emphasis,
+        };
+        size_t i;
+
+        mp3_writer_put_u64(writer, frame_num);
+        MP3_WRITER_PUT_LITERAL(writer, ",");
+        mp3_writer_put_u64(writer, pos);
+        for(i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            MP3_WRITER_PUT_LITERAL(writer, ",");
+            mp3_writer_put_u64(writer, fields[i]);
+        }
+        MP3_WRITER_PUT_LITERAL(writer, "\n");
+        break;
+    }
+
+    case MP3_OUTPUT_BINARY: {
+        mp3_frame_record record;
+
+        memset(&record, 0x00, sizeof(record));
+        record.offset = pos;
+        record.frame = frame_num;
+        record.size = frame_size;
+        record.bitrate = br;
+        record.sample_rate = sr;
+        record.type = 0;
+        record.version = header->version;
+        record.layer = header->layer;
+        record.channel_mode = header->channel_mode;
+        record.mode_extension = header->mode_extension;
+        record.flags = header->protection_bit |
+                        (header->padding_bit << 1) |
+                        (header->private_bit << 2) |
+                        (header->copyright << 3) |
+                        (header->original << 4);
+        record.emphasis = header->emphasis;
+        mp3_writer_put(writer, (const char *)&record, sizeof(record));
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+//csv has no junk rows
+static void
+mp3_writer_junk(mp3_writer *writer, size_t pos, size_t length)
+{
+    mp3_writer_reserve(writer, 128);
+
+    switch(writer->format) {
+    case MP3_OUTPUT_NDJSON:
+        MP3_WRITER_PUT_LITERAL(writer, "{\"junk\":");
+        mp3_writer_put_u64(writer, pos);
+        MP3_WRITER_PUT_LITERAL(writer, ",\"length\":");
+        mp3_writer_put_u64(writer, length);
+        MP3_WRITER_PUT_LITERAL(writer, "}\n");
+        break;
+
+    case MP3_OUTPUT_BINARY: {
+        mp3_frame_record record;
+
+        memset(&record, 0x00, sizeof(record));
+        record.offset = pos;
+        record.size = (uint32_t)length;
+        record.type = 1;
+        mp3_writer_put(writer, (const char *)&record, sizeof(record));
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+//per frame output, human readable dump or a writer record
+static void
+mp3_emit_frame(mp3demuxer_context *ctx, uint32_t frame_num, size_t pos, mp3_frame_header *header)
+{
+    uint64_t begin = mp3_counters_begin(ctx->counters);
+
+    if(ctx->stats)
+        mp3_stats_frame(ctx->stats, frame_num, pos, header);
+    else if(ctx->writer)
+        mp3_writer_frame(ctx->writer, frame_num, pos, header);
+    else
+        dump_mp3header(frame_num, pos, header);//dump
+
+    mp3_counters_end(ctx->counters, MP3_PHASE_OUTPUT, begin);
+}
+
+///////////////////////////////////////////////////////////////////
+// statistics
+//
+// Everything is gathered from the frame headers in the same pass as the
+// scan. Classification: a single bitrate is CBR; several bitrates whose
+// MP3_STATS_WINDOW frame averages stay within 10% of the mean are ABR;
+// anything else is VBR.
+
+static const char* stats_version_string[] =
+{
+    "MPEG2.5",
+    "Reserved",
+    "MPEG2",
+    "MPEG1",
+};
+
+static const char* stats_change_string[] =
+{
+    "version",
+    "layer",
+    "sampling rate",
+    "channel mode",
+};
+
+static void
+mp3_stats_change(mp3_stream_stats *stats, uint32_t frame_num, size_t pos, uint8_t field, uint32_t from, uint32_t to)
+{
+    mp3_stream_change *change;
+
+    if(stats->change_count < MP3_STATS_CHANGES) {
+        change = &stats->changes[stats->change_count];
+        change->frame = frame_num;
+        change->pos = pos;
+        change->field = field;
+        change->from = from;
+        change->to = to;
+    }
+    stats->change_count++;
+}
+
+static void
+mp3_stats_window_close(mp3_stream_stats *stats)
+{
+    double kbps;
+
+    if(stats->window_duration <= 0.0)
+        return;
+
+    kbps = stats->window_bytes * 8 / stats->window_duration / 1000;
+    if(stats->windows == 0 || kbps < stats->window_min)
+        stats->window_min = kbps;
+    if(stats->windows == 0 || kbps > stats->window_max)
+        stats->window_max = kbps;
+    stats->windows++;
+
+    stats->window_bytes = 0;
+    stats->window_duration = 0.0;
+    stats->window_frames = 0;
+}
+
+static void
+mp3_stats_frame(mp3_stream_stats *stats, uint32_t frame_num, size_t pos, const mp3_frame_header *header)
+{
+    uint32_t sr = sampling_rate_table[header->version][header->sampling_frequency_index];//sampling rate
+    uint32_t kbps = bitrate_table[header->version][header->layer][header->bitrate_index];//bitrate
+    size_t frame_size = mp3_frame_size(header);
+    double duration = sr ? (double)mp3_samples_per_frame(header) / sr : 0.0;
+    const mp3_frame_header *last = &stats->last;
+
+    if(stats->frames == 0) {
+        stats->bitrate_min = kbps;
+        stats->bitrate_max = kbps;
+    }
+    else {
+        if(header->version != last->version)
+            mp3_stats_change(stats, frame_num, pos, 0, last->version, header->version);
+        if(header->layer != last->layer)
+            mp3_stats_change(stats, frame_num, pos, 1, last->layer, header->layer);
+        if(sr != stats->sample_rate)
+            mp3_stats_change(stats, frame_num, pos, 2, stats->sample_rate, sr);
+        if(header->channel_mode != last->channel_mode)
+            mp3_stats_change(stats, frame_num, pos, 3, last->channel_mode, header->channel_mode);
+    }
+    stats->last = *header;
+    stats->sample_rate = sr;
+
+    stats->frames++;
+    stats->bytes += frame_size;
+    stats->duration += duration;
+
+    if(kbps <= MP3_STATS_MAX_KBPS)
+        stats->bitrate_frames[kbps]++;
+    if(kbps < stats->bitrate_min)
+        stats->bitrate_min = kbps;
+    if(kbps > stats->bitrate_max)
+        stats->bitrate_max = kbps;
+    stats->bitrate_sum += kbps;
+
+    stats->channel_mode[header->channel_mode]++;
+    if(header->channel_mode == 1)//joint stereo
+        stats->mode_extension[header->mode_extension]++;
+    if(header->padding_bit)
+        stats->padded++;
+    if(header->protection_bit == 0)//followed by CRC
+        stats->protected_frames++;
+
+    stats->window_bytes += frame_size;
+    stats->window_duration += duration;
+    if(++stats->window_frames == MP3_STATS_WINDOW)
+        mp3_stats_window_close(stats);
+}
+
+static void
+mp3_stats_print(mp3_stream_stats *stats, FILE *out)
+{
+    double mean = stats->duration > 0.0 ? stats->bytes * 8 / stats->duration / 1000 : 0.0;
+    const char *type;
+    uint32_t distinct = 0;
+    uint32_t kbps;
+    uint64_t i;
+
+    if(stats->window_frames * 2 >= MP3_STATS_WINDOW)
+        mp3_stats_window_close(stats);//a short tail would skew the check
+
+    for(kbps = 0; kbps <= MP3_STATS_MAX_KBPS; kbps++) {
+        if(stats->bitrate_frames[kbps])
+            distinct++;
+    }
+    if(distinct <= 1)
+        type = "CBR";
+    else if(stats->windows >= 2 && stats->window_max - stats->window_min <= mean * 0.1)
+        type = "ABR";
+    else
+        type = "VBR";
+
+    fprintf(out, "Frames     : %llu\n", (unsigned long long)stats->frames);//dump
+    fprintf(out, "Duration   : %.3f\n", stats->duration);//dump
+    fprintf(out, "Type       : %s\n", stats->frames ? type : "-");//dump
+    fprintf(out, "Bitrate    : mean %.1f kbps   frame mean %.1f kbps   min %u kbps   max %u kbps\n",
+        mean,
+        stats->frames ? (double)stats->bitrate_sum / stats->frames : 0.0,
+        stats->bitrate_min, stats->bitrate_max);//dump
+    for(kbps = 0; kbps <= MP3_STATS_MAX_KBPS; kbps++) {
+        if(stats->bitrate_frames[kbps])
+            fprintf(out, "  %3u kbps : %llu frames (%.2f %%)\n", kbps,
+                (unsigned long long)stats->bitrate_frames[kbps],
+                100.0 * stats->bitrate_frames[kbps] / stats->frames);//dump
+    }
+
+    fprintf(out, "Channel    :\n");//dump
+    for(i = 0; i < 4; i++) {
+        if(stats->channel_mode[i])
+            fprintf(out, "  %-14s : %llu frames\n", channel_string[i], (unsigned long long)stats->channel_mode[i]);//dump
+    }
+    if(stats->channel_mode[1]) {
+        fprintf(out, "Mode Ext   :\n");//dump
+        for(i = 0; i < 4; i++) {
+            if(stats->mode_extension[i])
+                fprintf(out, "  %-14s : %llu frames\n", mode_extention_string[i], (unsigned long long)stats->mode_extension[i]);//dump
+        }
+    }
+
+    fprintf(out, "Padding    : %llu frames (%.2f %%)\n", (unsigned long long)stats->padded,
+        stats->frames ? 100.0 * stats->padded / stats->frames : 0.0);//dump
+    fprintf(out, "CRC        : %llu frames\n", (unsigned long long)stats->protected_frames);//dump
 
+    fprintf(out, "Changes    : %llu\n", (unsigned long long)stats->change_count);//dump
+    for(i = 0; i < stats->change_count && i < MP3_STATS_CHANGES; i++) {
+        mp3_stream_change *change = &stats->changes[i];
+
+        fprintf(out, "  Frame : %08u   Pos : %llu   %s : ", change->frame,
+            (unsigned long long)change->pos, stats_change_string[change->field]);//dump
+        switch(change->field) {
+        case 0:
+            fprintf(out, "%s -> %s\n", stats_version_string[change->from], stats_version_string[change->to]);//dump
+            break;
+        case 1:
+            fprintf(out, "%s -> %s\n", layer_string[change->from], layer_string[change->to]);//dump
+            break;
+        case 2:
+            fprintf(out, "%u -> %u\n", change->from, change->to);//dump
+            break;
+        default:
+            fprintf(out, "%s -> %s\n", channel_string[change->from], channel_string[change->to]);//dump
+            break;
+        }
+    }
+    if(stats->change_count > MP3_STATS_CHANGES)
+        fprintf(out, "  ...\n");//dump
+}
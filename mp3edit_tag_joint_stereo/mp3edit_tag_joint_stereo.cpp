@@ -24,40 +24,144 @@
 // OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
 // EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#ifdef WIN32
 #include "stdafx.h"
 #include "stdint.h"
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+#endif
 #include "memory.h"
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
 
-///////////////////////////////////////
+#include "../mp3scan/mp3scan.h"
 
-#define MP3_SAMPLE_PER_FRAME 1152
-#define MP3_BYTE_ATTR_PER_FRAME 144
+///////////////////////////////////////
 
 /**
  * function
  *
  */
-typedef int (*id3_force_joint_stereo)(FILE *src_fp, FILE *dst_fp);
-typedef int (*id3_analyzation)(FILE *fp,
-                            uint32_t *num_frame,
-                            uint32_t *sample_rate,
-                            uint8_t *channel,
-                            uint8_t *version,
-                            uint8_t *layer);
-typedef int (*id3_skip_frame)(FILE *fp, uint32_t *frame);
-
-typedef struct mp3demuxer_context_tag {
+typedef struct mp3demuxer_context_tag mp3demuxer_context;
+
+typedef int (*id3_force_joint_stereo)(mp3demuxer_context *ctx, mp3_source *source, FILE *dst_fp);
+typedef int (*id3_force_joint_stereo_inplace)(mp3demuxer_context *ctx, int fd);
+typedef int (*id3_force_joint_stereo_zerocopy)(mp3demuxer_context *ctx, int src_fd, int dst_fd);
+typedef int (*id3_force_joint_stereo_pipeline)(mp3demuxer_context *ctx, int src_fd, int dst_fd);
+
+typedef enum mp3_io_backend_tag {
+    MP3_IO_STDIO = 0,// fread/fwrite through translate_buffer
+    MP3_IO_ZEROCOPY = 1,// kernel side copy, then patch
+    MP3_IO_PIPELINE = 2,// reader, patcher and writer threads
+} mp3_io_backend;
+
+/**
+ * header rewrite rules
+ *
+ * --rule=<field>=<value>[@<first>-<last>][?<field>=<value>] sets a
+ * header field in the frames its filters pick: a 0 based frame range,
+ * last included and open when left out, and a field value of the
+ * header as the rules before it left it. Values are the raw field
+ * bits; channel_mode and emphasis take names too. Only fields that
+ * leave the frame layout alone can be set. channel_mode is one of them
+ * only between stereo, joint and dual: Layer III side info is shorter
+ * in mono, so a rule that sets mono or picks mono frames is refused,
+ * and any other channel_mode rule skips mono frames.
+ *
+ * Each rule compiles to an AND and an OR mask over the 32 bit header,
+ * and a rule with the filters of the one before it merges into it, so
+ * the usual unfiltered set is a single mask pair. All rules apply in
+ * the one pass of the selected backend. Without --rule the editor
+ * forces joint stereo as it always did.
+ */
+#define MP3_RULE_MAX 64
+#define MP3_CHANNEL_MODE_MASK (3u << 6)
+#define MP3_CHANNEL_MODE_MONO (3u << 6)
+
+typedef struct mp3_header_field_tag {
+    const char *name;
+    uint8_t shift;// in the header, byte 0 in the top bits
+    uint8_t width;
+    uint8_t writable;
+    const char **names;// value names, NULL for numbers only
+} mp3_header_field;
+
+typedef struct mp3_rule_tag {
+    uint32_t and_mask;
+    uint32_t or_mask;
+    uint64_t first;// frame range, last included
+    uint64_t last;
+    uint32_t if_mask;// applies where header & if_mask == if_value
+    uint32_t if_value;
+    uint32_t unless_mask;// skipped where header & unless_mask == unless_value
+    uint32_t unless_value;
+} mp3_rule;
+
+typedef struct mp3_rule_set_tag {
+    mp3_rule rules[MP3_RULE_MAX];
+    uint32_t count;
+} mp3_rule_set;
+
+typedef enum mp3_cut_mode_tag {
+    MP3_CUT_NONE = 0,
+    MP3_CUT_FRAMES = 1,// --cut
+    MP3_CUT_TIME = 2,// --cut-time
+} mp3_cut_mode;
+
+struct mp3demuxer_context_tag {
     char *src_filename;
     char *dst_filename;
 
+    mp3_io_backend io_backend;
+    uint8_t in_place;// --in-place
+    uint8_t journal;// --journal
+    uint32_t threads;// --threads, 0:auto
+    uint8_t direct;// --direct, pipeline only
+
+    mp3_rule_set rules;// --rule, joint stereo without
+    size_t crc_updated;// CRCs recomputed for a rewritten header
+    size_t crc_bad;// CRCs that did not match before, left as they were
+
+    mp3_cut_mode cut;
+    uint64_t cut_first;// frames, last included
+    uint64_t cut_last;
+    double cut_start;// seconds, end excluded
+    double cut_end;
+    uint8_t cut_drop;// --reservoir=drop
+
+    uint8_t join;// --join
+    uint8_t join_xing;// --xing
+    char **join_files;// inputs in order, the output is dst_filename
+    uint32_t join_count;
+
     uint32_t sample_rate;
     uint8_t sample_bit;
     uint8_t channel;
 
     id3_force_joint_stereo force_js;
-    id3_analyzation analyze;
-    id3_skip_frame skip_frame;
-} mp3demuxer_context;
+    id3_force_joint_stereo_inplace force_js_inplace;
+    id3_force_joint_stereo_zerocopy force_js_zerocopy;
+    id3_force_joint_stereo_pipeline force_js_pipeline;
+
+    mp3_counters *counters;// --stats, NULL when off
+};
 
 ///////////////////////////////////////
 
@@ -67,65 +171,146 @@ typedef struct mp3demuxer_context_tag {
  *
  */
 static int
-id3_analyzation_v1(FILE *fp,
-                    uint32_t *num_frame,
-                    uint32_t *sample_rate,
-                    uint8_t *channel,
-                    uint8_t *version,
-                    uint8_t *layer);
+id3_force_js_v1(mp3demuxer_context *ctx, mp3_source *source, FILE *dst_fp);
+static int
+id3_force_js_v1_internal(mp3demuxer_context *ctx, mp3_source *source, FILE *dst_fp, uint64_t begin_pos);
+static int
+id3_force_js_v2(mp3demuxer_context *ctx, mp3_source *source, FILE *dst_fp);
+
+static int
+mp3_rule_add(mp3_rule_set *set, const char *text);
+static int
+mp3_rule_rewrite(const mp3_rule_set *set, uint64_t frame, uint8_t *data);
+static int
+mp3_rule_rewrite_frame(mp3demuxer_context *ctx, uint64_t frame, uint8_t *head, size_t length);
+static size_t
+mp3_frame_head(mp3_frame_iter *iter, const mp3_frame_event *event, uint8_t *head);
+static void
+mp3_crc_report(mp3demuxer_context *ctx, FILE *report);
+
+static int
+mp3_id3v2_end(mp3_source *source, uint64_t *begin_pos);
 
+#ifndef WIN32
+static int
+id3_force_js_inplace_v1(mp3demuxer_context *ctx, int fd);
 static int
-id3_analyzation_v1_internal(FILE *fp,
-                    uint32_t begin_pos,
-                    uint32_t *num_frame,
-                    uint32_t *sample_rate,
-                    uint8_t *channel,
-                    uint8_t *version,
-                    uint8_t *layer);
+id3_force_js_inplace_internal(mp3demuxer_context *ctx, int fd, uint64_t begin_pos);
 static int
-id3_analyzation_v2(FILE *fp,
-                    uint32_t *num_frame,
-                    uint32_t *sample_rate,
-                    uint8_t *channel,
-                    uint8_t *version,
-                    uint8_t *layer);
+id3_force_js_inplace_v2(mp3demuxer_context *ctx, int fd);
 
 static int
-id3_skip_frame_v1(FILE *fp, uint32_t *frame);
+id3_force_js_zerocopy_v1(mp3demuxer_context *ctx, int src_fd, int dst_fd);
+static int
+id3_force_js_zerocopy_internal(mp3demuxer_context *ctx, int src_fd, int dst_fd, uint64_t begin_pos);
+static int
+id3_force_js_zerocopy_v2(mp3demuxer_context *ctx, int src_fd, int dst_fd);
 
 static int
-id3_skip_frame_v1_internal(FILE *fp, uint32_t begin_pos, uint32_t *frame);
+id3_force_js_pipeline_v1(mp3demuxer_context *ctx, int src_fd, int dst_fd);
+static int
+id3_force_js_pipeline_internal(mp3demuxer_context *ctx, int src_fd, int dst_fd, uint64_t begin_pos);
+static int
+id3_force_js_pipeline_v2(mp3demuxer_context *ctx, int src_fd, int dst_fd);
 
+static char *
+mp3_journal_path(const char *filename);
 static int
-id3_skip_frame_v2(FILE *fp, uint32_t *frame);
+mp3_journal_rollback(const char *filename);
 
 static int
-id3_force_js_v1(FILE *src_fp, FILE *dst_fp);
+mp3_same_file(const char *src_filename, const char *dst_filename);
 static int
-id3_force_js_v1_internal(FILE *src_fp, FILE *dst_fp, uint32_t begin_pos);
+mp3_cut(mp3demuxer_context *ctx, int src_fd, int dst_fd);
 static int
-id3_force_js_v2(FILE *src_fp, FILE *dst_fp);
+mp3_join(mp3demuxer_context *ctx, int dst_fd);
+#endif
 
 /**
- * 
- *
+ * in-place patch list / rollback journal
  *
  */
-
-typedef struct mp3_frame_header_tag {
-    uint8_t version;
-    uint8_t layer;
-    uint8_t protection_bit;
-    uint8_t bitrate_index;
-    uint8_t sampling_frequency_index;
-    uint8_t padding_bit;
-    uint8_t private_bit;
-    uint8_t channel_mode;
-    uint8_t mode_extension;
-    uint8_t copyright;
-    uint8_t original;
-    uint8_t emphasis;
-} mp3_frame_header;
+#define MP3_JOURNAL_MAGIC "MP3JSJ01"
+#define MP3_JOURNAL_SUFFIX ".jsjournal"
+
+#define MP3_PATCH_WINDOW (256 * 1024)// max bytes per read-modify-write
+#define MP3_PATCH_GAP 4096// merge patches closer than a page
+#define MP3_PATCH_PARALLEL_THRESHOLD (64 * 1024)// patches before threads pay off
+#define MP3_PATCH_MAX_THREADS 32
+
+typedef struct mp3_patch_tag {
+    uint64_t offset;
+    uint8_t old_value;
+    uint8_t new_value;
+    uint8_t reserved[6];
+} mp3_patch;
+
+typedef struct mp3_patch_list_tag {
+    mp3_patch *patches;
+    size_t count;
+    size_t capacity;
+    size_t frames;// headers with a patch
+} mp3_patch_list;
+
+#define MP3_COPY_CHUNK (1024 * 1024)// read/write fallback
+#define MP3_SENDFILE_CHUNK (64 * 1024 * 1024)
+
+typedef enum mp3_copy_engine_tag {
+    MP3_COPY_READ_WRITE = 0,
+    MP3_COPY_SENDFILE = 1,
+    MP3_COPY_FILE_RANGE = 2,
+    MP3_COPY_REFLINK = 3,
+} mp3_copy_engine;
+
+#define MP3_PIPE_BUFFER (4 * 1024 * 1024)// bytes per pipeline buffer
+#define MP3_PIPE_BUFFERS 8// in flight, a power of two
+#define MP3_PIPE_ALIGN 4096// O_DIRECT buffer, offset and length alignment
+#define MP3_PIPE_SPIN 64// yields before a waiting stage sleeps
+
+typedef enum mp3_pipe_status_tag {
+    MP3_PIPE_DATA = 0,
+    MP3_PIPE_END = 1,// no data, last buffer of the run
+} mp3_pipe_status;
+
+typedef struct mp3_pipe_buffer_tag {
+    uint8_t *data;// MP3_PIPE_ALIGN aligned
+    uint64_t offset;// in the file
+    size_t length;
+    mp3_pipe_status status;
+} mp3_pipe_buffer;
+
+//single producer, single consumer
+typedef struct mp3_pipe_ring_tag {
+    mp3_pipe_buffer *slots[MP3_PIPE_BUFFERS];
+    uint32_t head;// next pop, consumer owned
+    uint32_t tail;// next push, producer owned
+} mp3_pipe_ring;
+
+typedef struct mp3_pipeline_tag {
+    int src_fd;
+    int dst_fd;
+    uint64_t file_size;
+    uint8_t direct;// O_DIRECT is set on both descriptors
+    mp3demuxer_context *ctx;// rules and CRC tallies
+
+    mp3_pipe_buffer buffers[MP3_PIPE_BUFFERS];
+    mp3_pipe_ring free_ring;// writer -> reader
+    mp3_pipe_ring read_ring;// reader -> patcher
+    mp3_pipe_ring patch_ring;// patcher -> writer
+
+    int result;// first error of any stage, atomic
+    int abort;// the reader stops early, atomic
+
+    mp3_counters *counters;
+    mp3_counters reader_counters;
+    mp3_counters writer_counters;
+} mp3_pipeline;
+
+typedef struct mp3_journal_header_tag {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t count;
+} mp3_journal_header;
 
 typedef struct mp3_id3v1_tag {
 }mp3_id3v1;
@@ -152,54 +337,6 @@ static uint32_t mediatype_table[][4] =
     {Unknown, MPEG1A, MPEG1A, MPEG1A}
 };
 
-//[version][layer][value]
-static uint32_t bitrate_table[][4][16] = 
-{
-    {//mpeg2.5
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2.5
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2.5
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0} //mpeg2.5
-    },
-    {//reserved
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0} //reserved
-    },
-    {//mpeg2
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2 L3
-        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2 L2
-        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0}//mpeg2 L1
-    },
-    {//mpeg1
-        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
-        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},//mpeg1 L3
-        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},//mpeg1 L2
-        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0}//mpeg1 L1
-    }
-};
-
-//[version][index]
-static uint32_t sampling_rate_table[][4] = 
-{
-    {11025, 12000, 8000, 0},//mpeg2.5
-    {0, 0, 0, 0},//reserved
-    {22050, 24000, 16000, 0},//mpeg2
-    {44100, 48000, 32000, 0} //mpeg1
-};
-
-//
-static uint32_t channel_table[] = 
-{
-    2, 2, 2, 1
-};
-
-
-static void
-dump_mp3header(uint32_t frame_num, mp3_frame_header *header);
-
 ///////////////////////////////////////
 
 
@@ -208,6 +345,12 @@ int main(int argc, char* argv[])
 {
     if(argc < 3) {
         fprintf(stderr, "*error* : comnadline argument must be lager than 1\n");
+        fprintf(stderr, "USAGE : [--backend=stdio|zerocopy|pipeline [--direct]] [--stats[=json]] <input mp3 file|-> <output mp3 file|->\n");
+        fprintf(stderr, "        --in-place [--journal] [--threads=<n>] [--stats[=json]] <mp3 file>\n");
+        fprintf(stderr, "        [--rule=<field>=<value>[@<first>-<last>][?<field>=<value>] ...] with any of the above\n");
+        fprintf(stderr, "        --rollback <mp3 file>\n");
+        fprintf(stderr, "        --cut=<first>-[<last>]|--cut-time=<start>-[<end>] [--reservoir=include|drop] <input mp3 file> <output mp3 file>\n");
+        fprintf(stderr, "        --join [--xing] <input mp3 file> ... <output mp3 file>\n");
         return -1;
     }
 
@@ -218,70 +361,444 @@ int main(int argc, char* argv[])
     FILE *dst_fp;
     uint8_t mp3_header[4];
     size_t read_size;
+    uint8_t rollback = 0;
+    mp3_stream *stream = NULL;
+    mp3_source source;
+    FILE *report = stdout;
+    mp3_counters counters;
+    uint8_t use_stats = 0;// 1:human 2:json
+    uint64_t phase_begin;
+    int result;
 
     //init
     memset(&mp3demuxer, 0x00, sizeof(mp3demuxer_context));
+    mp3_counters_init(&counters);
+    mp3demuxer.join_files = (char **)malloc(sizeof(char *) * argc);
+    if(!mp3demuxer.join_files)
+        return -1;
+
+    //options
+    for(int i = 1; i < argc; i++) {
+        if(0 == strcmp(argv[i], "--backend=stdio")) {
+            mp3demuxer.io_backend = MP3_IO_STDIO;
+        }
+        else if(0 == strcmp(argv[i], "--backend=zerocopy")) {
+#ifdef WIN32
+            fprintf(stderr, "*error* : zerocopy backend is not supported on this platform\n");
+            return -1;
+#else
+            mp3demuxer.io_backend = MP3_IO_ZEROCOPY;
+#endif
+        }
+        else if(0 == strcmp(argv[i], "--backend=pipeline")) {
+#ifdef WIN32
+            fprintf(stderr, "*error* : pipeline backend is not supported on this platform\n");
+            return -1;
+#else
+            mp3demuxer.io_backend = MP3_IO_PIPELINE;
+#endif
+        }
+        else if(0 == strcmp(argv[i], "--direct")) {
+            mp3demuxer.direct = 1;
+        }
+        else if(0 == strncmp(argv[i], "--cut=", 6) ||
+                0 == strncmp(argv[i], "--cut-time=", 11)) {
+            const char *range = strchr(argv[i], '=') + 1;
+            char *end;
+
+            if(argv[i][5] == '=') {
+                mp3demuxer.cut = MP3_CUT_FRAMES;
+                mp3demuxer.cut_first = strtoull(range, &end, 10);
+                mp3demuxer.cut_last = UINT64_MAX;
+                if(end != range && *end == '-' && end[1])
+                    mp3demuxer.cut_last = strtoull(end + 1, &end, 10);
+                else if(end != range && *end == '-')
+                    end++;
+            }
+            else {
+                mp3demuxer.cut = MP3_CUT_TIME;
+                mp3demuxer.cut_start = strtod(range, &end);
+                mp3demuxer.cut_end = -1.0;
+                if(end != range && *end == '-' && end[1])
+                    mp3demuxer.cut_end = strtod(end + 1, &end);
+                else if(end != range && *end == '-')
+                    end++;
+            }
+            if(end == range || *end ||
+                (mp3demuxer.cut == MP3_CUT_FRAMES && mp3demuxer.cut_last < mp3demuxer.cut_first) ||
+                (mp3demuxer.cut == MP3_CUT_TIME && (mp3demuxer.cut_start < 0.0 ||
+                    (mp3demuxer.cut_end >= 0.0 && mp3demuxer.cut_end <= mp3demuxer.cut_start)))) {
+                fprintf(stderr, "*error* : invalid range : %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if(0 == strcmp(argv[i], "--reservoir=include")) {
+            mp3demuxer.cut_drop = 0;
+        }
+        else if(0 == strcmp(argv[i], "--reservoir=drop")) {
+            mp3demuxer.cut_drop = 1;
+        }
+        else if(0 == strcmp(argv[i], "--join")) {
+            mp3demuxer.join = 1;
+        }
+        else if(0 == strcmp(argv[i], "--xing")) {
+            mp3demuxer.join_xing = 1;
+        }
+        else if(0 == strncmp(argv[i], "--rule=", 7)) {
+            if(mp3_rule_add(&mp3demuxer.rules, argv[i] + 7)) {
+                fprintf(stderr, "*error* : invalid rule : %s\n", argv[i] + 7);
+                return -1;
+            }
+        }
+        else if(0 == strcmp(argv[i], "--in-place")) {
+            mp3demuxer.in_place = 1;
+        }
+        else if(0 == strcmp(argv[i], "--journal")) {
+            mp3demuxer.journal = 1;
+        }
+        else if(0 == strncmp(argv[i], "--threads=", 10)) {
+            mp3demuxer.threads = (uint32_t)strtoul(argv[i] + 10, NULL, 10);
+        }
+        else if(0 == strcmp(argv[i], "--rollback")) {
+            rollback = 1;
+        }
+        else if(0 == strcmp(argv[i], "--stats")) {
+            use_stats = 1;
+        }
+        else if(0 == strcmp(argv[i], "--stats=json")) {
+            use_stats = 2;
+        }
+        else if(0 == strncmp(argv[i], "--", 2)) {
+            fprintf(stderr, "*error* : unknown option : %s\n", argv[i]);
+            return -1;
+        }
+        else if(!mp3demuxer.src_filename) {
+            mp3demuxer.src_filename = argv[i];
+            mp3demuxer.join_files[mp3demuxer.join_count++] = argv[i];
+        }
+        else {
+            mp3demuxer.dst_filename = argv[i];
+            mp3demuxer.join_files[mp3demuxer.join_count++] = argv[i];
+        }
+    }
+    if(mp3demuxer.join_count)
+        mp3demuxer.join_count--;//the last one is the output
 
-    mp3demuxer.src_filename = argv[1];
-    mp3demuxer.dst_filename = argv[2];
+    if(!mp3demuxer.src_filename ||
+        (!mp3demuxer.in_place && !rollback && !mp3demuxer.dst_filename)) {
+        fprintf(stderr, "*error* : missing input or output mp3 file\n");
+        return -1;
+    }
+    if(use_stats)
+        mp3demuxer.counters = &counters;
+    if(mp3demuxer.cut && mp3demuxer.join) {
+        fprintf(stderr, "*error* : --cut and --join cannot be combined\n");
+        return -1;
+    }
+    if(mp3demuxer.cut) {
+        //a cut copies the frames as they are
+        if(mp3demuxer.rules.count || mp3demuxer.in_place || rollback) {
+            fprintf(stderr, "*error* : --cut does not take --rule, --in-place or --rollback\n");
+            return -1;
+        }
+    }
+    else if(mp3demuxer.join) {
+        //a join copies the frames as they are
+        if(mp3demuxer.rules.count || mp3demuxer.in_place || rollback) {
+            fprintf(stderr, "*error* : --join does not take --rule, --in-place or --rollback\n");
+            return -1;
+        }
+    }
+    else if(mp3demuxer.rules.count == 0)
+        mp3_rule_add(&mp3demuxer.rules, "channel_mode=joint");
 
-    //check header
-    src_fp = fopen(mp3demuxer.src_filename, "rb");//open
-    if(!src_fp) {
-        fprintf(stderr, "*error* : file open failed : at %s\n", mp3demuxer.src_filename);
-    fclose(src_fp);//close
+#ifdef WIN32
+    if(mp3demuxer.in_place || rollback) {
+        fprintf(stderr, "*error* : in-place editing is not supported on this platform\n");
+        return -1;
+    }
+    if(mp3demuxer.cut || mp3demuxer.join) {
+        fprintf(stderr, "*error* : cutting and joining are not supported on this platform\n");
         return -1;
     }
-    read_size = fread(mp3_header, 1, 4, src_fp);
-    fclose(src_fp);//close
+#else
+    if(rollback) {
+        int result = mp3_journal_rollback(mp3demuxer.src_filename);
+        if(result < 0) {
+            fprintf(stderr, "*error* : rollback failed : at %s\n", mp3demuxer.src_filename);
+            return -1;
+        }
+        printf(result ? "no journal\n" : "rolled back\n");
+        return 0;
+    }
+#endif
+
+    //"-" streams stdin/stdout, only through the stdio backend
+    for(uint32_t i = 0; mp3demuxer.join && i <= mp3demuxer.join_count; i++) {
+        if(0 == strcmp(mp3demuxer.join_files[i], "-")) {
+            fprintf(stderr, "*error* : joining needs seekable files\n");
+            return -1;
+        }
+    }
+    if(0 == strcmp(mp3demuxer.src_filename, "-") ||
+        (mp3demuxer.dst_filename && 0 == strcmp(mp3demuxer.dst_filename, "-"))) {
+        if(mp3demuxer.in_place || mp3demuxer.cut || mp3demuxer.join || mp3demuxer.io_backend != MP3_IO_STDIO) {
+            fprintf(stderr, "*error* : in-place, zerocopy, pipeline editing, cutting and joining need seekable files\n");
+            return -1;
+        }
+    }
+    if(mp3demuxer.dst_filename && 0 == strcmp(mp3demuxer.dst_filename, "-"))
+        report = stderr;//stdout carries the mp3
+
+    //check header
+    if(0 == strcmp(mp3demuxer.src_filename, "-")) {
+        stream = (mp3_stream *)malloc(sizeof(mp3_stream));
+        if(!stream)
+            return -1;
+#ifdef WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        mp3_source_open_stream(&source, stream, fileno(stdin));
+        source.counters = mp3demuxer.counters;
+        read_size = source.read(&source, 0, mp3_header, 4) ? 0 : 4;
+    }
+    else {
+        src_fp = fopen(mp3demuxer.src_filename, "rb");//open
+        if(!src_fp) {
+            fprintf(stderr, "*error* : file open failed : at %s\n", mp3demuxer.src_filename);
+            return -1;
+        }
+        read_size = fread(mp3_header, 1, 4, src_fp);
+        fclose(src_fp);//close
+    }
 
     if(read_size != 4) {
         fprintf(stderr, "*error* : invalid file size\n");
+        free(stream);
         return -1;
     }
 
     if(mp3_header[0] == 0xff ||
         (mp3_header[1] & 0xe0) == 0xe0) {//MP3Header
             mp3demuxer.force_js = id3_force_js_v1;
-            mp3demuxer.analyze = id3_analyzation_v1;
-            mp3demuxer.skip_frame = id3_skip_frame_v1;
-            printf("mp3v1\n");
+#ifndef WIN32
+            mp3demuxer.force_js_inplace = id3_force_js_inplace_v1;
+            mp3demuxer.force_js_zerocopy = id3_force_js_zerocopy_v1;
+            mp3demuxer.force_js_pipeline = id3_force_js_pipeline_v1;
+#endif
+            fprintf(report, "mp3v1\n");
     }
     else if (mp3_header[0] == 0x49 &&
                 mp3_header[1] == 0x44 &&
                 mp3_header[2] == 0x33) {//ID3Header
             mp3demuxer.force_js = id3_force_js_v2;
-            mp3demuxer.analyze = id3_analyzation_v2;
-            mp3demuxer.skip_frame = id3_skip_frame_v2;
-            printf("mp3v2\n");
+#ifndef WIN32
+            mp3demuxer.force_js_inplace = id3_force_js_inplace_v2;
+            mp3demuxer.force_js_zerocopy = id3_force_js_zerocopy_v2;
+            mp3demuxer.force_js_pipeline = id3_force_js_pipeline_v2;
+#endif
+            fprintf(report, "mp3v2\n");
     }
     else {
         fprintf(stderr, "*error* : invalid header\n");
+        free(stream);
         return -1;
     }
 
-    
-    //
-    src_fp = fopen(mp3demuxer.src_filename, "rb");//open
-    if(!src_fp) {
-        fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.src_filename);
+#ifndef WIN32
+    if(mp3demuxer.join) {
+        int dst_fd;
+
+        //the output is truncated before the inputs are read
+        for(uint32_t i = 0; i < mp3demuxer.join_count; i++) {
+            if(mp3_same_file(mp3demuxer.join_files[i], mp3demuxer.dst_filename)) {
+                fprintf(stderr, "*error* : the output is one of the inputs : at %s\n", mp3demuxer.dst_filename);
+                return -1;
+            }
+        }
+        dst_fd = open(mp3demuxer.dst_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);//open
+        if(dst_fd < 0) {
+            fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.dst_filename);
+            return -1;
+        }
+        phase_begin = mp3_counters_begin(mp3demuxer.counters);
+        result = mp3_join(&mp3demuxer, dst_fd);
+        mp3_counters_end(mp3demuxer.counters, MP3_PHASE_SCAN, phase_begin);
+        if(close(dst_fd) && 0 == result) {//close
+            fprintf(stderr, "*error* : write failed : at %s\n", mp3demuxer.dst_filename);
+            result = -1;
+        }
+        if(result) {
+            fprintf(stderr, "*error* : joining failed\n");
+            remove(mp3demuxer.dst_filename);
+            return -1;
+        }
+        if(use_stats)
+            mp3_counters_print(&counters, use_stats == 2, stderr);
+        return 0;
+    }
+
+    if(mp3demuxer.cut) {
+        int src_fd;
+        int dst_fd;
+
+        if(mp3_same_file(mp3demuxer.src_filename, mp3demuxer.dst_filename)) {
+            fprintf(stderr, "*error* : the output is the input : at %s\n", mp3demuxer.dst_filename);
+            return -1;
+        }
+        src_fd = open(mp3demuxer.src_filename, O_RDONLY);//open
+        if(src_fd < 0) {
+            fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.src_filename);
+            return -1;
+        }
+        dst_fd = open(mp3demuxer.dst_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);//open
+        if(dst_fd < 0) {
+            fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.dst_filename);
+            close(src_fd);//close
+            return -1;
+        }
+        phase_begin = mp3_counters_begin(mp3demuxer.counters);
+        result = mp3_cut(&mp3demuxer, src_fd, dst_fd);
+        mp3_counters_end(mp3demuxer.counters, MP3_PHASE_SCAN, phase_begin);
+        close(src_fd);//close
+        if(close(dst_fd) && 0 == result) {//close
+            fprintf(stderr, "*error* : write failed : at %s\n", mp3demuxer.dst_filename);
+            result = -1;
+        }
+        if(result) {
+            fprintf(stderr, "*error* : cutting failed\n");
+            remove(mp3demuxer.dst_filename);
+            return -1;
+        }
+        if(use_stats)
+            mp3_counters_print(&counters, use_stats == 2, stderr);
+        return 0;
+    }
+
+    if(mp3demuxer.in_place) {
+        int fd;
+        char *journal_path = mp3_journal_path(mp3demuxer.src_filename);
+        struct stat st;
+
+        if(journal_path && 0 == stat(journal_path, &st)) {
+            fprintf(stderr, "*error* : interrupted run found, use --rollback first : at %s\n", journal_path);
+            free(journal_path);
+            return -1;
+        }
+        free(journal_path);
+
+        fd = open(mp3demuxer.src_filename, O_RDWR);//open
+        if(fd < 0) {
+            fprintf(stderr, "*error* : file open for patching failed : at %s\n", mp3demuxer.src_filename);
+            return -1;
+        }
+        phase_begin = mp3_counters_begin(mp3demuxer.counters);
+        if(mp3demuxer.force_js_inplace(&mp3demuxer, fd)) {
+            fprintf(stderr, "*error* : patching failed\n");
+            close(fd);//close
+            return -1;
+        }
+        mp3_counters_end(mp3demuxer.counters, MP3_PHASE_SCAN, phase_begin);
+        close(fd);//close
+        mp3_crc_report(&mp3demuxer, report);
+        if(use_stats)
+            mp3_counters_print(&counters, use_stats == 2, stderr);
+        return 0;
+    }
+
+    //every backend truncates the output before it reads the input
+    if(!stream && 0 != strcmp(mp3demuxer.dst_filename, "-") &&
+        mp3_same_file(mp3demuxer.src_filename, mp3demuxer.dst_filename)) {
+        fprintf(stderr, "*error* : the output is the input, use --in-place : at %s\n", mp3demuxer.dst_filename);
+        free(stream);
         return -1;
-    }    
+    }
+
+    if(mp3demuxer.io_backend == MP3_IO_ZEROCOPY ||
+        mp3demuxer.io_backend == MP3_IO_PIPELINE) {
+        int src_fd;
+        int dst_fd;
+
+        src_fd = open(mp3demuxer.src_filename, O_RDONLY);//open
+        if(src_fd < 0) {
+            fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.src_filename);
+            return -1;
+        }
+        dst_fd = open(mp3demuxer.dst_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);//open
+        if(dst_fd < 0) {
+            fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.dst_filename);
+            close(src_fd);//close
+            return -1;
+        }
+        phase_begin = mp3_counters_begin(mp3demuxer.counters);
+        if(mp3demuxer.io_backend == MP3_IO_PIPELINE ?
+            mp3demuxer.force_js_pipeline(&mp3demuxer, src_fd, dst_fd) :
+            mp3demuxer.force_js_zerocopy(&mp3demuxer, src_fd, dst_fd)) {
+            fprintf(stderr, "*error* : analyzation failed\n");
+            close(src_fd);//close
+            close(dst_fd);//close
+            return -1;
+        }
+        mp3_counters_end(mp3demuxer.counters, MP3_PHASE_SCAN, phase_begin);
+        close(src_fd);//close
+        if(close(dst_fd)) {//close
+            fprintf(stderr, "*error* : write failed : at %s\n", mp3demuxer.dst_filename);
+            return -1;
+        }
+        mp3_crc_report(&mp3demuxer, report);
+        if(use_stats)
+            mp3_counters_print(&counters, use_stats == 2, stderr);
+        return 0;
+    }
+#endif
+
+    //
+    src_fp = NULL;
+    if(!stream) {
+        src_fp = fopen(mp3demuxer.src_filename, "rb");//open
+        if(!src_fp ||
+            mp3_source_open_fd(&source, fileno(src_fp))) {
+            fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.src_filename);
+            if(src_fp)
+                fclose(src_fp);//close
+            return -1;
+        }
+        source.counters = mp3demuxer.counters;
+    }
     //
-    dst_fp = fopen(mp3demuxer.dst_filename, "wb");//open
+    if(0 == strcmp(mp3demuxer.dst_filename, "-")) {
+#ifdef WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        dst_fp = stdout;
+    }
+    else
+        dst_fp = fopen(mp3demuxer.dst_filename, "wb");//open
     if(!dst_fp) {
         fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", mp3demuxer.dst_filename);
+        if(src_fp)
+            fclose(src_fp);//close
+        free(stream);
         return -1;
     }
 
-    if(mp3demuxer.force_js(src_fp, dst_fp)) {
-        fprintf(stderr, "*error* : analyzation failed\n");
+    phase_begin = mp3_counters_begin(mp3demuxer.counters);
+    result = mp3demuxer.force_js(&mp3demuxer, &source, dst_fp);
+    if(src_fp)
         fclose(src_fp);//close
-        fclose(dst_fp);//close
+    free(stream);
+    if(dst_fp == stdout ? fflush(dst_fp) : fclose(dst_fp)) {//close
+        fprintf(stderr, "*error* : write failed : at %s\n", mp3demuxer.dst_filename);
         return -1;
     }
-    fclose(src_fp);//close
-    fclose(dst_fp);//close
+    mp3_counters_end(mp3demuxer.counters, MP3_PHASE_SCAN, phase_begin);
+    if(result) {
+        fprintf(stderr, "*error* : analyzation failed\n");
+        return -1;
+    }
+    mp3_crc_report(&mp3demuxer, report);
+    if(use_stats)
+        mp3_counters_print(&counters, use_stats == 2, stderr);
 
 
     return 0;
@@ -289,569 +806,1870 @@ int main(int argc, char* argv[])
 
 ///////////////////////////////////////////////////////////////////
 static int
-id3_analyzation_v1(FILE *fp,
-                    uint32_t *num_frame,
-                    uint32_t *sample_rate,
-                    uint8_t *channel,
-                    uint8_t *version,
-                    uint8_t *layer)
+id3_force_js_v1(mp3demuxer_context *ctx, mp3_source *source, FILE *dst_fp)
 {
-    return id3_analyzation_v1_internal(fp, 0, num_frame, sample_rate, channel, version, layer);
+    return id3_force_js_v1_internal(ctx, source, dst_fp, 0);
 }
-//[t[̏Ȃ
+//fwrite, counted
 static int
-id3_analyzation_v1_internal(FILE *fp,
-                    uint32_t begin_pos,
-                    uint32_t *num_frame,
-                    uint32_t *sample_rate,
-                    uint8_t *channel,
-                    uint8_t *version,
-                    uint8_t *layer)
+mp3_write(mp3_counters *counters, const void *data, size_t length, FILE *dst_fp)
 {
-    mp3_frame_header header;
-    uint8_t data[4];
-    size_t read_size;
-    size_t frame_count = 0;
-
-    size_t frame_size = 0;
-    size_t data_end;
+    uint64_t begin = mp3_counters_begin(counters);
 
-    uint32_t sr, br;
-
-    uint8_t tag_exist = 0;
-
-    if(fseek(fp, 0, SEEK_END))//end
+    if(fwrite(data, 1, length, dst_fp) != length)//write
         return -1;
-
-    data_end = ftell(fp);
-
-    //TAG
-    if(data_end > 128) {
-        fseek(fp, -128, SEEK_END);
-        fread(data, 1, 4, fp);
-        if(0 == memcmp(data, "TAG", 3))
-            tag_exist = 1;
+    if(counters) {
+        counters->write_calls++;
+        counters->bytes_written += length;
+        mp3_counters_end(counters, MP3_PHASE_WRITE, begin);
     }
-    if(tag_exist)
-        data_end -= 128;
-
-    if(fseek(fp, begin_pos, SEEK_SET))//start
-        return -1;
-
-    while (1) {
-
-        if(data_end <= ftell(fp))
-            break;//end
-    
-        read_size = fread(data, 1, 4, fp);
-
-        if(read_size < 4) {
-            return -1;//error
-        }
-
-
-#if 1
-        if(data[0] != 0xff ||
-            data[1] & 0xe0 != 0xe0)
-                return -2;//error
-
-#else
-        if(data[0] != 0xff ||
-            data[1] & 0xe0 != 0xe0) {
-
-                while(true) {
-                    read_size = fread(data, 1, 4, fp);
-
-                    if(read_size < 4) {
-                        return RME_IO_ERROR;//error
-                    }
-
-                    if(data[0] == 0xff &&
-                        data[1] == 0xff &&
-                        data[2] == 0xff &&
-                        data[3] == 0xff)
-                        break;
-                }
-                continue;
-        }
-#endif
-
-        header.version = (data[1] & 0x18) >> 3;
-        header.layer = (data[1] & 0x06) >> 1;
-        header.protection_bit = (data[1] & 0x01);
-        header.bitrate_index = (data[2] & 0xF0) >> 4;
-        header.sampling_frequency_index = (data[2] & 0x06) >> 2;
-        header.padding_bit = (data[2] & 0x02) >> 1;
-        header.private_bit = (data[2] & 0x01);
-        header.channel_mode = (data[3] & 0xc0) >> 6;
-        header.mode_extension = (data[3] & 0x30) >> 4;
-        header.copyright = (data[3] & 0x08) >> 3;
-        header.original = (data[3] & 0x04) >> 2;
-        header.emphasis = (data[3] & 0x03);
-
-        dump_mp3header(frame_count, &header);//dump
-
-        frame_count++;
-
-        sr = sampling_rate_table[header.version][header.sampling_frequency_index];//sampling rate
-        br = bitrate_table[header.version][header.layer][header.bitrate_index] * 1000;//bitrate
+    return 0;
+}
 
-        frame_size = (MP3_BYTE_ATTR_PER_FRAME * br / sr) + header.padding_bit;
+//copy length bytes from the iterator window to dst_fp
+static int
+mp3_copy_range(mp3_frame_iter *iter, uint64_t offset, uint64_t length, FILE *dst_fp)
+{
+    const uint8_t *data;
+    size_t available;
 
-        if(fseek(fp, frame_size - 4, SEEK_CUR))
+    while(length) {
+        data = mp3_iter_data(iter, offset, &available);//read
+        if(!data)
             return -1;
+        if(available > length)
+            available = (size_t)length;
+        if(mp3_write(iter->counters, data, available, dst_fp))
+            return -1;
+        offset += available;
+        length -= available;
     }
 
-    *num_frame = frame_count;
-    *sample_rate = sampling_rate_table[header.version][header.sampling_frequency_index];
-    *channel = channel_table[header.channel_mode];
-    *version = header.version;
-    *layer = header.layer;
-
     return 0;
 }
 
+//[t[̏Ȃ
 static int
-id3_analyzation_v2(FILE *fp,
-                    uint32_t *num_frame,
-                    uint32_t *sample_rate,
-                    uint8_t *channel,
-                    uint8_t *version,
-                    uint8_t *layer)
+id3_force_js_v1_internal(mp3demuxer_context *ctx, mp3_source *source, FILE *dst_fp, uint64_t begin_pos)
 {
-    uint8_t data[10];
-    uint32_t read_size;
-    uint32_t id3v2_length;
+    mp3_frame_iter iter;
+    mp3_frame_event event;
+    uint64_t frame = 0;
+    uint8_t head[MP3_CRC_HEAD];
+    size_t length;
+    uint64_t audio_begin;
+    uint64_t data_end;
+    int result;
 
-    read_size = fread(data, 1, 10, fp);
-    if(read_size != 10)
+    if(mp3_source_audio_region(source, &audio_begin, &data_end))
         return -1;
-    
-    if(data[0] != 0x49 ||
-        data[1] != 0x44 ||
-        data[2] != 0x33)
-        return -2;
 
-    id3v2_length = 0;
-    id3v2_length = ((data[6] & 0x7F) << 21) |
-                    ((data[7] & 0x7F) << 14) |
-                    ((data[8] & 0x7F) << 7) |
-                    ((data[9] & 0x7F) << 0);
+    mp3_iter_init(&iter, source, begin_pos, data_end);
+    iter.strict = 1;
 
-    if(fseek(fp, id3v2_length, SEEK_CUR))
+    // HEADER
+    if(mp3_copy_range(&iter, 0, begin_pos, dst_fp))
         return -1;
 
-    //search
+    while (0 < (result = mp3_iter_next(&iter, &event))) {
+
+        length = mp3_frame_head(&iter, &event, head);
+        if(length < 4)
+            return -1;
+
+        //data manipuration //******
+        mp3_rule_rewrite_frame(ctx, frame++, head, length);
+
+        if(mp3_write(iter.counters, head, length, dst_fp))
+            return -1;
+        if(mp3_copy_range(&iter, event.offset + length, event.size - length, dst_fp))
+            return -1;
+    }
+    if(result)
+        return result;//error
+
+    //write mp3tag, a stream knows where it is only now
+    if(iter.data_end < source->size) {
+        if(mp3_copy_range(&iter, iter.data_end, source->size - iter.data_end, dst_fp))
+            return -1;
+    }
 
-    return id3_analyzation_v1_internal(fp, ftell(fp), num_frame, sample_rate, channel, version, layer);
+    return 0;
 }
 
 static int
-id3_skip_frame_v1(FILE *fp, uint32_t *frame)
+id3_force_js_v2(mp3demuxer_context *ctx, mp3_source *source, FILE *dst_fp)
 {
+    uint64_t begin_pos;
     int result;
-    uint32_t skip_first = 1;
-    result = id3_skip_frame_v1_internal(fp, 0, &skip_first);
-    if(0 != result)//skip first frame
+
+    result = mp3_id3v2_end(source, &begin_pos);
+    if(result)
         return result;
-    if(1 != skip_first)
-        return -2;
 
-    return id3_skip_frame_v1_internal(fp, ftell(fp), frame);
+    return id3_force_js_v1_internal(ctx, source, dst_fp, begin_pos);
 }
 
+//end of the ID3v2 tag
 static int
-id3_skip_frame_v1_internal(FILE *fp, uint32_t begin_pos, uint32_t *frame)
+mp3_id3v2_end(mp3_source *source, uint64_t *begin_pos)
 {
-    mp3_frame_header header;
-    uint8_t data[4];
-    size_t read_size;
-    size_t frame_count = 0;
-
-    size_t frame_size = 0;
+    uint64_t data_end;
 
-    uint32_t sr, br;
-
-    uint8_t tag_exist = 0;
-
-    if(fseek(fp, begin_pos, SEEK_SET))//start
+    if(mp3_source_audio_region(source, begin_pos, &data_end))
         return -1;
+    if(*begin_pos == 0)
+        return -2;//no ID3v2 tag
 
-    while (frame_count < *frame) {
-    
-        read_size = fread(data, 1, 4, fp);
-
-        if(read_size < 4) {
-            *frame = frame_count;
-            if(feof(fp))
-                return 1;
-            else
-                return -1;//error
-        }
-        
-#if 1
-        if(data[0] != 0xff ||
-            data[1] & 0xe0 != 0xe0)
-                return -2;//error
-
-#else
-        if(data[0] != 0xff ||
-            data[1] & 0xe0 != 0xe0) {
-
-                while(true) {
-                    read_size = fread(data, 1, 4, fp);
-
-                    if(read_size < 4) {
-                        return RME_IO_ERROR;//error
-                    }
+    return 0;
+}
 
-                    if(data[0] == 0xff &&
-                        data[1] == 0xff &&
-                        data[2] == 0xff &&
-                        data[3] == 0xff)
-                        break;
-                }
-                continue;
-        }
-#endif
+///////////////////////////////////////////////////////////////////
+// header rewrite rules
 
-        header.version = (data[1] & 0x18) >> 3;
-        header.layer = (data[1] & 0x06) >> 1;
-        header.protection_bit = (data[1] & 0x01);
-        header.bitrate_index = (data[2] & 0xF0) >> 4;
-        header.sampling_frequency_index = (data[2] & 0x06) >> 2;
-        header.padding_bit = (data[2] & 0x02) >> 1;
-        header.private_bit = (data[2] & 0x01);
-        header.channel_mode = (data[3] & 0xc0) >> 6;
-        header.mode_extension = (data[3] & 0x30) >> 4;
-        header.copyright = (data[3] & 0x08) >> 3;
-        header.original = (data[3] & 0x04) >> 2;
-        header.emphasis = (data[3] & 0x03);
+static const char* channel_mode_name[] = { "stereo", "joint", "dual", "mono" };
+static const char* emphasis_name[] = { "none", "50/15", "reserved", "ccitt" };
 
-        frame_count++;
+static const mp3_header_field header_field_table[] =
+{
+    { "version", 19, 2, 0, NULL },
+    { "layer", 17, 2, 0, NULL },
+    { "protection", 16, 1, 0, NULL },
+    { "bitrate", 12, 4, 0, NULL },
+    { "sampling_rate", 10, 2, 0, NULL },
+    { "padding", 9, 1, 0, NULL },
+    { "private", 8, 1, 1, NULL },
+    { "channel_mode", 6, 2, 1, channel_mode_name },
+    { "mode_extension", 4, 2, 1, NULL },
+    { "copyright", 3, 1, 1, NULL },
+    { "original", 2, 1, 1, NULL },
+    { "emphasis", 0, 2, 1, emphasis_name },
+};
 
-        sr = sampling_rate_table[header.version][header.sampling_frequency_index];//sampling rate
-        br = bitrate_table[header.version][header.layer][header.bitrate_index] * 1000;//bitrate
+//"field=value" into the mask of the field and the value in place
+static int
+mp3_rule_term(char *term, uint8_t write, uint32_t *mask, uint32_t *value)
+{
+    const mp3_header_field *field = NULL;
+    char *text = strchr(term, '=');
+    char *end;
+    unsigned long number;
+    size_t i;
 
-        frame_size = (MP3_BYTE_ATTR_PER_FRAME * br / sr) + header.padding_bit;
+    if(!text)
+        return -1;
+    *text++ = 0;
 
-        if(fseek(fp, frame_size - 4, SEEK_CUR))
-            return -1;
+    for(i = 0; i < sizeof(header_field_table) / sizeof(header_field_table[0]); i++) {
+        if(0 == strcmp(term, header_field_table[i].name))
+            field = &header_field_table[i];
+    }
+    if(!field)
+        return -1;
+    if(write && !field->writable) {
+        fprintf(stderr, "*error* : %s changes the frame layout, it can only be tested\n", field->name);
+        return -1;
     }
 
+    number = strtoul(text, &end, 0);
+    if(end == text || *end) {
+        number = 4;
+        for(i = 0; field->names && i < 4; i++) {
+            if(0 == strcmp(text, field->names[i]))
+                number = i;
+        }
+    }
+    if(number >= (1ul << field->width))
+        return -1;
 
+    *mask = ((1u << field->width) - 1) << field->shift;
+    *value = (uint32_t)number << field->shift;
     return 0;
 }
+
+//parse, compile and append a rule
 static int
-id3_skip_frame_v2(FILE *fp, uint32_t *frame)
+mp3_rule_add(mp3_rule_set *set, const char *text)
 {
-    uint8_t data[10];
-    uint32_t read_size;
-    uint32_t id3v2_length;
+    mp3_rule rule;
+    mp3_rule *last;
+    char buffer[256];
+    char *range;
+    char *condition;
+    char *end;
+    uint32_t mask;
+    uint32_t value;
+
+    if(set->count >= MP3_RULE_MAX || strlen(text) >= sizeof(buffer))
+        return -1;
+    strcpy(buffer, text);
 
-    uint32_t skip_first = 1;
+    memset(&rule, 0x00, sizeof(mp3_rule));
+    rule.last = UINT64_MAX;
 
-    if(fseek(fp, 0, SEEK_SET))
+    condition = strchr(buffer, '?');
+    if(condition) {
+        *condition++ = 0;
+        if(mp3_rule_term(condition, 0, &rule.if_mask, &rule.if_value))
+            return -1;
+    }
+
+    range = strchr(buffer, '@');
+    if(range) {
+        *range++ = 0;
+        rule.first = strtoull(range, &end, 10);
+        if(end == range)
+            return -1;
+        if(*end == '-') {
+            range = end + 1;
+            if(*range) {
+                rule.last = strtoull(range, &end, 10);
+                if(end == range)
+                    return -1;
+            }
+        }
+        else
+            rule.last = rule.first;
+        if(*end || rule.last < rule.first)
+            return -1;
+    }
+
+    if(mp3_rule_term(buffer, 1, &mask, &value))
         return -1;
+    rule.and_mask = ~mask;
+    rule.or_mask = value;
+
+    //mono and the other modes differ in side info length
+    if(mask & MP3_CHANNEL_MODE_MASK) {
+        if((value & MP3_CHANNEL_MODE_MASK) == MP3_CHANNEL_MODE_MONO ||
+            ((rule.if_mask & MP3_CHANNEL_MODE_MASK) == MP3_CHANNEL_MODE_MASK &&
+            (rule.if_value & MP3_CHANNEL_MODE_MASK) == MP3_CHANNEL_MODE_MONO)) {
+            fprintf(stderr, "*error* : channel_mode cannot change to or from mono, it changes the frame layout\n");
+            return -1;
+        }
+        rule.unless_mask = MP3_CHANNEL_MODE_MASK;
+        rule.unless_value = MP3_CHANNEL_MODE_MONO;
+    }
+
+    //same filters, and the condition reads no bit the rule before wrote
+    if(set->count) {
+        last = &set->rules[set->count - 1];
+        if(last->first == rule.first &&
+            last->last == rule.last &&
+            last->if_mask == rule.if_mask &&
+            last->if_value == rule.if_value &&
+            last->unless_mask == rule.unless_mask &&
+            last->unless_value == rule.unless_value &&
+            0 == (~last->and_mask & (rule.if_mask | rule.unless_mask))) {
+            last->or_mask = (last->or_mask & rule.and_mask) | rule.or_mask;
+            last->and_mask &= rule.and_mask;
+            return 0;
+        }
+    }
 
-    read_size = fread(data, 1, 10, fp);
-    if(read_size != 10)
+    set->rules[set->count++] = rule;
+    return 0;
+}
+
+//rewrite the 4 header bytes of the frame'th frame, 1 when they changed
+static int
+mp3_rule_rewrite(const mp3_rule_set *set, uint64_t frame, uint8_t *data)
+{
+    const mp3_rule *rule = set->rules;
+    const mp3_rule *end = set->rules + set->count;
+    uint32_t before;
+    uint32_t header;
+
+    before = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    header = before;
+    for(; rule < end; rule++) {
+        if(frame < rule->first || frame > rule->last ||
+            (header & rule->if_mask) != rule->if_value ||
+            (rule->unless_mask && (header & rule->unless_mask) == rule->unless_value))
+            continue;
+        header = (header & rule->and_mask) | rule->or_mask;
+    }
+    if(header == before)
+        return 0;
+
+    data[2] = (header >> 8) & 0xff;
+    data[3] = (header >> 0) & 0xff;
+    return 1;
+}
+
+//rewrite the header in head, the first length bytes of the frame'th
+//frame. A CRC that matched the old header is recomputed for the new
+//one, a CRC that did not stays as it was so the damage stays visible.
+//1 when head changed
+static int
+mp3_rule_rewrite_frame(mp3demuxer_context *ctx, uint64_t frame, uint8_t *head, size_t length)
+{
+    mp3_frame_header header;
+    size_t side_info;
+    uint16_t crc;
+    uint8_t valid = 0;
+
+    parse_mp3header(head, &header);
+    side_info = mp3_frame_crc_length(&header);
+    if(side_info && 6 + side_info <= length)
+        valid = (uint16_t)(head[4] << 8 | head[5]) == mp3_frame_crc(head, side_info);
+
+    if(!mp3_rule_rewrite(&ctx->rules, frame, head))
+        return 0;
+    if(!side_info || 6 + side_info > length)
+        return 1;//no CRC, or cut by the end of the file
+
+    if(!valid) {
+        ctx->crc_bad++;
+        return 1;
+    }
+
+    //a CRC over a different side info length would vouch for a broken
+    //frame; the rules never change it, and the CRC stays if one does
+    parse_mp3header(head, &header);
+    if(mp3_frame_crc_length(&header) != side_info) {
+        ctx->crc_bad++;
+        return 1;
+    }
+    crc = mp3_frame_crc(head, side_info);
+    head[4] = (crc >> 8) & 0xff;
+    head[5] = (crc >> 0) & 0xff;
+    ctx->crc_updated++;
+    return 1;
+}
+
+//header, CRC and side info of the frame at event, as much of them as
+//the frame and the input hold; returns the bytes copied
+static size_t
+mp3_frame_head(mp3_frame_iter *iter, const mp3_frame_event *event, uint8_t *head)
+{
+    size_t length = event->size < MP3_CRC_HEAD ? (size_t)event->size : MP3_CRC_HEAD;
+    const uint8_t *data;
+    size_t available;
+    size_t done = 0;
+
+    while(done < length) {
+        data = mp3_iter_data(iter, event->offset + done, &available);
+        if(!data)
+            break;
+        if(available > length - done)
+            available = length - done;
+        memcpy(head + done, data, available);
+        done += available;
+    }
+    return done;
+}
+
+static void
+mp3_crc_report(mp3demuxer_context *ctx, FILE *report)
+{
+    if(ctx->crc_updated || ctx->crc_bad)
+        fprintf(report, "CRC        : %zd recomputed   %zd bad left as is\n", ctx->crc_updated, ctx->crc_bad);//dump
+}
+
+#ifndef WIN32
+///////////////////////////////////////////////////////////////////
+// in-place patching
+//
+// Only the frame header bytes and, in protected frames, the CRC after
+// them change, so instead of copying the whole file the changed bytes
+// are collected first and written back with pwrite. Patches that sit close together
+// are merged into one read-modify-write of the window around them.
+// With --journal the original bytes are made durable in
+// "<file>.jsjournal" before the first write so that --rollback can
+// undo an interrupted run.
+
+static int
+mp3_patch_append(mp3_patch_list *list, uint64_t offset, uint8_t old_value, uint8_t new_value)
+{
+    mp3_patch *patch;
+
+    if(list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 4096;
+        patch = (mp3_patch *)realloc(list->patches, capacity * sizeof(mp3_patch));
+        if(!patch)
+            return -1;
+        list->patches = patch;
+        list->capacity = capacity;
+    }
+
+    patch = &list->patches[list->count++];
+    memset(patch, 0x00, sizeof(mp3_patch));
+    patch->offset = offset;
+    patch->old_value = old_value;
+    patch->new_value = new_value;
+
+    return 0;
+}
+
+static void
+mp3_patch_free(mp3_patch_list *list)
+{
+    free(list->patches);
+    memset(list, 0x00, sizeof(mp3_patch_list));
+}
+
+//patches must be sorted by offset
+static int
+mp3_patch_apply_range(int fd, const mp3_patch *patches, size_t count, uint8_t restore, mp3_counters *counters)
+{
+    uint8_t *window;
+    size_t i, j, k;
+    uint64_t begin;
+    uint64_t phase_begin;
+    size_t length;
+
+    window = (uint8_t *)malloc(MP3_PATCH_WINDOW);
+    if(!window)
+        return -1;
+
+    for(i = 0; i < count; i = j) {
+        begin = patches[i].offset;
+        for(j = i + 1; j < count; j++) {
+            if(patches[j].offset - patches[j - 1].offset > MP3_PATCH_GAP ||
+                patches[j].offset + 1 - begin > MP3_PATCH_WINDOW)
+                break;
+        }
+        length = (size_t)(patches[j - 1].offset + 1 - begin);
+
+        if(j - i == 1) {
+            window[0] = restore ? patches[i].old_value : patches[i].new_value;
+        }
+        else {
+            phase_begin = mp3_counters_begin(counters);
+            if(pread(fd, window, length, begin) != (ssize_t)length) {
+                free(window);
+                return -1;
+            }
+            if(counters) {
+                counters->read_calls++;
+                counters->bytes_read += length;
+                mp3_counters_end(counters, MP3_PHASE_READ, phase_begin);
+            }
+            for(k = i; k < j; k++)
+                window[patches[k].offset - begin] = restore ? patches[k].old_value : patches[k].new_value;
+        }
+
+        phase_begin = mp3_counters_begin(counters);
+        if(pwrite(fd, window, length, begin) != (ssize_t)length) {
+            free(window);
+            return -1;
+        }
+        if(counters) {
+            counters->write_calls++;
+            counters->bytes_written += length;
+            mp3_counters_end(counters, MP3_PHASE_WRITE, phase_begin);
+        }
+    }
+
+    free(window);
+    return 0;
+}
+
+typedef struct mp3_patch_worker_tag {
+    int fd;
+    const mp3_patch *patches;
+    size_t count;
+    uint8_t restore;
+    int result;
+    mp3_counters counters;
+    mp3_counters *total;// NULL when not counting
+} mp3_patch_worker;
+
+static void *
+mp3_patch_worker_main(void *arg)
+{
+    mp3_patch_worker *worker = (mp3_patch_worker *)arg;
+
+    worker->result = mp3_patch_apply_range(worker->fd, worker->patches, worker->count, worker->restore,
+                        worker->total ? &worker->counters : NULL);
+    return NULL;
+}
+
+//split by frame range, one contiguous slice per thread
+static int
+mp3_patch_apply(int fd, const mp3_patch_list *list, uint32_t threads, uint8_t restore, mp3_counters *counters)
+{
+    mp3_patch_worker workers[MP3_PATCH_MAX_THREADS];
+    pthread_t thread_ids[MP3_PATCH_MAX_THREADS];
+    size_t slice;
+    uint32_t started = 0;
+    uint32_t i;
+    int result = 0;
+
+    if(threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (list->count < MP3_PATCH_PARALLEL_THRESHOLD || cores < 1) ? 1 : (uint32_t)cores;
+    }
+    if(threads > MP3_PATCH_MAX_THREADS)
+        threads = MP3_PATCH_MAX_THREADS;
+    if(threads > list->count)
+        threads = list->count ? (uint32_t)list->count : 1;
+
+    if(threads == 1)
+        return mp3_patch_apply_range(fd, list->patches, list->count, restore, counters);
+
+    slice = (list->count + threads - 1) / threads;
+    for(i = 0; i < threads; i++) {
+        size_t first = slice * i;
+
+        if(first >= list->count)
+            break;
+
+        workers[i].fd = fd;
+        workers[i].patches = list->patches + first;
+        workers[i].count = (list->count - first < slice) ? list->count - first : slice;
+        workers[i].restore = restore;
+        workers[i].result = 0;
+        workers[i].total = counters;
+        memset(&workers[i].counters, 0x00, sizeof(mp3_counters));
+
+        if(pthread_create(&thread_ids[i], NULL, mp3_patch_worker_main, &workers[i])) {
+            workers[i].result = mp3_patch_apply_range(fd, workers[i].patches, workers[i].count, restore, counters);
+            if(workers[i].result)
+                result = -1;
+            continue;
+        }
+        started |= 1u << i;
+    }
+
+    for(i = 0; i < threads; i++) {
+        if(started & (1u << i)) {
+            pthread_join(thread_ids[i], NULL);
+            if(workers[i].result)
+                result = -1;
+            if(counters)
+                mp3_counters_add(counters, &workers[i].counters);
+        }
+    }
+
+    return result;
+}
+
+static char *
+mp3_journal_path(const char *filename)
+{
+    char *path = (char *)malloc(strlen(filename) + sizeof(MP3_JOURNAL_SUFFIX));
+
+    if(!path)
+        return NULL;
+    strcpy(path, filename);
+    strcat(path, MP3_JOURNAL_SUFFIX);
+    return path;
+}
+
+static int
+mp3_journal_write(const char *path, uint64_t file_size, const mp3_patch_list *list)
+{
+    mp3_journal_header journal_header;
+    FILE *fp;
+    size_t wrote_size;
+
+    memset(&journal_header, 0x00, sizeof(journal_header));
+    memcpy(journal_header.magic, MP3_JOURNAL_MAGIC, 8);
+    journal_header.file_size = file_size;
+    journal_header.count = list->count;
+
+    fp = fopen(path, "wb");
+    if(!fp)
         return -1;
-    
-    if(data[0] != 0x49 ||
-        data[1] != 0x44 ||
-        data[2] != 0x33)
+    wrote_size = fwrite(&journal_header, 1, sizeof(journal_header), fp);
+    if(wrote_size == sizeof(journal_header))
+        wrote_size = fwrite(list->patches, sizeof(mp3_patch), list->count, fp);
+    if(wrote_size != list->count ||
+        fflush(fp) ||
+        fsync(fileno(fp))) {
+        fclose(fp);
+        remove(path);
         return -1;
+    }
+    if(fclose(fp)) {
+        remove(path);
+        return -1;
+    }
 
-    id3v2_length = 0;
-    id3v2_length = ((data[6] & 0x7F) << 21) |
-                    ((data[7] & 0x7F) << 14) |
-                    ((data[8] & 0x7F) << 7) |
-                    ((data[9] & 0x7F) << 0);
+    return 0;
+}
 
-    if(fseek(fp, id3v2_length, SEEK_CUR))
+//0:rolled back 1:no journal -1:error
+static int
+mp3_journal_rollback(const char *filename)
+{
+    mp3_journal_header journal_header;
+    mp3_patch_list list;
+    struct stat st;
+    char *path;
+    FILE *fp;
+    size_t read_size;
+    int fd;
+    int result;
+
+    path = mp3_journal_path(filename);
+    if(!path)
+        return -1;
+
+    fp = fopen(path, "rb");
+    if(!fp) {
+        free(path);
+        return 1;
+    }
+
+    read_size = fread(&journal_header, 1, sizeof(journal_header), fp);
+    if(read_size != sizeof(journal_header) ||
+        0 != memcmp(journal_header.magic, MP3_JOURNAL_MAGIC, 8)) {
+        fclose(fp);
+        free(path);
+        return -1;
+    }
+
+    memset(&list, 0x00, sizeof(list));
+    if(journal_header.count) {
+        list.patches = (mp3_patch *)malloc(journal_header.count * sizeof(mp3_patch));
+        if(!list.patches) {
+            fclose(fp);
+            free(path);
+            return -1;
+        }
+        list.capacity = journal_header.count;
+        //a torn journal means patching never started; restore what is there
+        list.count = fread(list.patches, sizeof(mp3_patch), journal_header.count, fp);
+    }
+    fclose(fp);
+
+    fd = open(filename, O_RDWR);
+    if(fd < 0 ||
+        fstat(fd, &st) ||
+        (uint64_t)st.st_size != journal_header.file_size) {
+        if(fd >= 0)
+            close(fd);
+        mp3_patch_free(&list);
+        free(path);
+        return -1;
+    }
+
+    result = mp3_patch_apply(fd, &list, 0, 1, NULL);
+    if(0 == result)
+        result = fsync(fd) ? -1 : 0;
+    close(fd);
+    mp3_patch_free(&list);
+
+    if(0 == result)
+        remove(path);
+    free(path);
+
+    return result;
+}
+
+//collect the header bytes the rules change
+static int
+mp3_collect_rule_patches(mp3demuxer_context *ctx, int fd, uint64_t begin_pos, mp3_patch_list *list, uint64_t *file_size)
+{
+    mp3_source source;
+    mp3_frame_iter iter;
+    mp3_frame_event event;
+    uint64_t audio_begin;
+    uint64_t data_end;
+    uint64_t frame = 0;
+    uint8_t head[MP3_CRC_HEAD];
+    uint8_t value[MP3_CRC_HEAD];
+    size_t length;
+    size_t i;
+    int result;
+
+    memset(list, 0x00, sizeof(mp3_patch_list));
+
+    if(mp3_source_open_mmap(&source, fd))
         return -1;
+    if(source.size == 0)
+        return -1;
+    source.counters = ctx->counters;
+    *file_size = source.size;
+
+    if(mp3_source_audio_region(&source, &audio_begin, &data_end)) {
+        mp3_source_close(&source);
+        return -1;
+    }
+
+    mp3_iter_init(&iter, &source, begin_pos, data_end);
+    iter.strict = 1;
+
+    while (0 < (result = mp3_iter_next(&iter, &event))) {
+
+        length = mp3_frame_head(&iter, &event, head);
+        if(length < 4) {
+            result = -1;
+            break;
+        }
+
+        //data manipuration //******
+        memcpy(value, head, length);
+        if(!mp3_rule_rewrite_frame(ctx, frame++, value, length))
+            continue;
+        for(i = 0; i < length; i++) {
+            if(value[i] != head[i] &&
+                mp3_patch_append(list, event.offset + i, head[i], value[i]))
+                result = -1;
+        }
+        if(result < 0)
+            break;
+        list->frames++;
+    }
+    mp3_source_close(&source);
+
+    if(result)
+        mp3_patch_free(list);
 
+    return result;
+}
+
+static int
+id3_force_js_inplace_v1(mp3demuxer_context *ctx, int fd)
+{
+    return id3_force_js_inplace_internal(ctx, fd, 0);
+}
+
+static int
+id3_force_js_inplace_internal(mp3demuxer_context *ctx, int fd, uint64_t begin_pos)
+{
+    mp3_patch_list list;
+    uint64_t file_size;
+    char *journal_path = NULL;
     int result;
-    result = id3_skip_frame_v1_internal(fp, ftell(fp), &skip_first);
-    if(0 != result)//skip first frame
+
+    result = mp3_collect_rule_patches(ctx, fd, begin_pos, &list, &file_size);
+    if(result)
         return result;
-    if(1 != skip_first)
-        return -2;
 
-    return id3_skip_frame_v1_internal(fp, ftell(fp), frame);
+    if(list.count == 0) {
+        mp3_patch_free(&list);
+        return 0;
+    }
+
+    if(ctx->journal) {
+        journal_path = mp3_journal_path(ctx->src_filename);
+        if(!journal_path ||
+            mp3_journal_write(journal_path, file_size, &list)) {
+            free(journal_path);
+            mp3_patch_free(&list);
+            return -1;
+        }
+    }
+
+    result = mp3_patch_apply(fd, &list, ctx->threads, 0, ctx->counters);
+    if(0 == result && journal_path)
+        result = fsync(fd) ? -1 : 0;
+
+    if(0 == result && journal_path)
+        remove(journal_path);//keep it on failure for --rollback
+
+    printf("Patched    : %zd frames\n", list.frames);//dump
+
+    free(journal_path);
+    mp3_patch_free(&list);
+    return result;
 }
 
-////////////////////////////////////////////////
+static int
+id3_force_js_inplace_v2(mp3demuxer_context *ctx, int fd)
+{
+    mp3_source source;
+    uint64_t begin_pos;
+    int result;
+
+    if(mp3_source_open_fd(&source, fd))
+        return -1;
+    source.counters = ctx->counters;
+    result = mp3_id3v2_end(&source, &begin_pos);
+    if(result)
+        return result;
 
+    return id3_force_js_inplace_internal(ctx, fd, begin_pos);
+}
 
-static char* version_string[] =
+///////////////////////////////////////////////////////////////////
+// zero-copy output
+//
+// The output is an exact copy of the input except for the patched
+// header bytes, so the whole file (ID3v2 prefix, frames and ID3v1
+// trailer alike) is handed to the kernel first: a reflink clone where
+// the filesystem shares extents, copy_file_range otherwise, then
+// sendfile in large chunks, then plain read/write as the last resort.
+// Only the changed header bytes are written from user space afterwards.
+
+static const char* copy_engine_string[] =
 {
-    "LSF extention",
-    "HSF"
+    "read/write",
+    "sendfile",
+    "copy_file_range",
+    "reflink",
 };
 
-static char* layer_string[] =
+//the kernel side engines count as writes only
+static int
+mp3_copy_file_rw(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t size, mp3_counters *counters)
 {
-    "Reserved",
-    "Layer3",
-    "Layer2",
-    "Layer1",
-};
+    uint8_t *buffer;
+    ssize_t read_size;
+    ssize_t wrote_size;
 
+    buffer = (uint8_t *)malloc(MP3_COPY_CHUNK);
+    if(!buffer)
+        return -1;
 
-static char* protection_bit_string[] =
-{
-    "CRC",
-    "NON",
-};
+    while(size > 0) {
+        read_size = pread(src_fd, buffer, size < MP3_COPY_CHUNK ? (size_t)size : MP3_COPY_CHUNK, src_offset);
+        if(read_size <= 0) {
+            free(buffer);
+            return -1;
+        }
+        wrote_size = pwrite(dst_fd, buffer, read_size, dst_offset);
+        if(wrote_size != read_size) {
+            free(buffer);
+            return -1;
+        }
+        if(counters) {
+            counters->read_calls++;
+            counters->bytes_read += read_size;
+            counters->write_calls++;
+            counters->bytes_written += wrote_size;
+        }
+        src_offset += read_size;
+        dst_offset += read_size;
+        size -= read_size;
+    }
 
-static char* padding_bit_string[] =
+    free(buffer);
+    return 0;
+}
+
+//returns the engine that did the copy, -1:error
+static int
+mp3_copy_file(int src_fd, int dst_fd, uint64_t size, mp3_counters *counters)
 {
-    "0",
-    "1"
-};
+#ifdef __linux__
+    uint64_t copied = 0;
+    ssize_t result;
+
+    //a refused clone is not a write
+    if(0 == ioctl(dst_fd, FICLONE, src_fd)) {
+        if(counters) {
+            counters->write_calls++;
+            counters->bytes_written += size;
+        }
+        return MP3_COPY_REFLINK;
+    }
+
+    while(copied < size) {
+        result = copy_file_range(src_fd, NULL, dst_fd, NULL, size - copied, 0);
+        if(counters)
+            counters->write_calls++;
+        if(result <= 0)
+            break;
+        copied += result;
+        if(counters)
+            counters->bytes_written += result;
+    }
+    if(copied == size)
+        return MP3_COPY_FILE_RANGE;
+
+    //cross-filesystem or unsupported: continue with sendfile
+    if(lseek(dst_fd, copied, SEEK_SET) < 0)
+        return -1;
+    while(copied < size) {
+        off_t offset = copied;
+        size_t chunk = size - copied < MP3_SENDFILE_CHUNK ? (size_t)(size - copied) : MP3_SENDFILE_CHUNK;
+
+        result = sendfile(dst_fd, src_fd, &offset, chunk);
+        if(counters)
+            counters->write_calls++;
+        if(result <= 0)
+            break;
+        copied += result;
+        if(counters)
+            counters->bytes_written += result;
+    }
+    if(copied == size)
+        return MP3_COPY_SENDFILE;
+
+    if(mp3_copy_file_rw(src_fd, copied, dst_fd, copied, size - copied, counters))
+        return -1;
+    return copied ? MP3_COPY_SENDFILE : MP3_COPY_READ_WRITE;
+#else
+    if(mp3_copy_file_rw(src_fd, 0, dst_fd, 0, size, counters))
+        return -1;
+    return MP3_COPY_READ_WRITE;
+#endif
+}
 
-static char* channel_string[] =
+static int
+id3_force_js_zerocopy_v1(mp3demuxer_context *ctx, int src_fd, int dst_fd)
 {
-    "stereo",
-    "joint stereo",
-    "dual channel",
-    "single channel",
-};
+    return id3_force_js_zerocopy_internal(ctx, src_fd, dst_fd, 0);
+}
 
-static char* mode_extention_string[] =
+static int
+id3_force_js_zerocopy_internal(mp3demuxer_context *ctx, int src_fd, int dst_fd, uint64_t begin_pos)
 {
-    "subband 4+",
-    "subband 8+",
-    "subband 12+",
-    "subband 16+",
-};
+    mp3_patch_list list;
+    uint64_t file_size;
+    uint64_t phase_begin;
+    int engine;
+    int result;
+
+    result = mp3_collect_rule_patches(ctx, src_fd, begin_pos, &list, &file_size);
+    if(result)
+        return result;
 
-static char* copyringht_string[] =
+    phase_begin = mp3_counters_begin(ctx->counters);
+    engine = mp3_copy_file(src_fd, dst_fd, file_size, ctx->counters);
+    mp3_counters_end(ctx->counters, MP3_PHASE_WRITE, phase_begin);
+    if(engine < 0) {
+        mp3_patch_free(&list);
+        return -1;
+    }
+
+    result = mp3_patch_apply(dst_fd, &list, ctx->threads, 0, ctx->counters);
+
+    printf("Copied     : %s\n", copy_engine_string[engine]);//dump
+    printf("Patched    : %zd frames\n", list.frames);//dump
+
+    mp3_patch_free(&list);
+    return result;
+}
+
+static int
+id3_force_js_zerocopy_v2(mp3demuxer_context *ctx, int src_fd, int dst_fd)
 {
-    "copyright disabled",
-    "copyright enabled",
-};
+    mp3_source source;
+    uint64_t begin_pos;
+    int result;
 
-static char* original_string[] =
+    if(mp3_source_open_fd(&source, src_fd))
+        return -1;
+    source.counters = ctx->counters;
+    result = mp3_id3v2_end(&source, &begin_pos);
+    if(result)
+        return result;
+
+    return id3_force_js_zerocopy_internal(ctx, src_fd, dst_fd, begin_pos);
+}
+
+///////////////////////////////////////////////////////////////////
+// pipelined output
+//
+// A reader thread fills large aligned buffers in file order, the
+// calling thread walks the frame headers through them and patches the
+// header bytes and the CRC, and a writer thread flushes them to the
+// same offsets in the output. MP3_PIPE_BUFFERS buffers circle through
+// three single producer, single consumer rings, so each stage waits
+// only when the stage before it falls behind and the disk is kept busy
+// while headers are patched. With --direct both files bypass the page
+// cache where the filesystem supports O_DIRECT.
+
+static void
+mp3_pipe_push(mp3_pipe_ring *ring, mp3_pipe_buffer *buffer)
 {
-    "copied",
-    "original",
-};
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
 
-static char* enphasisl_string[] =
+    //a ring holds every buffer at most, it is never full
+    ring->slots[tail & (MP3_PIPE_BUFFERS - 1)] = buffer;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static mp3_pipe_buffer *
+mp3_pipe_pop(mp3_pipe_ring *ring)
 {
-    "NON",
-    "50/15 us",
-    "Reserved",
-    "CCITT J.17",
-};
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    mp3_pipe_buffer *buffer;
+    uint32_t spin = 0;
+    struct timespec pause = { 0, 50 * 1000 };
+
+    while(head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        //a buffer takes milliseconds of disk time, sleeping costs no throughput
+        if(spin++ < MP3_PIPE_SPIN)
+            sched_yield();
+        else
+            nanosleep(&pause, NULL);
+    }
+    buffer = ring->slots[head & (MP3_PIPE_BUFFERS - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return buffer;
+}
 
 static void
-dump_mp3header(uint32_t frame_num, mp3_frame_header *header) {
-
-    if(!header)
-        return;
-    
-    uint32_t sr = sampling_rate_table[header->version][header->sampling_frequency_index];//sampling rate
-    uint32_t br = bitrate_table[header->version][header->layer][header->bitrate_index] * 1000;//bitrate
-
-    uint32_t frame_size = (MP3_BYTE_ATTR_PER_FRAME * br / sr) + header->padding_bit;
-    
-    //dump
-    printf(
-        "------------------------------------------------------------------------------\n"
-        "Frame : %08d   frame size : %d   version : %s   layer : %s\n"
-        "sampling rate  : %d   bit rate : %d   channel : %s\n"
-        "protection bit : %s   padding bit : %s   private bit : %d\n"
-        "extention mode : %s   copyright : %s   original : %s   enphasis : %s\n"
-        "------------------------------------------------------------------------------\n"
-        ,
-        frame_num, frame_size,
-        version_string[header->version & 0x01],
-        layer_string[header->layer],
-
-        sr, br, channel_string[header->channel_mode],
-
-        protection_bit_string[header->protection_bit],
-        padding_bit_string[header->padding_bit],
-        header->private_bit,
-        
-        mode_extention_string[header->mode_extension],
-        copyringht_string[header->copyright],
-        original_string[header->original],
-        enphasisl_string[header->emphasis]);
-        
-        
-        
+mp3_pipe_fail(mp3_pipeline *pipeline, int result)
+{
+    int expected = 0;
+
+    __atomic_compare_exchange_n(&pipeline->result, &expected, result, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&pipeline->abort, 1, __ATOMIC_RELEASE);
 }
 
+//length bytes at offset, short only at the end of the file
+static int
+mp3_pipe_read(mp3_pipeline *pipeline, mp3_pipe_buffer *buffer, uint64_t offset)
+{
+    size_t want = pipeline->file_size - offset < MP3_PIPE_BUFFER ? (size_t)(pipeline->file_size - offset) : MP3_PIPE_BUFFER;
+    size_t request = want;
+    size_t done = 0;
+    ssize_t result;
+
+    //O_DIRECT transfers whole blocks, the file end included
+    if(pipeline->direct)
+        request = (want + MP3_PIPE_ALIGN - 1) & ~(size_t)(MP3_PIPE_ALIGN - 1);
+
+    while(done < want) {
+        result = pread(pipeline->src_fd, buffer->data + done, request - done, offset + done);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            return -1;
+        done += result;
+        pipeline->reader_counters.read_calls++;
+        pipeline->reader_counters.bytes_read += result;
+    }
+    buffer->offset = offset;
+    buffer->length = want;
+    return 0;
+}
+
+static void *
+mp3_pipe_reader_main(void *arg)
+{
+    mp3_pipeline *pipeline = (mp3_pipeline *)arg;
+    mp3_pipe_buffer *buffer;
+    uint64_t offset = 0;
+    uint64_t begin;
+
+    while(1) {
+        buffer = mp3_pipe_pop(&pipeline->free_ring);
+        if(offset >= pipeline->file_size ||
+            __atomic_load_n(&pipeline->abort, __ATOMIC_ACQUIRE)) {
+            buffer->status = MP3_PIPE_END;
+            buffer->length = 0;
+            mp3_pipe_push(&pipeline->read_ring, buffer);
+            break;
+        }
+
+        begin = mp3_counters_begin(pipeline->counters);
+        if(mp3_pipe_read(pipeline, buffer, offset)) {
+            mp3_pipe_fail(pipeline, -1);
+            buffer->status = MP3_PIPE_END;
+            buffer->length = 0;
+            mp3_pipe_push(&pipeline->read_ring, buffer);
+            break;
+        }
+        mp3_counters_end(pipeline->counters ? &pipeline->reader_counters : NULL, MP3_PHASE_READ, begin);
+
+        buffer->status = MP3_PIPE_DATA;
+        offset += buffer->length;
+        mp3_pipe_push(&pipeline->read_ring, buffer);
+    }
+    return NULL;
+}
 
-///////////////////////////////////////////////////////////////////
 static int
-id3_force_js_v1(FILE *src_fp, FILE *dst_fp)
+mp3_pipe_write(mp3_pipeline *pipeline, mp3_pipe_buffer *buffer)
 {
-    return id3_force_js_v1_internal(src_fp, dst_fp, 0);
+    size_t request = buffer->length;
+    size_t done = 0;
+    ssize_t result;
+
+    //whole blocks again, the output is cut back to the file size at the end
+    if(pipeline->direct && (request & (MP3_PIPE_ALIGN - 1))) {
+        request = (request + MP3_PIPE_ALIGN - 1) & ~(size_t)(MP3_PIPE_ALIGN - 1);
+        memset(buffer->data + buffer->length, 0x00, request - buffer->length);
+    }
+
+    while(done < request) {
+        result = pwrite(pipeline->dst_fd, buffer->data + done, request - done, buffer->offset + done);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            return -1;
+        done += result;
+        pipeline->writer_counters.write_calls++;
+        pipeline->writer_counters.bytes_written += result;
+    }
+    return 0;
 }
-//[t[̏Ȃ
+
+static void *
+mp3_pipe_writer_main(void *arg)
+{
+    mp3_pipeline *pipeline = (mp3_pipeline *)arg;
+    mp3_pipe_buffer *buffer;
+    uint64_t begin;
+
+    while(1) {
+        buffer = mp3_pipe_pop(&pipeline->patch_ring);
+        if(buffer->status == MP3_PIPE_END)
+            break;
+
+        //after an error buffers still go round until the end
+        if(!__atomic_load_n(&pipeline->abort, __ATOMIC_ACQUIRE)) {
+            begin = mp3_counters_begin(pipeline->counters);
+            if(mp3_pipe_write(pipeline, buffer))
+                mp3_pipe_fail(pipeline, -1);
+            mp3_counters_end(pipeline->counters ? &pipeline->writer_counters : NULL, MP3_PHASE_WRITE, begin);
+        }
+        mp3_pipe_push(&pipeline->free_ring, buffer);
+    }
+    return NULL;
+}
+
+//the byte at offset in the held back buffer or the current one
+static uint8_t *
+mp3_pipe_byte(mp3_pipe_buffer *previous, mp3_pipe_buffer *current, uint64_t offset)
+{
+    if(offset >= current->offset)
+        return current->data + (offset - current->offset);
+    return previous->data + (offset - previous->offset);
+}
+
+//walk the headers in [begin_pos, data_end) as the strict iterator does;
+//a buffer is held back until no header still reaches into it
 static int
-id3_force_js_v1_internal(FILE *src_fp, FILE *dst_fp, uint32_t begin_pos)
+mp3_pipe_patch(mp3_pipeline *pipeline, uint64_t begin_pos, uint64_t data_end, size_t *patched, uint64_t *frames)
 {
+    mp3_pipe_buffer *previous = NULL;
+    mp3_pipe_buffer *current;
     mp3_frame_header header;
+    uint64_t next = begin_pos;
+    uint64_t current_end;
+    size_t frame_size;
+    size_t length;
     uint8_t data[4];
-    size_t read_size;
-    size_t wrote_size;
-    size_t frame_count = 0;
+    uint8_t head[MP3_CRC_HEAD];
+    int result = 0;
+    size_t i;
+
+    while(1) {
+        current = mp3_pipe_pop(&pipeline->read_ring);
+        if(current->status == MP3_PIPE_END)
+            break;
+        current_end = current->offset + current->length;
+
+        while(0 == result && next < data_end && next + 4 <= current_end) {
+            for(i = 0; i < 4; i++)
+                data[i] = *mp3_pipe_byte(previous, current, next + i);
+            if(!mp3_header_valid(data, &header, &frame_size)) {
+                result = -2;//error
+                break;
+            }
+
+            //CRC and side info may sit in the next buffer
+            length = frame_size < MP3_CRC_HEAD ? frame_size : MP3_CRC_HEAD;
+            if(length > pipeline->file_size - next)
+                length = (size_t)(pipeline->file_size - next);
+            if(next + length > current_end)
+                break;
+            for(i = 0; i < length; i++)
+                head[i] = *mp3_pipe_byte(previous, current, next + i);
+
+            //data manipuration //******
+            if(mp3_rule_rewrite_frame(pipeline->ctx, *frames, head, length)) {
+                for(i = 0; i < length; i++)
+                    *mp3_pipe_byte(previous, current, next + i) = head[i];
+                (*patched)++;
+            }
+            (*frames)++;
+            next += frame_size;
+        }
+        if(result)
+            mp3_pipe_fail(pipeline, result);
 
-    size_t frame_size = 0;
-    size_t data_end;
+        if(previous)
+            mp3_pipe_push(&pipeline->patch_ring, previous);
+        previous = current;
+    }
 
-    uint32_t sr, br;
+    //a header cut by the end of the file
+    if(0 == result && next < data_end && next + 4 > pipeline->file_size) {
+        result = -1;
+        mp3_pipe_fail(pipeline, result);
+    }
 
-    uint8_t tag_exist = 0;
+    if(previous)
+        mp3_pipe_push(&pipeline->patch_ring, previous);
+    mp3_pipe_push(&pipeline->patch_ring, current);
+    return result;
+}
 
-    uint8_t translate_buffer[5 * 1024];
-    uint8_t transrate_tail_buffer[128];
+#ifdef O_DIRECT
+static int
+mp3_pipe_direct(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
 
-    if(fseek(src_fp, 0, SEEK_END))//end
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
         return -1;
+    return 0;
+}
 
-    data_end = ftell(src_fp);
+static void
+mp3_pipe_buffered(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
 
-    //TAG
-    if(data_end > 128) {
-        fseek(src_fp, -128, SEEK_END);
-        fread(transrate_tail_buffer, 1, 128, src_fp);
-        if(0 == memcmp(transrate_tail_buffer, "TAG", 3))
-            tag_exist = 1;
-    }
-    if(tag_exist)
-        data_end -= 128;
+    if(flags >= 0)
+        fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+}
+#endif
 
-    // HEADER
-    //if(fseek(fp, begin_pos, SEEK_SET))//start
-    //    return -1;
-    if(fseek(src_fp, 0, SEEK_SET))//seek
-        return -1;
-    read_size = fread(translate_buffer, 1, begin_pos, src_fp);//read
-    if(read_size != begin_pos)
+static int
+id3_force_js_pipeline_v1(mp3demuxer_context *ctx, int src_fd, int dst_fd)
+{
+    return id3_force_js_pipeline_internal(ctx, src_fd, dst_fd, 0);
+}
+
+static int
+id3_force_js_pipeline_internal(mp3demuxer_context *ctx, int src_fd, int dst_fd, uint64_t begin_pos)
+{
+    mp3_pipeline *pipeline;
+    mp3_source source;
+    uint64_t audio_begin;
+    uint64_t data_end;
+    pthread_t reader;
+    pthread_t writer;
+    size_t patched = 0;
+    uint64_t frames = 0;
+    int result = 0;
+    uint32_t i;
+
+    if(mp3_source_open_fd(&source, src_fd))
         return -1;
-    wrote_size = fwrite(translate_buffer, 1, read_size, dst_fp);//write
-    if(wrote_size != read_size)
+    source.counters = ctx->counters;
+    if(mp3_source_audio_region(&source, &audio_begin, &data_end))
         return -1;
 
-    while (1) {
+    pipeline = (mp3_pipeline *)calloc(1, sizeof(mp3_pipeline));
+    if(!pipeline)
+        return -1;
+    pipeline->src_fd = src_fd;
+    pipeline->dst_fd = dst_fd;
+    pipeline->file_size = source.size;
+    pipeline->ctx = ctx;
+    pipeline->counters = ctx->counters;
+    mp3_counters_init(&pipeline->reader_counters);
+    mp3_counters_init(&pipeline->writer_counters);
+
+    for(i = 0; i < MP3_PIPE_BUFFERS; i++) {
+        if(posix_memalign((void **)&pipeline->buffers[i].data, MP3_PIPE_ALIGN, MP3_PIPE_BUFFER)) {
+            pipeline->buffers[i].data = NULL;
+            result = -1;
+            break;
+        }
+        mp3_pipe_push(&pipeline->free_ring, &pipeline->buffers[i]);
+    }
 
-        if(data_end <= ftell(src_fp))
-            break;//end
-    
-        read_size = fread(data, 1, 4, src_fp);
+    if(0 == result && ctx->direct) {
+#ifdef O_DIRECT
+        if(0 == mp3_pipe_direct(src_fd) && 0 == mp3_pipe_direct(dst_fd))
+            pipeline->direct = 1;
+        else {
+            mp3_pipe_buffered(src_fd);
+            fprintf(stderr, "*warning* : direct I/O is not supported here, using the page cache\n");
+        }
+#else
+        fprintf(stderr, "*warning* : direct I/O is not supported on this platform, using the page cache\n");
+#endif
+    }
 
-        if(read_size < 4) {
-            return -1;//error
+    if(0 == result) {
+        if(pthread_create(&writer, NULL, mp3_pipe_writer_main, pipeline))
+            result = -1;
+        else if(pthread_create(&reader, NULL, mp3_pipe_reader_main, pipeline)) {
+            //nothing was read, the end alone stops the writer
+            mp3_pipe_buffer *buffer = mp3_pipe_pop(&pipeline->free_ring);
+
+            buffer->status = MP3_PIPE_END;
+            mp3_pipe_push(&pipeline->patch_ring, buffer);
+            pthread_join(writer, NULL);
+            result = -1;
+        }
+        else {
+            mp3_pipe_patch(pipeline, begin_pos, data_end, &patched, &frames);
+            pthread_join(reader, NULL);
+            pthread_join(writer, NULL);
+            result = pipeline->result;
+
+            if(ctx->counters) {
+                ctx->counters->frames += frames;
+                mp3_counters_add(ctx->counters, &pipeline->reader_counters);
+                mp3_counters_add(ctx->counters, &pipeline->writer_counters);
+            }
         }
+    }
+
+#ifdef O_DIRECT
+    if(pipeline->direct) {
+        mp3_pipe_buffered(src_fd);
+        mp3_pipe_buffered(dst_fd);
+        if(0 == result && ftruncate(dst_fd, pipeline->file_size))
+            result = -1;
+    }
+#endif
 
+    if(0 == result) {
+        printf("Pipelined  : %u x %uKB buffers%s\n", MP3_PIPE_BUFFERS, MP3_PIPE_BUFFER / 1024,
+            pipeline->direct ? ", direct I/O" : "");//dump
+        printf("Patched    : %zd frames\n", patched);//dump
+    }
 
-#if 1
-        if(data[0] != 0xff ||
-            data[1] & 0xe0 != 0xe0)
-                return -2;//error
+    for(i = 0; i < MP3_PIPE_BUFFERS; i++)
+        free(pipeline->buffers[i].data);
+    free(pipeline);
+    return result;
+}
 
-#else
-        if(data[0] != 0xff ||
-            data[1] & 0xe0 != 0xe0) {
+static int
+id3_force_js_pipeline_v2(mp3demuxer_context *ctx, int src_fd, int dst_fd)
+{
+    mp3_source source;
+    uint64_t begin_pos;
+    int result;
 
-                while(true) {
-                    read_size = fread(data, 1, 4, fp);
+    if(mp3_source_open_fd(&source, src_fd))
+        return -1;
+    source.counters = ctx->counters;
+    result = mp3_id3v2_end(&source, &begin_pos);
+    if(result)
+        return result;
 
-                    if(read_size < 4) {
-                        return RME_IO_ERROR;//error
-                    }
+    return id3_force_js_pipeline_internal(ctx, src_fd, dst_fd, begin_pos);
+}
 
-                    if(data[0] == 0xff &&
-                        data[1] == 0xff &&
-                        data[2] == 0xff &&
-                        data[3] == 0xff)
-                        break;
-                }
-                continue;
+///////////////////////////////////////////////////////////////////
+// cut
+//
+// --cut and --cut-time copy a range of frames into a new file without
+// decoding them. Three byte ranges go to the kernel through
+// copy_file_range: the ID3v2 tag, the frames from the first one the
+// range needs to the end of the last one, and the ID3v1/APE trailer.
+// A Layer III frame starts its main data main_data_begin bytes back,
+// in the bit reservoir of the frames before it. Those frames are
+// copied in front of the range, and the decoder mutes them because
+// their own reservoir is gone. With --reservoir=drop the cut starts
+// at the first frame of the range, and that frame decodes as silence.
+
+//1 when dst_filename exists and is src_filename under another name,
+//an output opened with O_TRUNC would then empty the input
+static int
+mp3_same_file(const char *src_filename, const char *dst_filename)
+{
+    struct stat src_st;
+    struct stat dst_st;
+
+    if(stat(src_filename, &src_st) || stat(dst_filename, &dst_st))
+        return 0;
+    return src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino;
+}
+
+#define MP3_CUT_HISTORY 64// frames kept for the reservoir walk, more than 511 bytes span
+
+typedef struct mp3_cut_frame_tag {
+    uint64_t offset;
+    uint32_t main_data;// main data bytes stored in the frame
+} mp3_cut_frame;
+
+//length bytes from src_offset to dst_offset, returns the engine, -1:error
+static int
+mp3_copy_file_range(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t length, mp3_counters *counters)
+{
+#ifdef __linux__
+    loff_t in = src_offset;
+    loff_t out = dst_offset;
+    uint64_t copied = 0;
+    ssize_t result;
+    struct stat st;
+    struct file_clone_range clone;
+
+    //block aligned ranges can share extents
+    if(length > 0 && 0 == fstat(dst_fd, &st) && st.st_blksize > 0 &&
+        src_offset % st.st_blksize == 0 && dst_offset % st.st_blksize == 0 && length % st.st_blksize == 0) {
+        clone.src_fd = src_fd;
+        clone.src_offset = src_offset;
+        clone.src_length = length;
+        clone.dest_offset = dst_offset;
+        //a refused clone is not a write
+        if(0 == ioctl(dst_fd, FICLONERANGE, &clone)) {
+            if(counters) {
+                counters->write_calls++;
+                counters->bytes_written += length;
+            }
+            return MP3_COPY_REFLINK;
         }
+    }
+
+    while(copied < length) {
+        result = copy_file_range(src_fd, &in, dst_fd, &out, length - copied, 0);
+        if(counters)
+            counters->write_calls++;
+        if(result <= 0)
+            break;
+        copied += result;
+        if(counters)
+            counters->bytes_written += result;
+    }
+    if(copied == length)
+        return MP3_COPY_FILE_RANGE;
+
+    //cross-filesystem or unsupported
+    if(mp3_copy_file_rw(src_fd, src_offset + copied, dst_fd, dst_offset + copied, length - copied, counters))
+        return -1;
+    return copied ? MP3_COPY_FILE_RANGE : MP3_COPY_READ_WRITE;
+#else
+    if(mp3_copy_file_rw(src_fd, src_offset, dst_fd, dst_offset, length, counters))
+        return -1;
+    return MP3_COPY_READ_WRITE;
 #endif
+}
 
-        header.version = (data[1] & 0x18) >> 3;
-        header.layer = (data[1] & 0x06) >> 1;
-        header.protection_bit = (data[1] & 0x01);
-        header.bitrate_index = (data[2] & 0xF0) >> 4;
-        header.sampling_frequency_index = (data[2] & 0x06) >> 2;
-        header.padding_bit = (data[2] & 0x02) >> 1;
-        header.private_bit = (data[2] & 0x01);
-        header.channel_mode = (data[3] & 0xc0) >> 6;
-        header.mode_extension = (data[3] & 0x30) >> 4;
-        header.copyright = (data[3] & 0x08) >> 3;
-        header.original = (data[3] & 0x04) >> 2;
-        header.emphasis = (data[3] & 0x03);
+static int
+mp3_cut(mp3demuxer_context *ctx, int src_fd, int dst_fd)
+{
+    mp3_source source;
+    mp3_frame_iter iter;
+    mp3_frame_event event;
+    mp3_cut_frame history[MP3_CUT_HISTORY];
+    mp3_cut_frame *entry;
+    uint32_t history_count = 0;// frames since the start or the last junk
+    uint64_t audio_begin;
+    uint64_t data_end;
+    uint64_t frame_num = 0;
+    uint64_t first = ctx->cut_first;
+    uint64_t last = ctx->cut_last;
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    uint64_t last_found = 0;
+    uint8_t found = 0;
+    uint32_t reservoir = 0;// frames copied for the range's reservoir
+    uint32_t missing = 0;// reservoir bytes the output lacks
+    uint32_t main_data_begin = 0;
+    uint32_t sum;
+    uint8_t head[MP3_CRC_HEAD];
+    size_t length;
+    size_t header_length;
+    size_t side_info;
+    uint64_t phase_begin;
+    int engine;
+    int result;
 
-        //dump_mp3header(frame_count, &header);//dump
+    if(mp3_source_open_mmap(&source, src_fd))
+        return -1;
+    source.counters = ctx->counters;
+    if(mp3_source_audio_region(&source, &audio_begin, &data_end)) {
+        mp3_source_close(&source);
+        return -1;
+    }
 
-        frame_count++;
+    mp3_iter_init(&iter, &source, audio_begin, data_end);
 
-        sr = sampling_rate_table[header.version][header.sampling_frequency_index];//sampling rate
-        br = bitrate_table[header.version][header.layer][header.bitrate_index] * 1000;//bitrate
+    while(0 < (result = mp3_iter_next(&iter, &event))) {
+        if(event.type == MP3_EVENT_JUNK) {
+            history_count = 0;//the reservoir does not reach over junk
+            continue;
+        }
 
-        frame_size = (MP3_BYTE_ATTR_PER_FRAME * br / sr) + header.padding_bit;
+        if(frame_num == 0 && ctx->cut == MP3_CUT_TIME) {
+            double rate = (double)sampling_rate_table[event.header.version][event.header.sampling_frequency_index] /
+                            mp3_samples_per_frame(&event.header);//frames per second
 
-        //data manipuration //******
-        data[3] &= 0x3F;
-        data[3] |= 0x40;
+            first = (uint64_t)(ctx->cut_start * rate);
+            last = ctx->cut_end < 0.0 ? UINT64_MAX : (uint64_t)ceil(ctx->cut_end * rate) - 1;
+        }
 
-        //if(fseek(fp, frame_size - 4, SEEK_CUR))
-        //    return -1;
-        read_size = fread(translate_buffer, 1, frame_size - 4, src_fp);//read
-        if(read_size != frame_size - 4)
-            return -1;
-        wrote_size = fwrite(data, 1, 4, dst_fp);//write
-        if(wrote_size != 4)
-            return -1;
-        wrote_size = fwrite(translate_buffer, 1, read_size, dst_fp);//write
-        if(wrote_size != read_size)
-            return -1;
+        length = mp3_frame_head(&iter, &event, head);
+        header_length = event.header.protection_bit ? 4 : 6;
+        side_info = mp3_side_info_length(&event.header);
+
+        if(frame_num == first) {
+            found = 1;
+            begin = event.offset;
+            if(side_info && length >= header_length + 2)
+                main_data_begin = mp3_main_data_begin(&event.header, head + header_length);
+
+            //back through the frames holding the reservoir
+            for(sum = 0; !ctx->cut_drop && sum < main_data_begin && reservoir < history_count; ) {
+                reservoir++;
+                entry = &history[(frame_num - reservoir) % MP3_CUT_HISTORY];
+                sum += entry->main_data;
+                begin = entry->offset;
+            }
+            missing = ctx->cut_drop ? main_data_begin : (sum < main_data_begin ? main_data_begin - sum : 0);
+        }
+        if(found) {
+            end = event.offset + event.size;
+            last_found = frame_num;
+        }
+        if(frame_num == last)
+            break;
+
+        entry = &history[frame_num % MP3_CUT_HISTORY];
+        entry->offset = event.offset;
+        entry->main_data = event.size > header_length + side_info ? (uint32_t)(event.size - header_length - side_info) : 0;
+        if(side_info == 0)
+            entry->main_data = 0;//no reservoir in Layer I/II
+        if(history_count < MP3_CUT_HISTORY)
+            history_count++;
+        frame_num++;
     }
-
-    //write mp3tag
-    wrote_size = fwrite(transrate_tail_buffer, 1, 128, dst_fp);//write
-    if(wrote_size != 128)
+    if(result < 0) {
+        mp3_source_close(&source);
+        return result;
+    }
+    if(!found) {
+        fprintf(stderr, "*error* : the range starts past the last frame : %llu frames\n", (unsigned long long)frame_num);
+        mp3_source_close(&source);
+        return -2;
+    }
+    if(end > data_end)
+        end = data_end;//a cut last frame
+
+    phase_begin = mp3_counters_begin(ctx->counters);
+    engine = mp3_copy_file_range(src_fd, 0, dst_fd, 0, audio_begin, ctx->counters);
+    if(engine >= 0)
+        engine = mp3_copy_file_range(src_fd, begin, dst_fd, audio_begin, end - begin, ctx->counters);
+    if(engine >= 0 &&
+        0 > mp3_copy_file_range(src_fd, data_end, dst_fd, audio_begin + end - begin, source.size - data_end, ctx->counters))
+        engine = -1;
+    mp3_counters_end(ctx->counters, MP3_PHASE_WRITE, phase_begin);
+    mp3_source_close(&source);
+    if(engine < 0)
         return -1;
 
+    printf("Cut        : frames %llu-%llu   pos : %llu-%llu\n",
+        (unsigned long long)first, (unsigned long long)last_found,
+        (unsigned long long)begin, (unsigned long long)end);//dump
+    if(reservoir)
+        printf("Reservoir  : %u frames before the range\n", reservoir);//dump
+    if(missing)
+        printf("Reservoir  : %u bytes missing, the first frame decodes as silence\n", missing);//dump
+    printf("Copied     : %s\n", copy_engine_string[engine]);//dump
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////
+// join
+//
+// --join appends the frames of several files into one without the
+// tags cat would leave in the middle: the ID3v2 tag of the first file
+// and the ID3v1/APE trailer of the last one are kept, the tags in
+// between, junk, a cut last frame and the Xing/Info/VBRI frames of the
+// inputs are left out. Runs of frames go to the kernel through
+// copy_file_range. Every frame has to match the first one in version,
+// layer, sampling rate and mono or not. With --xing a Layer III output
+// starts with a fresh Info (CBR) or Xing (VBR) frame that carries the
+// frame count, the byte count and the seek table of the joined stream.
+
+#define MP3_JOIN_TOC_STRIDE 64// frames per sampled offset, finer than the 1/256 of the seek table
+#define MP3_XING_LENGTH (4 + 4 + 4 + 4 + 100)// tag, flags, frames, bytes and seek table
+
+typedef struct mp3_join_state_tag {
+    int dst_fd;
+    uint64_t dst_offset;// where the next run goes
+    uint64_t audio_begin;// output offset of the first frame, the Xing frame included
+    uint64_t audio_end;
+    mp3_frame_header first;// every frame must match it
+    uint8_t first_head[4];
+    uint8_t found;
+    uint8_t vbr;// the bitrate changes
+    uint32_t xing_size;// reserved at audio_begin, 0:none
+    uint64_t frames;
+    uint64_t *toc_offsets;// output offset every MP3_JOIN_TOC_STRIDE frames
+    size_t toc_count;
+    size_t toc_capacity;
+    uint64_t junk;// bytes left out
+    uint32_t tags;
+    uint32_t vbr_frames;
+    int engine;// the slowest one used
+} mp3_join_state;
+
+static void
+mp3_write_be32(uint8_t *data, uint32_t value)
+{
+    data[0] = (uint8_t)(value >> 24);
+    data[1] = (uint8_t)(value >> 16);
+    data[2] = (uint8_t)(value >> 8);
+    data[3] = (uint8_t)(value >> 0);
+}
+
+//1:the frame carries a Xing/Info/VBRI header
+static int
+mp3_join_vbr_frame(mp3_frame_iter *iter, const mp3_frame_event *event)
+{
+    const uint8_t *data;
+    size_t available;
+    size_t offset;
+
+    data = mp3_iter_data(iter, event->offset, &available);
+    if(!data)
+        return 0;
+    if(available > event->size)
+        available = (size_t)event->size;
+
+    return mp3_frame_vbr_tag(&event->header, data, available, &offset) != MP3_VBR_NONE;
+}
+
+//the smallest frame of the stream's format that holds the Xing header
+static uint32_t
+mp3_join_xing_size(mp3_join_state *state, uint8_t *head)
+{
+    mp3_frame_header header;
+    size_t need = 4 + mp3_side_info_length(&state->first) + MP3_XING_LENGTH;
+    size_t size;
+
+    memcpy(head, state->first_head, 4);
+    head[1] |= 0x01;//no CRC
+    for(int index = 1; index < 15; index++) {
+        head[2] = (uint8_t)((index << 4) | (state->first_head[2] & 0x0d));//no padding
+        parse_mp3header(head, &header);
+        size = mp3_frame_size(&header);
+        if(size >= need)
+            return (uint32_t)size;
+    }
     return 0;
 }
 
 static int
-id3_force_js_v2(FILE *src_fp, FILE *dst_fp)
+mp3_join_write_xing(mp3_join_state *state)
+{
+    uint8_t *frame;
+    uint8_t *toc;
+    uint64_t bytes = state->audio_end - state->audio_begin;
+    uint64_t pos;
+    size_t offset = 4 + mp3_side_info_length(&state->first);
+    size_t sample;
+    uint32_t flags = 0x07;//frames, bytes, toc
+    ssize_t wrote_size;
+
+    frame = (uint8_t *)calloc(1, state->xing_size);
+    if(!frame)
+        return -1;
+    mp3_join_xing_size(state, frame);
+
+    if(bytes > UINT32_MAX) {
+        fprintf(stderr, "*warning* : the stream is too large for the byte count of the Xing header\n");
+        flags = 0x05;
+    }
+    memcpy(frame + offset, state->vbr ? "Xing" : "Info", 4);
+    mp3_write_be32(frame + offset + 4, flags);
+    mp3_write_be32(frame + offset + 8, (uint32_t)state->frames);//the Xing frame not included
+    offset += 12;
+    if(flags & 0x02) {
+        mp3_write_be32(frame + offset, (uint32_t)bytes);
+        offset += 4;
+    }
+
+    //byte position of each percent of the frames, in 1/256 of the stream
+    toc = frame + offset;
+    for(int i = 0; i < 100; i++) {
+        sample = (size_t)((uint64_t)i * state->frames / 100 / MP3_JOIN_TOC_STRIDE);
+        if(sample >= state->toc_count)
+            sample = state->toc_count - 1;
+        pos = (state->toc_offsets[sample] - state->audio_begin) * 256 / bytes;
+        toc[i] = (uint8_t)(pos > 255 ? 255 : pos);
+    }
+
+    wrote_size = pwrite(state->dst_fd, frame, state->xing_size, state->audio_begin);
+    free(frame);
+    return wrote_size == (ssize_t)state->xing_size ? 0 : -1;
+}
+
+static int
+mp3_join_copy(mp3_join_state *state, int src_fd, uint64_t begin, uint64_t end, mp3_counters *counters)
 {
-    uint8_t data[10];
-    uint32_t read_size;
-    uint32_t id3v2_length;
+    int engine;
 
-    read_size = fread(data, 1, 10, src_fp);
-    if(read_size != 10)
+    if(end <= begin)
+        return 0;
+    engine = mp3_copy_file_range(src_fd, begin, state->dst_fd, state->dst_offset, end - begin, counters);
+    if(engine < 0)
         return -1;
-    
-    if(data[0] != 0x49 ||
-        data[1] != 0x44 ||
-        data[2] != 0x33)
-        return -2;
+    if(engine < state->engine)
+        state->engine = engine;
+    state->dst_offset += end - begin;
+    return 0;
+}
 
-    id3v2_length = 0;
-    id3v2_length = ((data[6] & 0x7F) << 21) |
-                    ((data[7] & 0x7F) << 14) |
-                    ((data[8] & 0x7F) << 7) |
-                    ((data[9] & 0x7F) << 0);
+//the frames of one input, the leading tag of the first one and the
+//trailer of the last one
+static int
+mp3_join_file(mp3demuxer_context *ctx, mp3_join_state *state, uint32_t index)
+{
+    const char *filename = ctx->join_files[index];
+    mp3_source source;
+    mp3_frame_iter iter;
+    mp3_frame_event event;
+    uint64_t audio_begin;
+    uint64_t data_end;
+    uint64_t run_begin = 0;
+    uint64_t run_end = 0;
+    uint64_t frame_num = 0;
+    uint64_t phase_begin;
+    uint8_t head[MP3_CRC_HEAD];
+    const char *differs;
+    int src_fd;
+    int result;
 
-    if(fseek(src_fp, id3v2_length, SEEK_CUR))
+    src_fd = open(filename, O_RDONLY);//open
+    if(src_fd < 0) {
+        fprintf(stderr, "*error* : file open for analyzation failed : at %s\n", filename);
         return -1;
+    }
+    if(mp3_source_open_mmap(&source, src_fd)) {
+        close(src_fd);//close
+        return -1;
+    }
+    source.counters = ctx->counters;
+    if(mp3_source_audio_region(&source, &audio_begin, &data_end)) {
+        result = -1;
+        goto done;
+    }
+
+    if(index == 0) {
+        phase_begin = mp3_counters_begin(ctx->counters);
+        result = mp3_join_copy(state, src_fd, 0, audio_begin, ctx->counters);
+        mp3_counters_end(ctx->counters, MP3_PHASE_WRITE, phase_begin);
+        if(result)
+            goto done;
+        state->audio_begin = state->dst_offset;
+    }
+    else if(audio_begin > 0)
+        state->tags++;
+    if(index + 1 < ctx->join_count && data_end < source.size)
+        state->tags++;
 
-    //search
+    mp3_iter_init(&iter, &source, audio_begin, data_end);
 
-    return id3_force_js_v1_internal(src_fp, dst_fp, ftell(src_fp));
+    while(0 < (result = mp3_iter_next(&iter, &event))) {
+        if(event.type == MP3_EVENT_JUNK) {
+            state->junk += event.size;
+            continue;
+        }
+        if(event.offset + event.size > data_end) {
+            fprintf(stderr, "*warning* : the last frame is cut, left out : at %s\n", filename);
+            state->junk += data_end - event.offset;
+            break;
+        }
+        if(frame_num++ == 0 && mp3_join_vbr_frame(&iter, &event)) {
+            state->vbr_frames++;
+            continue;
+        }
+
+        if(!state->found) {
+            state->found = 1;
+            state->first = event.header;
+            if(mp3_frame_head(&iter, &event, head) < 4) {
+                result = -1;
+                break;
+            }
+            memcpy(state->first_head, head, 4);
+            if(ctx->join_xing) {
+                if(mp3_side_info_length(&state->first) == 0)
+                    fprintf(stderr, "*warning* : Xing headers are for Layer III only, left out\n");
+                else
+                    state->xing_size = mp3_join_xing_size(state, head);
+                state->dst_offset += state->xing_size;
+            }
+        }
+
+        differs = NULL;
+        if(event.header.version != state->first.version)
+            differs = "version";
+        else if(event.header.layer != state->first.layer)
+            differs = "layer";
+        else if(event.header.sampling_frequency_index != state->first.sampling_frequency_index)
+            differs = "sampling rate";
+        else if((event.header.channel_mode == 3) != (state->first.channel_mode == 3))
+            differs = "channel layout";
+        if(differs) {
+            fprintf(stderr, "*error* : the %s differs from the first file : at %s frame %llu\n",
+                differs, filename, (unsigned long long)(frame_num - 1));
+            result = -2;
+            break;
+        }
+        if(event.header.bitrate_index != state->first.bitrate_index)
+            state->vbr = 1;
+
+        //a run of frames, copied when it breaks
+        if(event.offset != run_end) {
+            phase_begin = mp3_counters_begin(ctx->counters);
+            result = mp3_join_copy(state, src_fd, run_begin, run_end, ctx->counters);
+            mp3_counters_end(ctx->counters, MP3_PHASE_WRITE, phase_begin);
+            if(result)
+                break;
+            run_begin = event.offset;
+        }
+        run_end = event.offset + event.size;
+
+        if(state->frames % MP3_JOIN_TOC_STRIDE == 0) {
+            if(state->toc_count == state->toc_capacity) {
+                size_t capacity = state->toc_capacity ? state->toc_capacity * 2 : 1024;
+                uint64_t *offsets = (uint64_t *)realloc(state->toc_offsets, sizeof(uint64_t) * capacity);
+                if(!offsets) {
+                    result = -1;
+                    break;
+                }
+                state->toc_offsets = offsets;
+                state->toc_capacity = capacity;
+            }
+            state->toc_offsets[state->toc_count++] = state->dst_offset + (event.offset - run_begin);
+        }
+        state->frames++;
+    }
+    if(result < 0)
+        goto done;
+
+    phase_begin = mp3_counters_begin(ctx->counters);
+    result = mp3_join_copy(state, src_fd, run_begin, run_end, ctx->counters);
+    if(result == 0 && index + 1 == ctx->join_count) {
+        state->audio_end = state->dst_offset;
+        if(state->xing_size && state->frames)
+            result = mp3_join_write_xing(state);
+        if(result == 0)
+            result = mp3_join_copy(state, src_fd, data_end, source.size, ctx->counters);
+    }
+    mp3_counters_end(ctx->counters, MP3_PHASE_WRITE, phase_begin);
+
+done:
+    mp3_source_close(&source);
+    close(src_fd);//close
+    return result;
 }
+
+static int
+mp3_join(mp3demuxer_context *ctx, int dst_fd)
+{
+    mp3_join_state state;
+    int result = 0;
+
+    memset(&state, 0x00, sizeof(mp3_join_state));
+    state.dst_fd = dst_fd;
+    state.engine = MP3_COPY_REFLINK;
+
+    for(uint32_t i = 0; i < ctx->join_count && 0 == result; i++)
+        result = mp3_join_file(ctx, &state, i);
+    free(state.toc_offsets);
+    if(result)
+        return result;
+    if(state.frames == 0) {
+        fprintf(stderr, "*error* : no frames found\n");
+        return -2;
+    }
+
+    printf("Joined     : %u files   frames : %llu   bytes : %llu\n",
+        ctx->join_count, (unsigned long long)state.frames,
+        (unsigned long long)(state.audio_end - state.audio_begin));//dump
+    if(state.tags || state.vbr_frames || state.junk)
+        printf("Dropped    : %u tags   %u Xing/Info/VBRI frames   %llu junk bytes\n",
+            state.tags, state.vbr_frames, (unsigned long long)state.junk);//dump
+    if(state.xing_size)
+        printf("Xing       : %s frame, %u bytes\n", state.vbr ? "Xing" : "Info", state.xing_size);//dump
+    printf("Copied     : %s\n", copy_engine_string[state.engine]);//dump
+
+    return 0;
+}
+#endif
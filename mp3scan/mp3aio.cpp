@@ -0,0 +1,709 @@
+// mp3aio.cpp : asynchronous reads for batch analysis, io_uring or a pread thread pool
+//
+// Copyright (c) 2010, Reiji Tokuda
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+// 
+// - Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+// IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+// EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "mp3aio.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define MP3_HAVE_URING 1
+#endif
+
+enum {
+    MP3_AIO_FREE = 0,
+    MP3_AIO_BUSY = 1,
+    MP3_AIO_READY = 2,
+    MP3_AIO_FAILED = 3,
+};
+
+struct mp3_aio_tag {
+    mp3_aio_backend backend;
+    uint32_t in_flight;// queued and not reaped yet
+
+#ifdef MP3_HAVE_URING
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint32_t to_submit;
+
+    //one slot per request in the ring, the iovec lives until completion
+    mp3_aio_request *slot_request[MP3_AIO_ENTRIES];
+    struct iovec slot_iov[MP3_AIO_ENTRIES];
+    uint32_t free_slots[MP3_AIO_ENTRIES];
+    uint32_t free_count;
+#endif
+
+    //pread pool
+    pthread_t threads[MP3_AIO_POOL_THREADS];
+    uint32_t thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    mp3_aio_request *staged[MP3_AIO_ENTRIES];
+    uint32_t staged_count;
+    mp3_aio_request *pending[MP3_AIO_ENTRIES];// ring
+    uint32_t pending_head;
+    uint32_t pending_count;
+    mp3_aio_request *finished[MP3_AIO_ENTRIES];// ring
+    uint32_t finished_head;
+    uint32_t finished_count;
+    uint8_t stop;
+};
+
+///////////////////////////////////////////////////////////////////
+// io_uring
+//
+// Raw system calls, no liburing: one submission ring and one completion
+// ring shared with the kernel, reads are IORING_OP_READV (Linux 5.1).
+
+#ifdef MP3_HAVE_URING
+static int
+mp3_aio_uring_setup(mp3_aio *aio)
+{
+    struct io_uring_params params;
+    uint8_t *sq;
+    uint8_t *cq;
+
+    memset(&params, 0x00, sizeof(params));
+    aio->ring_fd = (int)syscall(__NR_io_uring_setup, MP3_AIO_ENTRIES, &params);
+    if(aio->ring_fd < 0)
+        return -1;//old kernel or not allowed here
+
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(aio->cq_ring_size > aio->sq_ring_size)
+            aio->sq_ring_size = aio->cq_ring_size;
+        aio->cq_ring_size = aio->sq_ring_size;
+    }
+
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        aio->ring_fd, IORING_OFF_SQ_RING);
+    if(aio->sq_ring == MAP_FAILED) {
+        close(aio->ring_fd);
+        return -1;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+        aio->cq_ring = aio->sq_ring;
+    else {
+        aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            aio->ring_fd, IORING_OFF_CQ_RING);
+        if(aio->cq_ring == MAP_FAILED) {
+            munmap(aio->sq_ring, aio->sq_ring_size);
+            close(aio->ring_fd);
+            return -1;
+        }
+    }
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = (struct io_uring_sqe *)mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        aio->ring_fd, IORING_OFF_SQES);
+    if(aio->sqes == MAP_FAILED) {
+        if(aio->cq_ring != aio->sq_ring)
+            munmap(aio->cq_ring, aio->cq_ring_size);
+        munmap(aio->sq_ring, aio->sq_ring_size);
+        close(aio->ring_fd);
+        return -1;
+    }
+
+    sq = (uint8_t *)aio->sq_ring;
+    cq = (uint8_t *)aio->cq_ring;
+    aio->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    aio->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)(sq + params.sq_off.array);
+    aio->cq_head = (unsigned *)(cq + params.cq_off.head);
+    aio->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    aio->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    for(uint32_t i = 0; i < MP3_AIO_ENTRIES; i++)
+        aio->free_slots[i] = MP3_AIO_ENTRIES - 1 - i;
+    aio->free_count = MP3_AIO_ENTRIES;
+
+    return 0;
+}
+
+static void
+mp3_aio_uring_close(mp3_aio *aio)
+{
+    munmap(aio->sqes, aio->sqes_size);
+    if(aio->cq_ring != aio->sq_ring)
+        munmap(aio->cq_ring, aio->cq_ring_size);
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(aio->ring_fd);
+}
+
+static void
+mp3_aio_uring_queue(mp3_aio *aio, mp3_aio_request *request)
+{
+    unsigned tail = *aio->sq_tail;
+    unsigned index = tail & *aio->sq_mask;
+    uint32_t slot = aio->free_slots[--aio->free_count];
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+
+    aio->slot_request[slot] = request;
+    aio->slot_iov[slot].iov_base = request->buffer;
+    aio->slot_iov[slot].iov_len = request->length;
+
+    memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = request->fd;
+    sqe->off = request->offset;
+    sqe->addr = (uint64_t)(uintptr_t)&aio->slot_iov[slot];
+    sqe->len = 1;
+    sqe->user_data = slot;
+
+    aio->sq_array[index] = index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->to_submit++;
+}
+
+//submit what is queued, then wait for min_complete completions
+static int
+mp3_aio_uring_enter(mp3_aio *aio, uint32_t min_complete)
+{
+    int result;
+
+    do {
+        result = (int)syscall(__NR_io_uring_enter, aio->ring_fd, aio->to_submit, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(result < 0 && errno == EINTR);
+    if(result < 0)
+        return -1;
+
+    aio->to_submit -= (uint32_t)result;
+    return 0;
+}
+
+static mp3_aio_request *
+mp3_aio_uring_wait(mp3_aio *aio)
+{
+    mp3_aio_request *request;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    uint32_t slot;
+
+    while(1) {
+        head = *aio->cq_head;
+        if(head != __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE))
+            break;
+        if(mp3_aio_uring_enter(aio, 1))
+            return NULL;
+    }
+
+    cqe = &aio->cqes[head & *aio->cq_mask];
+    slot = (uint32_t)cqe->user_data;
+    request = aio->slot_request[slot];
+    request->result = cqe->res;
+    __atomic_store_n(aio->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    aio->free_slots[aio->free_count++] = slot;
+    return request;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////
+// pread pool
+
+static void *
+mp3_aio_pool_main(void *arg)
+{
+    mp3_aio *aio = (mp3_aio *)arg;
+    mp3_aio_request *request;
+    size_t done;
+    ssize_t result;
+
+    while(1) {
+        pthread_mutex_lock(&aio->lock);
+        while(aio->pending_count == 0 && !aio->stop)
+            pthread_cond_wait(&aio->work, &aio->lock);
+        if(aio->pending_count == 0) {
+            pthread_mutex_unlock(&aio->lock);
+            break;//stop
+        }
+        request = aio->pending[aio->pending_head];
+        aio->pending_head = (aio->pending_head + 1) % MP3_AIO_ENTRIES;
+        aio->pending_count--;
+        pthread_mutex_unlock(&aio->lock);
+
+        done = 0;
+        result = 0;
+        while(done < request->length) {
+            result = pread(request->fd, request->buffer + done, request->length - done, request->offset + done);
+            if(result < 0 && errno == EINTR)
+                continue;
+            if(result <= 0)
+                break;//error or end of file
+            done += result;
+        }
+        request->result = result < 0 ? -errno : (ssize_t)done;
+
+        pthread_mutex_lock(&aio->lock);
+        aio->finished[(aio->finished_head + aio->finished_count) % MP3_AIO_ENTRIES] = request;
+        aio->finished_count++;
+        pthread_cond_signal(&aio->done);
+        pthread_mutex_unlock(&aio->lock);
+    }
+
+    return NULL;
+}
+
+static int
+mp3_aio_pool_start(mp3_aio *aio)
+{
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->done, NULL);
+
+    for(uint32_t i = 0; i < MP3_AIO_POOL_THREADS; i++) {
+        if(pthread_create(&aio->threads[i], NULL, mp3_aio_pool_main, aio))
+            break;
+        aio->thread_count++;
+    }
+    return aio->thread_count ? 0 : -1;
+}
+
+static void
+mp3_aio_pool_stop(mp3_aio *aio)
+{
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = 1;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+
+    for(uint32_t i = 0; i < aio->thread_count; i++)
+        pthread_join(aio->threads[i], NULL);
+
+    pthread_cond_destroy(&aio->done);
+    pthread_cond_destroy(&aio->work);
+    pthread_mutex_destroy(&aio->lock);
+}
+
+///////////////////////////////////////////////////////////////////
+// engine
+
+mp3_aio *
+mp3_aio_create(mp3_aio_backend backend)
+{
+    mp3_aio *aio = (mp3_aio *)calloc(1, sizeof(mp3_aio));
+
+    if(!aio)
+        return NULL;
+
+#ifdef MP3_HAVE_URING
+    if(backend != MP3_AIO_POOL &&
+        0 == mp3_aio_uring_setup(aio)) {
+        aio->backend = MP3_AIO_URING;
+        return aio;
+    }
+#endif
+    if(backend == MP3_AIO_URING ||
+        mp3_aio_pool_start(aio)) {
+        free(aio);
+        return NULL;
+    }
+    aio->backend = MP3_AIO_POOL;
+    return aio;
+}
+
+//nothing may be in flight
+void
+mp3_aio_destroy(mp3_aio *aio)
+{
+    if(!aio)
+        return;
+#ifdef MP3_HAVE_URING
+    if(aio->backend == MP3_AIO_URING)
+        mp3_aio_uring_close(aio);
+    else
+#endif
+        mp3_aio_pool_stop(aio);
+    free(aio);
+}
+
+mp3_aio_backend
+mp3_aio_backend_used(const mp3_aio *aio)
+{
+    return aio->backend;
+}
+
+//-1 when MP3_AIO_ENTRIES requests are out already
+int
+mp3_aio_queue(mp3_aio *aio, mp3_aio_request *request)
+{
+    if(aio->in_flight == MP3_AIO_ENTRIES)
+        return -1;
+
+    request->result = 0;
+#ifdef MP3_HAVE_URING
+    if(aio->backend == MP3_AIO_URING)
+        mp3_aio_uring_queue(aio, request);
+    else
+#endif
+        aio->staged[aio->staged_count++] = request;
+    aio->in_flight++;
+    return 0;
+}
+
+int
+mp3_aio_submit(mp3_aio *aio)
+{
+#ifdef MP3_HAVE_URING
+    if(aio->backend == MP3_AIO_URING)
+        return aio->to_submit ? mp3_aio_uring_enter(aio, 0) : 0;
+#endif
+    if(aio->staged_count == 0)
+        return 0;
+
+    pthread_mutex_lock(&aio->lock);
+    for(uint32_t i = 0; i < aio->staged_count; i++) {
+        aio->pending[(aio->pending_head + aio->pending_count) % MP3_AIO_ENTRIES] = aio->staged[i];
+        aio->pending_count++;
+    }
+    aio->staged_count = 0;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+    return 0;
+}
+
+//the next completed request, NULL when nothing is in flight or on error
+mp3_aio_request *
+mp3_aio_wait(mp3_aio *aio)
+{
+    mp3_aio_request *request;
+
+    if(aio->in_flight == 0)
+        return NULL;
+
+#ifdef MP3_HAVE_URING
+    if(aio->backend == MP3_AIO_URING) {
+        request = mp3_aio_uring_wait(aio);
+        if(request)
+            aio->in_flight--;
+        return request;
+    }
+#endif
+    if(mp3_aio_submit(aio))
+        return NULL;
+
+    pthread_mutex_lock(&aio->lock);
+    while(aio->finished_count == 0)
+        pthread_cond_wait(&aio->done, &aio->lock);
+    request = aio->finished[aio->finished_head];
+    aio->finished_head = (aio->finished_head + 1) % MP3_AIO_ENTRIES;
+    aio->finished_count--;
+    pthread_mutex_unlock(&aio->lock);
+
+    aio->in_flight--;
+    return request;
+}
+
+///////////////////////////////////////////////////////////////////
+// read ahead
+
+int
+mp3_aio_reader_init(mp3_aio_reader *reader, mp3_aio *aio)
+{
+    memset(reader, 0x00, sizeof(mp3_aio_reader));
+    reader->aio = aio;
+    reader->memory = (uint8_t *)malloc((size_t)MP3_AIO_DEPTH * MP3_AIO_CHUNK);
+    if(!reader->memory)
+        return -1;
+
+    for(int i = 0; i < MP3_AIO_DEPTH; i++) {
+        reader->chunks[i].request.buffer = reader->memory + (size_t)i * MP3_AIO_CHUNK;
+        reader->chunks[i].request.user = &reader->chunks[i].state;
+    }
+    return 0;
+}
+
+void
+mp3_aio_reader_free(mp3_aio_reader *reader)
+{
+    free(reader->memory);
+    reader->memory = NULL;
+}
+
+//one completion, its state byte tells the waiter
+static int
+mp3_aio_reader_reap(mp3_aio_reader *reader)
+{
+    uint64_t begin = mp3_counters_begin(reader->counters);
+    mp3_aio_request *request;
+
+    request = mp3_aio_wait(reader->aio);
+    if(!request)
+        return -1;
+    mp3_counters_end(reader->counters, MP3_PHASE_READ, begin);
+
+    *(uint8_t *)request->user = (request->result == (ssize_t)request->length) ? MP3_AIO_READY : MP3_AIO_FAILED;
+    if(reader->counters) {
+        reader->counters->read_calls++;
+        if(request->result > 0)
+            reader->counters->bytes_read += request->result;
+    }
+    return 0;
+}
+
+//free chunks take the next bytes of the task, then all go out at once
+static int
+mp3_aio_reader_fill(mp3_aio_reader *reader)
+{
+    mp3_aio_chunk *chunk;
+    mp3_aio_file *file = NULL;
+    uint64_t rest;
+
+    for(int i = 0; i < MP3_AIO_DEPTH; i++) {
+        chunk = &reader->chunks[i];
+        if(chunk->state != MP3_AIO_FREE)
+            continue;
+
+        while(reader->next_file < reader->file_count) {
+            file = &reader->files[reader->next_file];
+            if(file->fd >= 0 && reader->next_offset < file->size)
+                break;
+            reader->next_file++;
+            reader->next_offset = 0;
+        }
+        if(reader->next_file == reader->file_count)
+            break;//all of the task is out
+
+        rest = file->size - reader->next_offset;
+        chunk->request.fd = file->fd;
+        chunk->request.offset = reader->next_offset;
+        chunk->request.length = rest < MP3_AIO_CHUNK ? (size_t)rest : MP3_AIO_CHUNK;
+        if(mp3_aio_queue(reader->aio, &chunk->request))
+            break;//ring full
+        chunk->file = file;
+        chunk->state = MP3_AIO_BUSY;
+        reader->next_offset += chunk->request.length;
+    }
+
+    return mp3_aio_submit(reader->aio);
+}
+
+//files must have fd and size set, fd -1 for files that failed to open
+int
+mp3_aio_reader_start(mp3_aio_reader *reader, mp3_aio_file *files, size_t count)
+{
+    mp3_aio_file *file;
+
+    reader->files = files;
+    reader->file_count = count;
+    reader->next_file = 0;
+    reader->next_offset = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        file = &files[i];
+        file->reader = reader;
+        file->tail_state = MP3_AIO_FREE;
+        file->tail_request.length = 0;
+        if(file->fd < 0 || file->size == 0)
+            continue;
+
+        file->tail_request.fd = file->fd;
+        file->tail_request.length = file->size < MP3_AIO_TAIL ? (size_t)file->size : MP3_AIO_TAIL;
+        file->tail_request.offset = file->size - file->tail_request.length;
+        file->tail_request.buffer = file->tail;
+        file->tail_request.user = &file->tail_state;
+        if(0 == mp3_aio_queue(reader->aio, &file->tail_request))
+            file->tail_state = MP3_AIO_BUSY;
+    }
+
+    return mp3_aio_reader_fill(reader);
+}
+
+static int
+mp3_aio_source_read(mp3_source *source, uint64_t offset, uint8_t *buffer, size_t length)
+{
+    mp3_aio_file *file = (mp3_aio_file *)source->opaque;
+    mp3_aio_reader *reader = file->reader;
+    mp3_aio_chunk *chunk;
+    uint64_t begin;
+    uint8_t released = 0;
+    size_t copy;
+    ssize_t result;
+    int i;
+
+    if(offset > file->size || file->size - offset < length)
+        return -1;
+
+    //tail probe
+    if(file->tail_state != MP3_AIO_FREE &&
+        offset >= file->tail_request.offset &&
+        offset + length <= file->tail_request.offset + file->tail_request.length) {
+        while(file->tail_state == MP3_AIO_BUSY) {
+            if(mp3_aio_reader_reap(reader))
+                return -1;
+        }
+        if(file->tail_state == MP3_AIO_READY) {
+            memcpy(buffer, file->tail + (offset - file->tail_request.offset), length);
+            return 0;
+        }
+    }
+
+    //the walk has passed these
+    for(i = 0; i < MP3_AIO_DEPTH; i++) {
+        chunk = &reader->chunks[i];
+        if(chunk->file == file &&
+            (chunk->state == MP3_AIO_READY || chunk->state == MP3_AIO_FAILED) &&
+            chunk->request.offset + chunk->request.length <= offset) {
+            chunk->state = MP3_AIO_FREE;
+            released = 1;
+        }
+    }
+    if(released && mp3_aio_reader_fill(reader))
+        return -1;
+
+    while(length) {
+        for(i = 0; i < MP3_AIO_DEPTH; i++) {
+            chunk = &reader->chunks[i];
+            if(chunk->file == file &&
+                chunk->state != MP3_AIO_FREE &&
+                offset >= chunk->request.offset &&
+                offset < chunk->request.offset + chunk->request.length)
+                break;
+        }
+        if(i == MP3_AIO_DEPTH)
+            break;//not read ahead
+
+        while(chunk->state == MP3_AIO_BUSY) {
+            if(mp3_aio_reader_reap(reader))
+                return -1;
+        }
+        if(chunk->state == MP3_AIO_FAILED)
+            break;
+
+        copy = (size_t)(chunk->request.offset + chunk->request.length - offset);
+        if(copy > length)
+            copy = length;
+        memcpy(buffer, chunk->request.buffer + (offset - chunk->request.offset), copy);
+        buffer += copy;
+        offset += copy;
+        length -= copy;
+    }
+
+    //the rest the plain way
+    begin = mp3_counters_begin(source->counters);
+    while(length) {
+        result = pread(file->fd, buffer, length, offset);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            return -1;
+        if(source->counters) {
+            source->counters->read_calls++;
+            source->counters->bytes_read += result;
+        }
+        buffer += result;
+        offset += result;
+        length -= result;
+    }
+    mp3_counters_end(source->counters, MP3_PHASE_READ, begin);
+
+    return 0;
+}
+
+void
+mp3_aio_reader_open(mp3_aio_reader *reader, mp3_aio_file *file, mp3_source *source)
+{
+    memset(source, 0x00, sizeof(mp3_source));
+    source->size = file->size;
+    source->read = mp3_aio_source_read;
+    source->opaque = file;
+    source->fd = file->fd;
+    source->counters = reader->counters;
+}
+
+//drop what is left of a file, the kernel must be done with its buffers
+void
+mp3_aio_reader_close(mp3_aio_reader *reader, mp3_aio_file *file)
+{
+    mp3_aio_chunk *chunk;
+
+    while(file->tail_state == MP3_AIO_BUSY) {
+        if(mp3_aio_reader_reap(reader))
+            break;
+    }
+    for(int i = 0; i < MP3_AIO_DEPTH; i++) {
+        chunk = &reader->chunks[i];
+        if(chunk->file != file)
+            continue;
+        while(chunk->state == MP3_AIO_BUSY) {
+            if(mp3_aio_reader_reap(reader))
+                break;
+        }
+        chunk->state = MP3_AIO_FREE;
+        chunk->file = NULL;
+    }
+
+    //no read ahead for the rest of it
+    if(reader->next_file < reader->file_count &&
+        &reader->files[reader->next_file] == file) {
+        reader->next_file++;
+        reader->next_offset = 0;
+    }
+    mp3_aio_reader_fill(reader);
+}
+
+//wait out everything still in flight
+void
+mp3_aio_reader_finish(mp3_aio_reader *reader)
+{
+    while(0 == mp3_aio_reader_reap(reader))
+        ;
+    for(int i = 0; i < MP3_AIO_DEPTH; i++) {
+        reader->chunks[i].state = MP3_AIO_FREE;
+        reader->chunks[i].file = NULL;
+    }
+    reader->files = NULL;
+    reader->file_count = 0;
+}
+
+#endif
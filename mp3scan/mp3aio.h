@@ -0,0 +1,137 @@
+// mp3aio.h : asynchronous reads for batch analysis, io_uring or a pread thread pool
+//
+// Copyright (c) 2010, Reiji Tokuda
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+// 
+// - Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+// IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+// EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef MP3AIO_H
+#define MP3AIO_H
+
+#ifndef WIN32
+
+#include <sys/types.h>
+#include "mp3scan.h"
+
+#define MP3_AIO_ENTRIES 128// ring size, reads in flight per engine at most
+#define MP3_AIO_DEPTH 32// chunks a reader keeps in flight or buffered
+#define MP3_AIO_CHUNK (64 * 1024)
+#define MP3_AIO_POOL_THREADS 4// pread fallback
+#define MP3_AIO_TAIL 160// ID3v1 and APE footer probe
+
+/**
+ * asynchronous read engine
+ *
+ * Requests are queued, then handed to the kernel together by one
+ * mp3_aio_submit(). io_uring is used where the kernel allows it, a small
+ * pool of pread threads otherwise. An engine belongs to one thread.
+ */
+typedef enum mp3_aio_backend_tag {
+    MP3_AIO_AUTO = 0,
+    MP3_AIO_URING = 1,
+    MP3_AIO_POOL = 2,
+} mp3_aio_backend;
+
+typedef struct mp3_aio_request_tag {
+    int fd;
+    uint64_t offset;
+    uint8_t *buffer;
+    size_t length;
+    ssize_t result;// bytes read or -errno, set on completion
+    void *user;
+} mp3_aio_request;
+
+typedef struct mp3_aio_tag mp3_aio;
+
+mp3_aio *
+mp3_aio_create(mp3_aio_backend backend);
+void
+mp3_aio_destroy(mp3_aio *aio);
+mp3_aio_backend
+mp3_aio_backend_used(const mp3_aio *aio);
+
+int
+mp3_aio_queue(mp3_aio *aio, mp3_aio_request *request);
+int
+mp3_aio_submit(mp3_aio *aio);
+mp3_aio_request *
+mp3_aio_wait(mp3_aio *aio);
+
+/**
+ * read ahead over a list of files
+ *
+ * The reader streams the files of a batch task front to back through
+ * MP3_AIO_DEPTH chunks: the tail probes of all files and the first
+ * chunks go out as one submission, and every chunk the analysis walks
+ * past is refilled with the next one, in the next file if need be. A
+ * source opened on one of the files reads from those chunks and waits
+ * only for the one it needs. Reads the read ahead does not cover, like
+ * jumping back, fall back to pread.
+ */
+typedef struct mp3_aio_reader_tag mp3_aio_reader;
+
+typedef struct mp3_aio_file_tag {
+    mp3_aio_reader *reader;
+    int fd;// -1 if the file could not be opened
+    uint64_t size;
+
+    mp3_aio_request tail_request;
+    uint8_t tail[MP3_AIO_TAIL];
+    uint8_t tail_state;
+} mp3_aio_file;
+
+typedef struct mp3_aio_chunk_tag {
+    mp3_aio_request request;
+    mp3_aio_file *file;
+    uint8_t state;
+} mp3_aio_chunk;
+
+struct mp3_aio_reader_tag {
+    mp3_aio *aio;
+    mp3_counters *counters;
+
+    mp3_aio_file *files;
+    size_t file_count;
+    size_t next_file;// read ahead position
+    uint64_t next_offset;
+
+    mp3_aio_chunk chunks[MP3_AIO_DEPTH];
+    uint8_t *memory;
+};
+
+int
+mp3_aio_reader_init(mp3_aio_reader *reader, mp3_aio *aio);
+void
+mp3_aio_reader_free(mp3_aio_reader *reader);
+
+int
+mp3_aio_reader_start(mp3_aio_reader *reader, mp3_aio_file *files, size_t count);
+void
+mp3_aio_reader_open(mp3_aio_reader *reader, mp3_aio_file *file, mp3_source *source);
+void
+mp3_aio_reader_close(mp3_aio_reader *reader, mp3_aio_file *file);
+void
+mp3_aio_reader_finish(mp3_aio_reader *reader);
+
+#endif
+
+#endif
@@ -0,0 +1,1414 @@
+// mp3scan.cpp : frame scanning library shared by the command line tools
+//
+// Copyright (c) 2010, Reiji Tokuda
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+// 
+// - Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+// IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+// EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include "mp3scan.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MP3_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MP3_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static inline uint32_t mp3_ctz32(uint32_t x) { unsigned long i; _BitScanForward(&i, x); return i; }
+#else
+static inline uint32_t mp3_ctz32(uint32_t x) { return __builtin_ctz(x); }
+static inline uint32_t mp3_ctz64(uint64_t x) { return __builtin_ctzll(x); }
+#endif
+#if defined(_MSC_VER)
+static inline uint64_t mp3_bswap64(uint64_t x) { return _byteswap_uint64(x); }
+#else
+static inline uint64_t mp3_bswap64(uint64_t x) { return __builtin_bswap64(x); }
+#endif
+
+///////////////////////////////////////
+
+//[version][layer][value]
+const uint32_t bitrate_table[4][4][16] = 
+{
+    {//mpeg2.5
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2.5
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2.5
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0} //mpeg2.5
+    },
+    {//reserved
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0} //reserved
+    },
+    {//mpeg2
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2 L3
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},//mpeg2 L2
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0}//mpeg2 L1
+    },
+    {//mpeg1
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},//reserved
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},//mpeg1 L3
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},//mpeg1 L2
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0}//mpeg1 L1
+    }
+};
+
+//[version][index]
+const uint32_t sampling_rate_table[4][4] = 
+{
+    {11025, 12000, 8000, 0},//mpeg2.5
+    {0, 0, 0, 0},//reserved
+    {22050, 24000, 16000, 0},//mpeg2
+    {44100, 48000, 32000, 0} //mpeg1
+};
+
+//
+const uint32_t channel_table[4] = 
+{
+    2, 2, 2, 1
+};
+
+///////////////////////////////////////////////////////////////////
+// frame length table
+//
+// Slot size and samples per frame depend on version and layer: Layer I
+// counts 4 byte slots of 12 per kbit/s, Layer II 144, Layer III 144 for
+// MPEG-1 and 72 for MPEG-2/2.5 which also halve the samples. The table
+// is filled once during static initialization so the walk needs one
+// load instead of three lookups and a divide.
+
+//[byte1 bits 4..1][byte2 bits 7..1]
+static mp3_frame_info mp3_frame_table[16][128];
+
+static int
+mp3_frame_table_build()
+{
+    uint32_t version, layer, bitrate, sampling, padding;
+    uint32_t br, sr;
+    uint32_t coef, slot, samples;
+    mp3_frame_info *info;
+
+    for(version = 0; version < 4; version++) {
+        for(layer = 1; layer < 4; layer++) {
+            if(layer == 3) {//layer1
+                coef = 12;
+                slot = 4;
+                samples = 384;
+            }
+            else if(layer == 1 && version != 3) {//mpeg2/2.5 layer3
+                coef = 72;
+                slot = 1;
+                samples = 576;
+            }
+            else {
+                coef = 144;
+                slot = 1;
+                samples = 1152;
+            }
+
+            for(bitrate = 0; bitrate < 16; bitrate++) {
+                for(sampling = 0; sampling < 4; sampling++) {
+                    for(padding = 0; padding < 2; padding++) {
+                        br = bitrate_table[version][layer][bitrate] * 1000;//bitrate
+                        sr = sampling_rate_table[version][sampling];//sampling rate
+                        info = &mp3_frame_table[version << 2 | layer][bitrate << 3 | sampling << 1 | padding];
+                        if(br == 0 || sr == 0)
+                            continue;//free format or reserved
+                        info->length = (uint16_t)((coef * br / sr + padding) * slot);
+                        info->samples = (uint16_t)samples;
+                    }
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+static int mp3_frame_table_built = mp3_frame_table_build();
+
+const mp3_frame_info *
+mp3_frame_lookup(const uint8_t *data)
+{
+    return &mp3_frame_table[(data[1] >> 1) & 0x0F][data[2] >> 1];
+}
+
+///////////////////////////////////////////////////////////////////
+// frame header
+
+void
+parse_mp3header(const uint8_t *data, mp3_frame_header *header)
+{
+    header->version = (data[1] & 0x18) >> 3;
+    header->layer = (data[1] & 0x06) >> 1;
+    header->protection_bit = (data[1] & 0x01);
+    header->bitrate_index = (data[2] & 0xF0) >> 4;
+    header->sampling_frequency_index = (data[2] & 0x0C) >> 2;
+    header->padding_bit = (data[2] & 0x02) >> 1;
+    header->private_bit = (data[2] & 0x01);
+    header->channel_mode = (data[3] & 0xc0) >> 6;
+    header->mode_extension = (data[3] & 0x30) >> 4;
+    header->copyright = (data[3] & 0x08) >> 3;
+    header->original = (data[3] & 0x04) >> 2;
+    header->emphasis = (data[3] & 0x03);
+}
+
+size_t
+mp3_frame_size(const mp3_frame_header *header)
+{
+    return mp3_frame_table[(header->version & 3) << 2 | (header->layer & 3)]
+        [(header->bitrate_index & 15) << 3 | (header->sampling_frequency_index & 3) << 1 | (header->padding_bit & 1)].length;
+}
+
+uint32_t
+mp3_samples_per_frame(const mp3_frame_header *header)
+{
+    if(header->layer == 3)//layer1
+        return 384;
+    if(header->layer == 1 && header->version != 3)//mpeg2/2.5 layer3
+        return 576;
+    return 1152;
+}
+
+int
+mp3_header_valid(const uint8_t *data, mp3_frame_header *header, size_t *frame_size)
+{
+    if(data[0] != 0xff ||
+        (data[1] & 0xe0) != 0xe0)
+        return 0;
+
+    *frame_size = mp3_frame_lookup(data)->length;
+    if(*frame_size < 4)
+        return 0;
+
+    parse_mp3header(data, header);
+    return 1;
+}
+
+///////////////////////////////////////////////////////////////////
+// CRC-16
+//
+// Slice-by-8: table[k][x] is the CRC of byte x followed by k zero
+// bytes, so eight bytes take eight loads instead of eight dependent
+// steps. Side info is 9 to 32 bytes, one to four rounds.
+
+static uint16_t mp3_crc_table[8][256];
+
+static int
+mp3_crc_table_build()
+{
+    uint32_t crc;
+    int i, k;
+
+    for(i = 0; i < 256; i++) {
+        crc = (uint32_t)i << 8;
+        for(k = 0; k < 8; k++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+        mp3_crc_table[0][i] = (uint16_t)crc;
+    }
+    for(k = 1; k < 8; k++) {
+        for(i = 0; i < 256; i++) {
+            crc = mp3_crc_table[k - 1][i];
+            mp3_crc_table[k][i] = (uint16_t)((crc << 8) ^ mp3_crc_table[0][crc >> 8]);
+        }
+    }
+
+    return 1;
+}
+
+static int mp3_crc_table_built = mp3_crc_table_build();
+
+uint16_t
+mp3_crc16(uint16_t crc, const uint8_t *data, size_t length)
+{
+    while(length >= 8) {
+        crc = mp3_crc_table[7][data[0] ^ (crc >> 8)] ^
+              mp3_crc_table[6][data[1] ^ (crc & 0xff)] ^
+              mp3_crc_table[5][data[2]] ^
+              mp3_crc_table[4][data[3]] ^
+              mp3_crc_table[3][data[4]] ^
+              mp3_crc_table[2][data[5]] ^
+              mp3_crc_table[1][data[6]] ^
+              mp3_crc_table[0][data[7]];
+        data += 8;
+        length -= 8;
+    }
+    while(length--)
+        crc = (uint16_t)((crc << 8) ^ mp3_crc_table[0][(crc >> 8) ^ *data++]);
+
+    return crc;
+}
+
+size_t
+mp3_side_info_length(const mp3_frame_header *header)
+{
+    if(header->layer != 1)//layer3 only
+        return 0;
+    if(header->version == 3)//mpeg1
+        return header->channel_mode == 3 ? 17 : 32;
+    return header->channel_mode == 3 ? 9 : 17;
+}
+
+size_t
+mp3_frame_crc_length(const mp3_frame_header *header)
+{
+    if(header->protection_bit)
+        return 0;
+    return mp3_side_info_length(header);
+}
+
+uint32_t
+mp3_main_data_begin(const mp3_frame_header *header, const uint8_t *data)
+{
+    if(header->layer != 1)
+        return 0;
+    if(header->version == 3)//mpeg1: 9 bits
+        return (uint32_t)data[0] << 1 | data[1] >> 7;
+    return data[0];//mpeg2/2.5: 8 bits
+}
+
+uint16_t
+mp3_frame_crc(const uint8_t *frame, size_t side_info)
+{
+    return mp3_crc16(mp3_crc16(0xffff, frame + 2, 2), frame + 6, side_info);
+}
+
+///////////////////////////////////////////////////////////////////
+// Layer III side info
+//
+// The side info is copied into a zero padded buffer, so an unaligned
+// 64-bit big endian load is safe at any of its bytes. The fields of a
+// granule and channel up to mixed_block_flag are 37 (MPEG-1) or 42
+// (MPEG-2/2.5) bits and come out of one load with shifts and masks;
+// block_type and mixed_block are masked with window_switching instead
+// of branched on.
+
+static inline uint64_t
+mp3_load_be64(const uint8_t *data)
+{
+    uint64_t value;
+
+    memcpy(&value, data, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return value;
+#else
+    return mp3_bswap64(value);
+#endif
+}
+
+int
+mp3_parse_side_info(const mp3_frame_header *header, const uint8_t *data, size_t length, mp3_side_info *info)
+{
+    uint8_t padded[32 + 8];
+    size_t side_info = mp3_side_info_length(header);
+    uint32_t mpeg1 = header->version == 3;
+    uint32_t mono = header->channel_mode == 3;
+    uint32_t sfc_bits = mpeg1 ? 4 : 9;
+    uint32_t granule_bits = mpeg1 ? 59 : 63;
+    uint32_t pos;
+    uint32_t window_switching;
+    uint64_t bits;
+    mp3_granule_info *granule;
+
+    if(side_info == 0 || length < side_info)
+        return -2;
+    memcpy(padded, data, side_info);
+    memset(padded + side_info, 0x00, sizeof(padded) - side_info);
+
+    info->granules = mpeg1 ? 2 : 1;
+    info->channels = mono ? 1 : 2;
+    info->main_data_begin = (uint16_t)(mp3_load_be64(padded) >> (mpeg1 ? 64 - 9 : 64 - 8));
+
+    //main_data_begin, private bits and scfsi
+    pos = mpeg1 ? (mono ? 9 + 5 + 4 : 9 + 3 + 8) : (mono ? 8 + 1 : 8 + 2);
+
+    for(uint32_t gr = 0; gr < info->granules; gr++) {
+        for(uint32_t ch = 0; ch < info->channels; ch++) {
+            granule = &info->granule[gr][ch];
+            bits = mp3_load_be64(padded + (pos >> 3)) << (pos & 7);
+
+            granule->part2_3_length = (uint16_t)(bits >> (64 - 12));
+            granule->big_values = (uint16_t)((bits >> (64 - 21)) & 0x1ff);
+            granule->global_gain = (uint8_t)(bits >> (64 - 29));
+            granule->scalefac_compress = (uint16_t)((bits >> (64 - 29 - sfc_bits)) & ((1u << sfc_bits) - 1));
+            window_switching = (uint32_t)(bits >> (64 - 30 - sfc_bits)) & 1;
+            granule->window_switching = (uint8_t)window_switching;
+            granule->block_type = (uint8_t)((bits >> (64 - 32 - sfc_bits)) & 3 & (0 - window_switching));
+            granule->mixed_block = (uint8_t)((bits >> (64 - 33 - sfc_bits)) & window_switching);
+
+            pos += granule_bits;
+        }
+    }
+
+    return 0;
+}
+
+mp3_vbr_type
+mp3_frame_vbr_tag(const mp3_frame_header *header, const uint8_t *data, size_t length, size_t *offset)
+{
+    size_t side_info = mp3_side_info_length(header);
+    size_t pos;
+
+    if(side_info == 0)//layer3 only
+        return MP3_VBR_NONE;
+
+    //Xing/Info sits right after the CRC and the side info
+    pos = 4 + (header->protection_bit ? 0 : 2) + side_info;
+    if(pos + 4 <= length) {
+        *offset = pos;
+        if(0 == memcmp(data + pos, "Xing", 4))
+            return MP3_VBR_XING;
+        if(0 == memcmp(data + pos, "Info", 4))
+            return MP3_VBR_INFO;
+    }
+
+    //VBRI is always 32 bytes after the header
+    pos = 4 + 32;
+    if(pos + 4 <= length &&
+        0 == memcmp(data + pos, "VBRI", 4)) {
+        *offset = pos;
+        return MP3_VBR_VBRI;
+    }
+
+    return MP3_VBR_NONE;
+}
+
+///////////////////////////////////////////////////////////////////
+// sync search
+//
+// 32 bytes per step with SSE2 and 64 with AVX2; the scalar variant
+// leaves the byte scan to memchr.
+
+static size_t
+mp3_sync_search_scalar(const uint8_t *data, size_t length)
+{
+    const uint8_t *p = data;
+    const uint8_t *last;
+
+    if(length < 2)
+        return length;
+    last = data + length - 1;
+
+    while(p < last) {
+        p = (const uint8_t *)memchr(p, 0xff, last - p);
+        if(!p)
+            break;
+        if((p[1] & 0xe0) == 0xe0)
+            return p - data;
+        p++;
+    }
+
+    return length;
+}
+
+#if MP3_HAVE_SSE2
+static size_t
+mp3_sync_search_sse2(const uint8_t *data, size_t length)
+{
+    const __m128i ff = _mm_set1_epi8((char)0xff);
+    const __m128i e0 = _mm_set1_epi8((char)0xe0);
+    size_t i = 0;
+
+    //the second byte of a candidate is loaded one byte ahead
+    for(; i + 33 <= length; i += 32) {
+        __m128i lo0 = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i lo1 = _mm_loadu_si128((const __m128i *)(data + i + 16));
+        __m128i hi0 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+        __m128i hi1 = _mm_loadu_si128((const __m128i *)(data + i + 17));
+        __m128i m0 = _mm_and_si128(_mm_cmpeq_epi8(lo0, ff),
+                        _mm_cmpeq_epi8(_mm_and_si128(hi0, e0), e0));
+        __m128i m1 = _mm_and_si128(_mm_cmpeq_epi8(lo1, ff),
+                        _mm_cmpeq_epi8(_mm_and_si128(hi1, e0), e0));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(m0) |
+                        ((uint32_t)_mm_movemask_epi8(m1) << 16);
+
+        if(mask)
+            return i + mp3_ctz32(mask);
+    }
+
+    return i + mp3_sync_search_scalar(data + i, length - i);
+}
+#endif
+
+#if MP3_HAVE_AVX2
+__attribute__((target("avx2")))
+static size_t
+mp3_sync_search_avx2(const uint8_t *data, size_t length)
+{
+    const __m256i ff = _mm256_set1_epi8((char)0xff);
+    const __m256i e0 = _mm256_set1_epi8((char)0xe0);
+    size_t i = 0;
+
+    for(; i + 65 <= length; i += 64) {
+        __m256i lo0 = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i lo1 = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        __m256i hi0 = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+        __m256i hi1 = _mm256_loadu_si256((const __m256i *)(data + i + 33));
+        __m256i m0 = _mm256_and_si256(_mm256_cmpeq_epi8(lo0, ff),
+                        _mm256_cmpeq_epi8(_mm256_and_si256(hi0, e0), e0));
+        __m256i m1 = _mm256_and_si256(_mm256_cmpeq_epi8(lo1, ff),
+                        _mm256_cmpeq_epi8(_mm256_and_si256(hi1, e0), e0));
+        uint64_t mask = (uint64_t)(uint32_t)_mm256_movemask_epi8(m0) |
+                        ((uint64_t)(uint32_t)_mm256_movemask_epi8(m1) << 32);
+
+        if(mask)
+            return i + mp3_ctz64(mask);
+    }
+
+    return i + mp3_sync_search_scalar(data + i, length - i);
+}
+#endif
+
+mp3_sync_search_func
+mp3_sync_search_select(const char *name, const char **selected)
+{
+    const char *dummy;
+
+    if(!selected)
+        selected = &dummy;
+
+    if(name && 0 == strcmp(name, "scalar")) {
+        *selected = "scalar";
+        return mp3_sync_search_scalar;
+    }
+#if MP3_HAVE_AVX2
+    if(!name || 0 == strcmp(name, "avx2")) {
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) {
+            *selected = "avx2";
+            return mp3_sync_search_avx2;
+        }
+    }
+#endif
+#if MP3_HAVE_SSE2
+    if(!name || 0 == strcmp(name, "sse2") || 0 == strcmp(name, "avx2")) {
+        *selected = "sse2";
+        return mp3_sync_search_sse2;
+    }
+#endif
+    *selected = "scalar";
+    return mp3_sync_search_scalar;
+}
+
+///////////////////////////////////////////////////////////////////
+// performance counters
+
+uint64_t
+mp3_clock_ns()
+{
+#ifdef WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart * 1000000000 +
+                        now.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void
+mp3_counters_init(mp3_counters *counters)
+{
+    memset(counters, 0x00, sizeof(mp3_counters));
+    counters->start = mp3_clock_ns();
+}
+
+void
+mp3_counters_add(mp3_counters *total, const mp3_counters *counters)
+{
+    total->read_calls += counters->read_calls;
+    total->bytes_read += counters->bytes_read;
+    total->write_calls += counters->write_calls;
+    total->bytes_written += counters->bytes_written;
+    total->frames += counters->frames;
+    total->junk += counters->junk;
+    total->resyncs += counters->resyncs;
+    for(int i = 0; i < MP3_PHASES; i++)
+        total->phase[i] += counters->phase[i];
+}
+
+//wall and CPU time of the process so far, with the page faults, then
+//the counters; a run is CPU bound when the CPU time is most of the wall
+void
+mp3_counters_print(const mp3_counters *counters, int json, FILE *out)
+{
+    double wall = (mp3_clock_ns() - counters->start) / 1e9;
+    double user = 0.0;
+    double sys = 0.0;
+    uint64_t major_faults = 0;
+    uint64_t minor_faults = 0;
+    uint64_t nested;
+    double decode;
+    double cpu_share;
+
+#ifdef WIN32
+    FILETIME creation, exit_time, kernel, user_time;
+    if(GetProcessTimes(GetCurrentProcess(), &creation, &exit_time, &kernel, &user_time)) {
+        user = (((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime) / 1e7;
+        sys = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+    }
+#else
+    struct rusage usage;
+    if(0 == getrusage(RUSAGE_SELF, &usage)) {
+        user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        major_faults = usage.ru_majflt;
+        minor_faults = usage.ru_minflt;
+    }
+#endif
+
+    //threads can add up to more than the scan took
+    nested = counters->phase[MP3_PHASE_READ] + counters->phase[MP3_PHASE_OUTPUT] + counters->phase[MP3_PHASE_WRITE];
+    decode = counters->phase[MP3_PHASE_SCAN] > nested ? (counters->phase[MP3_PHASE_SCAN] - nested) / 1e9 : 0.0;
+    cpu_share = wall > 0.0 ? (user + sys) / wall : 0.0;
+
+    if(json) {
+        fprintf(out,
+            "{\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"bound\":\"%s\","
+            "\"read_calls\":%llu,\"bytes_read\":%llu,\"read_time\":%.6f,"
+            "\"write_calls\":%llu,\"bytes_written\":%llu,\"write_time\":%.6f,"
+            "\"frames\":%llu,\"junk\":%llu,\"resyncs\":%llu,"
+            "\"scan_time\":%.6f,\"decode_time\":%.6f,\"output_time\":%.6f,"
+            "\"major_faults\":%llu,\"minor_faults\":%llu}\n",
+            wall, user, sys, cpu_share >= 0.5 ? "cpu" : "io",
+            (unsigned long long)counters->read_calls,
+            (unsigned long long)counters->bytes_read,
+            counters->phase[MP3_PHASE_READ] / 1e9,
+            (unsigned long long)counters->write_calls,
+            (unsigned long long)counters->bytes_written,
+            counters->phase[MP3_PHASE_WRITE] / 1e9,
+            (unsigned long long)counters->frames,
+            (unsigned long long)counters->junk,
+            (unsigned long long)counters->resyncs,
+            counters->phase[MP3_PHASE_SCAN] / 1e9,
+            decode,
+            counters->phase[MP3_PHASE_OUTPUT] / 1e9,
+            (unsigned long long)major_faults,
+            (unsigned long long)minor_faults);
+        return;
+    }
+
+    fprintf(out, "Wall       : %.6f s   user : %.6f s   sys : %.6f s\n", wall, user, sys);//dump
+    fprintf(out, "Bound      : %s   cpu/wall : %.2f\n", cpu_share >= 0.5 ? "cpu" : "io", cpu_share);//dump
+    fprintf(out, "Read       : %llu calls   %llu bytes   %.6f s\n",
+        (unsigned long long)counters->read_calls,
+        (unsigned long long)counters->bytes_read,
+        counters->phase[MP3_PHASE_READ] / 1e9);//dump
+    fprintf(out, "Write      : %llu calls   %llu bytes   %.6f s\n",
+        (unsigned long long)counters->write_calls,
+        (unsigned long long)counters->bytes_written,
+        counters->phase[MP3_PHASE_WRITE] / 1e9);//dump
+    fprintf(out, "Decode     : %llu frames   %llu junk   %llu resyncs   %.6f s\n",
+        (unsigned long long)counters->frames,
+        (unsigned long long)counters->junk,
+        (unsigned long long)counters->resyncs,
+        decode);//dump
+    fprintf(out, "Output     : %.6f s\n", counters->phase[MP3_PHASE_OUTPUT] / 1e9);//dump
+    fprintf(out, "Faults     : %llu major   %llu minor\n",
+        (unsigned long long)major_faults,
+        (unsigned long long)minor_faults);//dump
+}
+
+///////////////////////////////////////////////////////////////////
+// byte sources
+
+static int
+mp3_source_read_fd(mp3_source *source, uint64_t offset, uint8_t *buffer, size_t length)
+{
+    uint64_t begin = mp3_counters_begin(source->counters);
+    size_t done = 0;
+
+    while(done < length) {
+        if(source->counters)
+            source->counters->read_calls++;
+#ifdef WIN32
+        int result;
+        if(_lseeki64(source->fd, offset + done, SEEK_SET) < 0)
+            return -1;
+        result = _read(source->fd, buffer + done, (unsigned int)(length - done));
+#else
+        ssize_t result = pread(source->fd, buffer + done, length - done, offset + done);
+        if(result < 0 && errno == EINTR)
+            continue;
+#endif
+        if(result <= 0)
+            return -1;//error or unexpected end
+        done += result;
+    }
+
+    if(source->counters) {
+        source->counters->bytes_read += length;
+        mp3_counters_end(source->counters, MP3_PHASE_READ, begin);
+    }
+    return 0;
+}
+
+int
+mp3_source_open_fd(mp3_source *source, int fd)
+{
+#ifdef WIN32
+    struct _stati64 st;
+    if(_fstati64(fd, &st))
+        return -1;
+#else
+    struct stat st;
+    if(fstat(fd, &st))
+        return -1;
+#endif
+
+    memset(source, 0x00, sizeof(mp3_source));
+    source->size = st.st_size;
+    source->read = mp3_source_read_fd;
+    source->fd = fd;
+
+    return 0;
+}
+
+#ifndef WIN32
+int
+mp3_source_open_mmap(mp3_source *source, int fd)
+{
+    struct stat st;
+    void *base;
+
+    if(fstat(fd, &st))
+        return -1;
+
+    if(st.st_size == 0)
+        return mp3_source_open_fd(source, fd);//nothing to map, reads fail past the end
+    memset(source, 0x00, sizeof(mp3_source));
+    source->fd = fd;
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(base == MAP_FAILED)
+        return -1;
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    source->data = (const uint8_t *)base;
+    source->size = st.st_size;
+    source->mapped = 1;
+
+    return 0;
+}
+#endif
+
+void
+mp3_source_open_memory(mp3_source *source, const uint8_t *data, size_t size)
+{
+    memset(source, 0x00, sizeof(mp3_source));
+    source->data = data;
+    source->size = size;
+    source->fd = -1;
+}
+
+void
+mp3_source_close(mp3_source *source)
+{
+#ifndef WIN32
+    if(source->mapped)
+        munmap((void *)source->data, source->size);
+#endif
+    source->data = NULL;
+    source->mapped = 0;
+}
+
+//ID3v1 and APEv2 bytes at the end of tail, size is the whole input
+static uint64_t
+mp3_trailer_length(const uint8_t *tail, size_t length, uint64_t size)
+{
+    const uint8_t *footer;
+    uint64_t trailer = 0;
+    uint32_t ape_size;
+
+    //TAG
+    if(length >= 128 &&
+        0 == memcmp(tail + length - 128, "TAG", 3))
+        trailer = 128;
+
+    //APETAGEX footer, before TAG
+    if(length - trailer >= 32 &&
+        0 == memcmp(tail + length - trailer - 32, "APETAGEX", 8)) {
+        footer = tail + length - trailer - 32;
+        ape_size = footer[12] | (footer[13] << 8) | (footer[14] << 16) | ((uint32_t)footer[15] << 24);
+        if(footer[23] & 0x80)
+            ape_size += 32;//header present
+        trailer += ape_size;
+    }
+
+    return trailer < size ? trailer : size;
+}
+
+static void
+mp3_stream_finish(mp3_source *source)
+{
+    mp3_stream *stream = source->stream;
+    size_t used = (size_t)(stream->end - stream->begin);
+    size_t length = used < 160 ? used : 160;
+
+    stream->eof = 1;
+    stream->trailer = mp3_trailer_length(stream->buffer + used - length, length, stream->end);
+    source->size = stream->end;
+}
+
+//read until target is buffered or the input ends, bytes before keep may go
+static int
+mp3_stream_fill(mp3_source *source, uint64_t keep, uint64_t target)
+{
+    mp3_stream *stream = source->stream;
+    uint64_t begin;
+    size_t used;
+    size_t drop;
+
+    if(target <= stream->end || stream->eof)
+        return 0;
+
+    //make room
+    if(keep > stream->begin) {
+        drop = (size_t)((keep < stream->end ? keep : stream->end) - stream->begin);
+        memmove(stream->buffer, stream->buffer + drop, (size_t)(stream->end - stream->begin) - drop);
+        stream->begin += drop;
+    }
+
+    begin = mp3_counters_begin(source->counters);
+
+    //input before keep is read and thrown away, an ID3v2 tag larger
+    //than the buffer
+    while(keep > stream->end) {
+        uint64_t skip = keep - stream->end;
+        size_t chunk = skip < MP3_STREAM_BUFFER ? (size_t)skip : MP3_STREAM_BUFFER;
+        if(source->counters)
+            source->counters->read_calls++;
+#ifdef WIN32
+        int result = _read(stream->fd, stream->buffer, (unsigned int)chunk);
+#else
+        ssize_t result = read(stream->fd, stream->buffer, chunk);
+        if(result < 0 && errno == EINTR)
+            continue;
+#endif
+        if(result < 0)
+            return -1;//error
+        if(result == 0) {
+            mp3_stream_finish(source);
+            mp3_counters_end(source->counters, MP3_PHASE_READ, begin);
+            return 0;//end
+        }
+        stream->end += result;
+        stream->begin = stream->end;
+        if(source->counters)
+            source->counters->bytes_read += result;
+    }
+
+    if(target - stream->begin > MP3_STREAM_BUFFER)
+        target = stream->begin + MP3_STREAM_BUFFER;
+
+    while(stream->end < target) {
+        used = (size_t)(stream->end - stream->begin);
+        if(source->counters)
+            source->counters->read_calls++;
+#ifdef WIN32
+        int result = _read(stream->fd, stream->buffer + used, (unsigned int)(MP3_STREAM_BUFFER - used));
+#else
+        ssize_t result = read(stream->fd, stream->buffer + used, MP3_STREAM_BUFFER - used);
+        if(result < 0 && errno == EINTR)
+            continue;
+#endif
+        if(result < 0)
+            return -1;//error
+        if(result == 0) {
+            mp3_stream_finish(source);
+            break;//end
+        }
+        stream->end += result;
+        if(source->counters)
+            source->counters->bytes_read += result;
+    }
+    mp3_counters_end(source->counters, MP3_PHASE_READ, begin);
+
+    return 0;
+}
+
+static int
+mp3_source_read_stream(mp3_source *source, uint64_t offset, uint8_t *buffer, size_t length)
+{
+    mp3_stream *stream = source->stream;
+
+    if(offset < stream->begin ||
+        mp3_stream_fill(source, offset, offset + length) ||
+        offset + length > stream->end)
+        return -1;
+
+    memcpy(buffer, stream->buffer + (offset - stream->begin), length);
+    return 0;
+}
+
+void
+mp3_source_open_stream(mp3_source *source, mp3_stream *stream, int fd)
+{
+    memset(source, 0x00, sizeof(mp3_source));
+    source->size = UINT64_MAX;
+    source->read = mp3_source_read_stream;
+    source->fd = fd;
+    source->stream = stream;
+
+    stream->fd = fd;
+    stream->begin = 0;
+    stream->end = 0;
+    stream->trailer = 0;
+    stream->eof = 0;
+}
+
+static int
+mp3_source_copy(mp3_source *source, uint64_t offset, uint8_t *buffer, size_t length)
+{
+    if(offset > source->size || source->size - offset < length)
+        return -1;
+    if(source->data) {
+        memcpy(buffer, source->data + offset, length);
+        return 0;
+    }
+    return source->read(source, offset, buffer, length);
+}
+
+int
+mp3_source_audio_region(mp3_source *source, uint64_t *begin, uint64_t *end)
+{
+    uint8_t data[160];
+    size_t length;
+
+    *begin = 0;
+    *end = source->size;
+
+    //ID3v2
+    if(source->size >= 10) {
+        if(mp3_source_copy(source, 0, data, 10))
+            return -1;
+        if(data[0] == 0x49 &&
+            data[1] == 0x44 &&
+            data[2] == 0x33) {
+            *begin = 10 + (((data[6] & 0x7F) << 21) |
+                            ((data[7] & 0x7F) << 14) |
+                            ((data[8] & 0x7F) << 7) |
+                            ((data[9] & 0x7F) << 0));
+        }
+    }
+
+    if(source->stream)
+        return 0;//the end is not known yet
+
+    //TAG, APE
+    length = source->size < sizeof(data) ? (size_t)source->size : sizeof(data);
+    if(mp3_source_copy(source, source->size - length, data, length))
+        return -1;
+    *end -= mp3_trailer_length(data, length, source->size);
+    if(*end < *begin)
+        *end = *begin;
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////
+// frame iterator
+//
+// A broken header does not end the walk: the bytes up to the next
+// trusted sync come out as one junk event. A candidate sync is trusted
+// when MP3_SYNC_CHAIN consecutive headers chain from it and agree on
+// version, layer and sampling rate.
+
+void
+mp3_iter_init(mp3_frame_iter *iter, mp3_source *source, uint64_t begin, uint64_t end)
+{
+    iter->source = source;
+    iter->pos = begin;
+    iter->data_end = end < source->size ? end : source->size;
+    iter->strict = 0;
+    iter->follow = 0;
+    iter->searched = 0;
+    iter->sync_search = mp3_sync_search_select(NULL, NULL);
+    iter->counters = source->counters;
+    iter->keep = begin;
+    iter->window_offset = 0;
+    iter->window_length = 0;
+}
+
+//streams learn where the audio ends when they hit the end of input
+static inline void
+mp3_iter_stream_end(mp3_frame_iter *iter)
+{
+    mp3_stream *stream = iter->source->stream;
+
+    if(stream && stream->eof &&
+        iter->data_end > stream->end - stream->trailer)
+        iter->data_end = stream->end - stream->trailer;
+}
+
+//bytes at offset, at least length of them; available is what follows
+static const uint8_t *
+mp3_iter_peek(mp3_frame_iter *iter, uint64_t offset, size_t length, size_t *available)
+{
+    mp3_source *source = iter->source;
+    uint64_t rest;
+    size_t window;
+
+    if(offset >= source->size || source->size - offset < length)
+        return NULL;
+    rest = source->size - offset;
+
+    if(source->stream) {
+        if(offset < source->stream->begin ||
+            mp3_stream_fill(source, offset < iter->keep ? offset : iter->keep, offset + length) ||
+            offset + length > source->stream->end)
+            return NULL;//dropped, error or end of input
+        *available = (size_t)(source->stream->end - offset);
+        return source->stream->buffer + (offset - source->stream->begin);
+    }
+
+    if(source->data) {
+        *available = rest > SIZE_MAX ? SIZE_MAX : (size_t)rest;
+        return source->data + offset;
+    }
+
+    if(offset < iter->window_offset ||
+        offset + length > iter->window_offset + iter->window_length) {
+        window = rest < MP3_SOURCE_WINDOW ? (size_t)rest : MP3_SOURCE_WINDOW;
+        if(source->read(source, offset, iter->window, window)) {
+            iter->window_length = 0;
+            return NULL;
+        }
+        iter->window_offset = offset;
+        iter->window_length = window;
+    }
+
+    *available = (size_t)(iter->window_offset + iter->window_length - offset);
+    return iter->window + (offset - iter->window_offset);
+}
+
+//4 header bytes without moving the window
+static int
+mp3_iter_read_header(mp3_frame_iter *iter, uint64_t offset, uint8_t *data)
+{
+    const uint8_t *buffer;
+    size_t available;
+
+    if(iter->source->stream) {
+        buffer = mp3_iter_peek(iter, offset, 4, &available);
+        if(!buffer)
+            return -1;
+        memcpy(data, buffer, 4);
+        return 0;
+    }
+    if(!iter->source->data &&
+        offset >= iter->window_offset &&
+        offset + 4 <= iter->window_offset + iter->window_length) {
+        memcpy(data, iter->window + (offset - iter->window_offset), 4);
+        return 0;
+    }
+    return mp3_source_copy(iter->source, offset, data, 4);
+}
+
+static int
+mp3_iter_chain_valid(mp3_frame_iter *iter, uint64_t pos)
+{
+    mp3_frame_header first;
+    mp3_frame_header header;
+    uint8_t data[4];
+    size_t frame_size;
+    uint32_t i;
+
+    memset(&first, 0, sizeof(first));
+
+    for(i = 0; i < MP3_SYNC_CHAIN; i++) {
+        if(pos >= iter->data_end)
+            return 1;//the chain ran into the end of the audio
+        if(iter->source->size - pos < 4 ||
+            mp3_iter_read_header(iter, pos, data)) {
+            mp3_iter_stream_end(iter);
+            return pos >= iter->data_end;
+        }
+        if(!mp3_header_valid(data, &header, &frame_size))
+            return 0;
+
+        if(i == 0)
+            first = header;
+        else if(header.version != first.version ||
+                header.layer != first.layer ||
+                header.sampling_frequency_index != first.sampling_frequency_index)
+            return 0;
+
+        pos += frame_size;
+    }
+
+    return 1;
+}
+
+int
+mp3_iter_resync(mp3_frame_iter *iter, uint64_t from, uint64_t limit, uint64_t *found)
+{
+    const uint8_t *data;
+    uint64_t pos = from;
+    uint64_t end;
+    size_t available;
+    size_t length;
+    size_t offset;
+
+    if(iter->counters)
+        iter->counters->resyncs++;
+
+    while(1) {
+        //streams find their end on the way
+        if(limit > iter->data_end)
+            limit = iter->data_end;
+        //a candidate needs its second byte
+        end = (limit < iter->source->size) ? limit + 1 : iter->source->size;
+        if(pos >= limit || end - pos < 2)
+            break;
+
+        iter->keep = pos;//junk is not kept
+        data = mp3_iter_peek(iter, pos, 2, &available);
+        if(!data) {
+            if(iter->source->stream && iter->source->stream->eof) {
+                mp3_iter_stream_end(iter);
+                continue;
+            }
+            return -1;
+        }
+        length = (end - pos < available) ? (size_t)(end - pos) : available;
+
+        offset = iter->sync_search(data, length);
+        if(offset == length) {
+            if(length == end - pos)
+                break;//searched to the end
+            pos += length - 1;//the last byte pairs with the next window
+            continue;
+        }
+        if(pos + offset >= limit)
+            break;
+        if(mp3_iter_chain_valid(iter, pos + offset)) {
+            *found = pos + offset;
+            return 0;
+        }
+        pos += offset + 1;
+    }
+
+    *found = limit < iter->data_end ? limit : iter->data_end;
+    return 0;
+}
+
+//frame length of a header of one version and layer, 0 for any other
+//header; the table row and the header compare are constants in each
+//instance
+template<uint32_t VERSION, uint32_t LAYER>
+static inline size_t
+mp3_frame_length(const uint8_t *data)
+{
+    const mp3_frame_info *row = mp3_frame_table[VERSION << 2 | LAYER];
+    const uint8_t byte1 = (uint8_t)(0xE0 | VERSION << 3 | LAYER << 1);
+
+    if(data[0] != 0xff ||
+        (data[1] & 0xFE) != byte1)
+        return 0;//other stream or broken header
+    return row[data[2] >> 1].length;
+}
+
+//mp3_header_valid() for one version and layer
+template<uint32_t VERSION, uint32_t LAYER>
+static inline int
+mp3_header_valid_as(const uint8_t *data, mp3_frame_header *header, size_t *frame_size)
+{
+    *frame_size = mp3_frame_length<VERSION, LAYER>(data);
+    if(*frame_size < 4)
+        return 0;
+
+    header->version = VERSION;
+    header->layer = LAYER;
+    header->protection_bit = (data[1] & 0x01);
+    header->bitrate_index = (data[2] & 0xF0) >> 4;
+    header->sampling_frequency_index = (data[2] & 0x0C) >> 2;
+    header->padding_bit = (data[2] & 0x02) >> 1;
+    header->private_bit = (data[2] & 0x01);
+    header->channel_mode = (data[3] & 0xc0) >> 6;
+    header->mode_extension = (data[3] & 0x30) >> 4;
+    header->copyright = (data[3] & 0x08) >> 3;
+    header->original = (data[3] & 0x04) >> 2;
+    header->emphasis = (data[3] & 0x03);
+    return 1;
+}
+
+//frames of one version and layer back to back in the window
+template<uint32_t VERSION, uint32_t LAYER>
+static uint64_t
+mp3_iter_walk(mp3_frame_iter *iter, const uint8_t *data, size_t available, uint64_t frames)
+{
+    uint64_t walked = 0;
+    size_t length;
+
+    while(walked < frames &&
+            iter->pos < iter->data_end &&
+            available >= 4) {
+        length = mp3_frame_length<VERSION, LAYER>(data);
+        if(length < 4)
+            break;
+
+        iter->pos += length;
+        walked++;
+        if(length >= available)
+            break;//refill
+        data += length;
+        available -= length;
+    }
+
+    return walked;
+}
+
+int
+mp3_iter_skip(mp3_frame_iter *iter, uint64_t frames, uint64_t *skipped)
+{
+    mp3_frame_event event;
+    const uint8_t *data;
+    size_t available;
+    uint64_t walked;
+    int result;
+
+    *skipped = 0;
+
+    while(*skipped < frames) {
+        walked = 0;
+        data = NULL;
+        if(!iter->source->stream &&
+            iter->pos < iter->data_end &&
+            iter->source->size - iter->pos >= 4)
+            data = mp3_iter_peek(iter, iter->pos, 4, &available);
+
+        if(data) {
+            switch((data[1] >> 1) & 0x0F) {
+            case 3 << 2 | 1://mpeg1 layer3
+                walked = mp3_iter_walk<3, 1>(iter, data, available, frames - *skipped);
+                break;
+            case 2 << 2 | 1://mpeg2 layer3
+                walked = mp3_iter_walk<2, 1>(iter, data, available, frames - *skipped);
+                break;
+            }
+        }
+        if(walked) {
+            *skipped += walked;
+            if(iter->counters)
+                iter->counters->frames += walked;
+            continue;
+        }
+
+        //anything else, junk and the end go the long way
+        result = mp3_iter_next(iter, &event);
+        if(result <= 0)
+            return result;
+        if(event.type == MP3_EVENT_FRAME)
+            (*skipped)++;
+    }
+
+    return 1;
+}
+
+int
+mp3_iter_refresh(mp3_frame_iter *iter)
+{
+    mp3_source *source = iter->source;
+#ifdef WIN32
+    struct _stati64 st;
+    if(source->read != mp3_source_read_fd || _fstati64(source->fd, &st))
+        return -1;
+#else
+    struct stat st;
+    if(source->read != mp3_source_read_fd || fstat(source->fd, &st))
+        return -1;
+#endif
+
+    if((uint64_t)st.st_size < source->size)
+        return -1;//truncated
+    if((uint64_t)st.st_size == source->size)
+        return 0;
+
+    //the window only holds bytes below the old size, which do not change
+    source->size = st.st_size;
+    iter->data_end = source->size;
+    return 1;
+}
+
+const uint8_t *
+mp3_iter_data(mp3_frame_iter *iter, uint64_t offset, size_t *available)
+{
+    return mp3_iter_peek(iter, offset, 1, available);
+}
+
+int
+mp3_iter_crc(mp3_frame_iter *iter, const mp3_frame_event *event, uint16_t *stored, uint16_t *computed)
+{
+    const uint8_t *data;
+    size_t available;
+    size_t side_info;
+
+    side_info = mp3_frame_crc_length(&event->header);
+    if(event->type != MP3_EVENT_FRAME || side_info == 0 ||
+        event->size < 6 + side_info)
+        return 2;
+    if(event->offset + 6 + side_info > iter->source->size)
+        return 2;//cut by the end of the input
+
+    data = mp3_iter_peek(iter, event->offset, 6 + side_info, &available);
+    if(!data)
+        return -1;
+
+    *stored = (uint16_t)(data[4] << 8 | data[5]);
+    *computed = mp3_frame_crc(data, side_info);
+    return *stored == *computed ? 0 : 1;
+}
+
+int
+mp3_iter_side_info(mp3_frame_iter *iter, const mp3_frame_event *event, mp3_side_info *info)
+{
+    const uint8_t *data;
+    size_t available;
+    size_t side_info;
+    size_t offset;
+
+    side_info = mp3_side_info_length(&event->header);
+    offset = event->header.protection_bit ? 4 : 6;
+    if(event->type != MP3_EVENT_FRAME || side_info == 0 ||
+        event->size < offset + side_info)
+        return 2;
+    if(event->offset + offset + side_info > iter->source->size)
+        return 2;//cut by the end of the input
+
+    data = mp3_iter_peek(iter, event->offset, offset + side_info, &available);
+    if(!data)
+        return -1;
+
+    return mp3_parse_side_info(&event->header, data + offset, side_info, info) ? 2 : 0;
+}
+
+int
+mp3_iter_next(mp3_frame_iter *iter, mp3_frame_event *event)
+{
+    const uint8_t *data;
+    size_t available;
+    size_t frame_size;
+    uint64_t limit;
+    uint64_t next;
+    int valid;
+
+    iter->keep = iter->pos;
+    if(iter->source->stream) {
+        //hold back enough to see the trailers before walking into them
+        if(mp3_stream_fill(iter->source, iter->pos, iter->pos + MP3_STREAM_HOLDBACK))
+            return -1;
+        mp3_iter_stream_end(iter);
+    }
+
+    if(iter->pos >= iter->data_end)
+        return 0;//end
+    if(iter->source->size - iter->pos < 4)
+        return iter->follow ? 0 : -1;//error, or the header is still being written
+
+    data = mp3_iter_peek(iter, iter->pos, 4, &available);
+    if(!data)
+        return -1;
+
+    event->offset = iter->pos;
+
+    //MPEG-1 and MPEG-2 Layer III through the specialized header check
+    switch((data[1] >> 1) & 0x0F) {
+    case 3 << 2 | 1://mpeg1 layer3
+        valid = mp3_header_valid_as<3, 1>(data, &event->header, &frame_size);
+        break;
+    case 2 << 2 | 1://mpeg2 layer3
+        valid = mp3_header_valid_as<2, 1>(data, &event->header, &frame_size);
+        break;
+    default:
+        valid = mp3_header_valid(data, &event->header, &frame_size);
+        break;
+    }
+
+    if(!valid) {
+        if(iter->strict)
+            return -2;//error
+
+        limit = iter->data_end;
+        if(iter->follow) {
+            //a sync is trusted only with its chain written
+            if(limit - iter->pos <= MP3_FOLLOW_HOLDBACK)
+                return 0;
+            limit -= MP3_FOLLOW_HOLDBACK;
+            if(iter->searched >= limit)
+                return 0;
+        }
+
+        if(mp3_iter_resync(iter, iter->searched > iter->pos ? iter->searched : iter->pos + 1, limit, &next))
+            return -1;
+        if(iter->follow && next >= limit) {
+            iter->searched = limit;//no sync yet, search on from here
+            return 0;
+        }
+        event->type = MP3_EVENT_JUNK;
+        event->size = next - iter->pos;
+        iter->pos = next;
+        if(iter->counters)
+            iter->counters->junk++;
+        return 1;
+    }
+
+    if(iter->follow && frame_size > iter->data_end - iter->pos)
+        return 0;//the rest of the frame is not written yet
+
+    memcpy(event->raw, data, 4);
+    event->type = MP3_EVENT_FRAME;
+    event->size = frame_size;
+    iter->pos += frame_size;
+    if(iter->counters)
+        iter->counters->frames++;
+    return 1;
+}
@@ -0,0 +1,387 @@
+// mp3scan.h : frame scanning library shared by the command line tools
+//
+// Copyright (c) 2010, Reiji Tokuda
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+// 
+// - Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+// IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+// EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef MP3SCAN_H
+#define MP3SCAN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#ifdef WIN32
+#include "stdint.h"
+#else
+#include <stdint.h>
+#endif
+
+///////////////////////////////////////
+
+#define MP3_SYNC_CHAIN 4// consecutive headers to trust a sync
+#define MP3_SOURCE_WINDOW (64 * 1024)// read ahead of fd and callback sources
+#define MP3_STREAM_BUFFER (256 * 1024)// pipe input buffer
+#define MP3_STREAM_HOLDBACK (64 * 1024)// read ahead of the walk, trailers up to this size are found
+#define MP3_FOLLOW_HOLDBACK (16 * 1024)// growing input: a sync chain after junk fits in this
+
+/**
+ * frame header
+ *
+ */
+typedef struct mp3_frame_header_tag {
+    uint8_t version;
+    uint8_t layer;
+    uint8_t protection_bit;
+    uint8_t bitrate_index;
+    uint8_t sampling_frequency_index;
+    uint8_t padding_bit;
+    uint8_t private_bit;
+    uint8_t channel_mode;
+    uint8_t mode_extension;
+    uint8_t copyright;
+    uint8_t original;
+    uint8_t emphasis;
+} mp3_frame_header;
+
+//[version][layer][value]
+extern const uint32_t bitrate_table[4][4][16];
+//[version][index]
+extern const uint32_t sampling_rate_table[4][4];
+//[channel mode]
+extern const uint32_t channel_table[4];
+
+/**
+ * frame length table
+ *
+ * Indexed by the version/layer bits of header byte 1 and the
+ * bitrate/sampling rate/padding bits of byte 2. length is 0 for
+ * reserved values and free format.
+ */
+typedef struct mp3_frame_info_tag {
+    uint16_t length;
+    uint16_t samples;
+} mp3_frame_info;
+
+const mp3_frame_info *
+mp3_frame_lookup(const uint8_t *data);
+
+void
+parse_mp3header(const uint8_t *data, mp3_frame_header *header);
+
+size_t
+mp3_frame_size(const mp3_frame_header *header);
+
+uint32_t
+mp3_samples_per_frame(const mp3_frame_header *header);
+
+//sync, known bitrate and sampling rate
+int
+mp3_header_valid(const uint8_t *data, mp3_frame_header *header, size_t *frame_size);
+
+/**
+ * CRC-16
+ *
+ * A frame with protection_bit 0 stores a CRC-16 (polynomial 0x8005,
+ * initial value 0xFFFF, MSB first) in the two bytes after its header.
+ * It covers header bytes 2 and 3 and the side info after the CRC. Only
+ * Layer III side info has a length known from the header alone; Layer
+ * I and II frames go unchecked.
+ */
+#define MP3_CRC_HEAD (6 + 32)// header, CRC and the longest side info
+
+uint16_t
+mp3_crc16(uint16_t crc, const uint8_t *data, size_t length);
+
+//Layer III side info bytes after the header and CRC, 0 for other layers
+size_t
+mp3_side_info_length(const mp3_frame_header *header);
+
+//side info bytes under the CRC, 0 for no CRC or an unchecked layer
+size_t
+mp3_frame_crc_length(const mp3_frame_header *header);
+
+//Layer III main_data_begin from the side info at data, the bytes of
+//the bit reservoir in frames before this one the frame's main data
+//starts with
+uint32_t
+mp3_main_data_begin(const mp3_frame_header *header, const uint8_t *data);
+
+//CRC of a frame from its first 6 + side_info bytes
+uint16_t
+mp3_frame_crc(const uint8_t *frame, size_t side_info);
+
+/**
+ * Layer III side info
+ *
+ * The fields of each granule and channel that tell how the main data
+ * is coded, without decoding it. MPEG-1 frames have two granules,
+ * MPEG-2/2.5 frames one. block_type and mixed_block are 0 when the
+ * granule does not switch windows.
+ */
+typedef struct mp3_granule_info_tag {
+    uint16_t part2_3_length;// bits of scale factors and Huffman data
+    uint16_t big_values;
+    uint16_t scalefac_compress;// 4 bits MPEG-1, 9 bits MPEG-2/2.5
+    uint8_t global_gain;
+    uint8_t window_switching;
+    uint8_t block_type;// 0:long 1:start 2:short 3:stop
+    uint8_t mixed_block;
+} mp3_granule_info;
+
+typedef struct mp3_side_info_tag {
+    uint16_t main_data_begin;
+    uint8_t granules;
+    uint8_t channels;
+    mp3_granule_info granule[2][2];// [granule][channel]
+} mp3_side_info;
+
+//side info at data, the bytes after the header and CRC: 0:ok
+//-2:not Layer III or shorter than mp3_side_info_length()
+int
+mp3_parse_side_info(const mp3_frame_header *header, const uint8_t *data, size_t length, mp3_side_info *info);
+
+/**
+ * Xing/Info/VBRI tag
+ *
+ * The first frame of most encodes is a Layer III frame without audio
+ * that carries a Xing/Info (LAME) tag right after the CRC and the side
+ * info, or a VBRI (Fraunhofer) tag 32 bytes after the header.
+ */
+typedef enum mp3_vbr_type_tag {
+    MP3_VBR_NONE = 0,
+    MP3_VBR_XING = 1,// LAME/Xing VBR
+    MP3_VBR_INFO = 2,// LAME/Xing CBR
+    MP3_VBR_VBRI = 3,// Fraunhofer
+} mp3_vbr_type;
+
+//tag of the frame at data, length of its bytes available; offset gets
+//where the tag id starts. MP3_VBR_NONE for other frames and layers
+mp3_vbr_type
+mp3_frame_vbr_tag(const mp3_frame_header *header, const uint8_t *data, size_t length, size_t *offset);
+
+/**
+ * sync word search
+ *
+ * Returns the offset of the first 0xFF followed by a byte with its top
+ * three bits set, or length when there is none.
+ */
+typedef size_t (*mp3_sync_search_func)(const uint8_t *data, size_t length);
+
+//name : "avx2", "sse2", "scalar" or NULL for the best one the CPU runs
+mp3_sync_search_func
+mp3_sync_search_select(const char *name, const char **selected);
+
+/**
+ * performance counters
+ *
+ * Sources and iterators count into the counters they point to. The
+ * pointer is NULL unless the caller sets it, which costs one branch per
+ * read or frame. Counters are not locked: each thread counts into its
+ * own set and the sets are added up afterwards.
+ *
+ * Phase times are monotonic nanoseconds. The caller times the whole
+ * walk as MP3_PHASE_SCAN; reads, output and writes happen inside it, and
+ * what is left is the header decode.
+ */
+typedef enum mp3_phase_tag {
+    MP3_PHASE_SCAN = 0,
+    MP3_PHASE_READ = 1,
+    MP3_PHASE_OUTPUT = 2,
+    MP3_PHASE_WRITE = 3,
+    MP3_PHASES = 4,
+} mp3_phase;
+
+typedef struct mp3_counters_tag {
+    uint64_t start;// mp3_counters_init() time, for the wall clock
+    uint64_t read_calls;
+    uint64_t bytes_read;
+    uint64_t write_calls;
+    uint64_t bytes_written;
+    uint64_t frames;// headers decoded or walked
+    uint64_t junk;// junk regions
+    uint64_t resyncs;// sync searches
+    uint64_t phase[MP3_PHASES];
+} mp3_counters;
+
+uint64_t
+mp3_clock_ns();
+
+void
+mp3_counters_init(mp3_counters *counters);
+
+void
+mp3_counters_add(mp3_counters *total, const mp3_counters *counters);
+
+void
+mp3_counters_print(const mp3_counters *counters, int json, FILE *out);
+
+//0 when counting is off
+static inline uint64_t
+mp3_counters_begin(const mp3_counters *counters)
+{
+    return counters ? mp3_clock_ns() : 0;
+}
+
+static inline void
+mp3_counters_end(mp3_counters *counters, mp3_phase phase, uint64_t begin)
+{
+    if(counters)
+        counters->phase[phase] += mp3_clock_ns() - begin;
+}
+
+/**
+ * byte source
+ *
+ * Memory and mmap sources set data and are read in place. Other sources
+ * set read, which must fill exactly length bytes and return 0, or -1.
+ *
+ * Stream sources read a pipe front to back through a fixed buffer. Their
+ * size is UINT64_MAX until the end of input has been read, and bytes
+ * before the frame an iterator stands on are dropped.
+ */
+typedef struct mp3_source_tag mp3_source;
+
+typedef struct mp3_stream_tag {
+    int fd;
+    uint64_t begin;// offset of buffer[0]
+    uint64_t end;// offset after the last byte read
+    uint64_t trailer;// ID3v1/APE bytes before end, known at eof
+    uint8_t eof;
+    uint8_t buffer[MP3_STREAM_BUFFER];
+} mp3_stream;
+
+typedef int (*mp3_source_read_func)(mp3_source *source, uint64_t offset, uint8_t *buffer, size_t length);
+
+struct mp3_source_tag {
+    const uint8_t *data;// whole content, NULL for read sources
+    uint64_t size;
+
+    mp3_source_read_func read;
+    void *opaque;// for caller supplied read functions
+
+    int fd;
+    uint8_t mapped;
+
+    mp3_stream *stream;// stream sources only
+
+    mp3_counters *counters;// NULL unless counting
+};
+
+int
+mp3_source_open_fd(mp3_source *source, int fd);
+#ifndef WIN32
+int
+mp3_source_open_mmap(mp3_source *source, int fd);
+#endif
+void
+mp3_source_open_memory(mp3_source *source, const uint8_t *data, size_t size);
+//stream is caller owned and must outlive the source
+void
+mp3_source_open_stream(mp3_source *source, mp3_stream *stream, int fd);
+void
+mp3_source_close(mp3_source *source);
+
+//audio between the ID3v2 tag and the APE/ID3v1 trailers; end is
+//UINT64_MAX for a stream, whose iterators find the end as they go
+int
+mp3_source_audio_region(mp3_source *source, uint64_t *begin, uint64_t *end);
+
+/**
+ * frame iterator
+ *
+ * mp3_iter_next() returns 1 with the next frame or junk region, 0 at the
+ * end of the region, -1 on an I/O error and -2 on a broken header in
+ * strict mode. The iterator owns no heap memory; it can live on the
+ * stack and one source can feed any number of iterators.
+ *
+ * With follow set the input is a file that is still being written: a
+ * frame cut at data_end, or junk without MP3_FOLLOW_HOLDBACK bytes after
+ * it, ends the walk with 0 and pos left on it. mp3_iter_refresh() takes
+ * the new size and the walk goes on from there.
+ */
+typedef enum mp3_event_type_tag {
+    MP3_EVENT_FRAME = 0,
+    MP3_EVENT_JUNK = 1,// bytes skipped up to the next trusted sync
+} mp3_event_type;
+
+typedef struct mp3_frame_event_tag {
+    mp3_event_type type;
+    uint64_t offset;
+    uint64_t size;// frame size, junk length for junk
+    mp3_frame_header header;
+    uint8_t raw[4];// header bytes as stored
+} mp3_frame_event;
+
+typedef struct mp3_frame_iter_tag {
+    mp3_source *source;
+    uint64_t pos;
+    uint64_t data_end;
+
+    uint8_t strict;// stop at the first broken header
+    uint8_t follow;// the input grows, see above
+    uint64_t searched;// follow: junk at pos has no sync before this
+    mp3_sync_search_func sync_search;
+    mp3_counters *counters;// the source's by default
+
+    uint64_t keep;// stream sources keep bytes from here on
+
+    uint64_t window_offset;
+    size_t window_length;
+    uint8_t window[MP3_SOURCE_WINDOW];
+} mp3_frame_iter;
+
+void
+mp3_iter_init(mp3_frame_iter *iter, mp3_source *source, uint64_t begin, uint64_t end);
+
+int
+mp3_iter_next(mp3_frame_iter *iter, mp3_frame_event *event);
+
+//first trusted sync in [from, limit), limit when there is none
+int
+mp3_iter_resync(mp3_frame_iter *iter, uint64_t from, uint64_t limit, uint64_t *found);
+
+//skip up to frames frames, junk is skipped silently; skipped counts the
+//frames passed. Returns 1 on success, 0 at the end, else as mp3_iter_next()
+int
+mp3_iter_skip(mp3_frame_iter *iter, uint64_t frames, uint64_t *skipped);
+
+//follow mode: the new size of a growing fd source becomes the end of
+//the region; 1 when it grew, 0 when not, -1 on an error or a truncation
+int
+mp3_iter_refresh(mp3_frame_iter *iter);
+
+//bytes at offset through the read ahead window, NULL past the end or on
+//an I/O error; valid until the next call on the iterator
+const uint8_t *
+mp3_iter_data(mp3_frame_iter *iter, uint64_t offset, size_t *available);
+
+//CRC of the frame at event: 0 when it matches, 1 when not, 2 when
+//there is none to check, -1 on an I/O error
+int
+mp3_iter_crc(mp3_frame_iter *iter, const mp3_frame_event *event, uint16_t *stored, uint16_t *computed);
+
+//side info of the frame at event: 0 when parsed, 2 when there is none
+//(not Layer III, or cut by the end of the input), -1 on an I/O error
+int
+mp3_iter_side_info(mp3_frame_iter *iter, const mp3_frame_event *event, mp3_side_info *info);
+
+#endif